@@ -0,0 +1,29 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_COMPILER_COMPAT_H
+#define LDGRAPHY_COMPILER_COMPAT_H
+
+// Shims for the older compilers we still build with.
+
+#if __GNUC__ == 4 && __GNUC_MINOR__ < 7
+// Default compiler on beaglebone black does not understand this one yet.
+#  define override
+#endif
+
+#endif  // LDGRAPHY_COMPILER_COMPAT_H
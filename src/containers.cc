@@ -0,0 +1,218 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "containers.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+static constexpr size_t kBufferAlignment = 64;
+
+// Tiles are at most this size, unless a single row is larger.
+static constexpr size_t kMaxTileBytes = 4 << 20;
+
+BitmapPool *BitmapPool::instance() {
+    static BitmapPool *const pool = new BitmapPool();
+    return pool;
+}
+
+BitmapPool::BitmapPool()
+    : in_use_(0), peak_(0), mapped_in_use_(0), allocated_(0),
+      memory_limit_((size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE)
+                    / 2),
+      spill_dir_(getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp") {
+}
+
+uint8_t *BitmapPool::Allocate(size_t bytes) {
+    bool zeroed;
+    std::lock_guard<std::mutex> l(mutex_);
+    return AllocateLocked(bytes, &zeroed);
+}
+
+uint8_t *BitmapPool::AllocateZeroed(size_t bytes) {
+    bool zeroed;
+    uint8_t *result;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        result = AllocateLocked(bytes, &zeroed);
+    }
+    if (!zeroed) bzero(result, bytes);
+    return result;
+}
+
+uint8_t *BitmapPool::AllocateLocked(size_t bytes, bool *zeroed) {
+    *zeroed = false;
+    allocated_ += bytes;
+    std::multimap<size_t, uint8_t*>::iterator found = cached_.find(bytes);
+    if (found != cached_.end()) {
+        uint8_t *const result = found->second;
+        cached_.erase(found);
+        in_use_ += bytes;
+        peak_ = std::max(peak_, in_use_);
+        return result;
+    }
+    TrimLocked();  // None of them fit, so don't hold on to them.
+    if (in_use_ + bytes > memory_limit_) {
+        uint8_t *const result = MapFromFile(bytes);
+        if (result) {
+            mapped_[result] = bytes;
+            mapped_in_use_ += bytes;
+            *zeroed = true;
+            return result;
+        }
+        // Otherwise, still try memory.
+    }
+    void *result = NULL;
+    if (posix_memalign(&result, kBufferAlignment, std::max(bytes, (size_t)1))) {
+        fprintf(stderr, "Out of memory allocating %zu bytes\n", bytes);
+        abort();
+    }
+    in_use_ += bytes;
+    peak_ = std::max(peak_, in_use_);
+    return (uint8_t*) result;
+}
+
+uint8_t *BitmapPool::MapFromFile(size_t bytes) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/ldgraphy-bitmap-XXXXXX", spill_dir_);
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    unlink(path);   // Disappears with the last mapping.
+    void *result = MAP_FAILED;
+    if (ftruncate(fd, std::max(bytes, (size_t)1)) == 0) {
+        result = mmap(NULL, std::max(bytes, (size_t)1), PROT_READ|PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    }
+    if (result == MAP_FAILED) perror("Mapping bitmap file");
+    close(fd);
+    return (result == MAP_FAILED) ? NULL : (uint8_t*) result;
+}
+
+void BitmapPool::Free(uint8_t *buffer, size_t bytes) {
+    std::lock_guard<std::mutex> l(mutex_);
+    std::map<uint8_t*, size_t>::iterator found = mapped_.find(buffer);
+    if (found != mapped_.end()) {
+        munmap(buffer, std::max(bytes, (size_t)1));
+        mapped_in_use_ -= bytes;
+        mapped_.erase(found);
+        return;
+    }
+    in_use_ -= bytes;
+    cached_.insert(std::make_pair(bytes, buffer));
+}
+
+void BitmapPool::SetMemoryLimit(size_t bytes) {
+    std::lock_guard<std::mutex> l(mutex_);
+    memory_limit_ = bytes;
+}
+
+void BitmapPool::SetSpillDirectory(const char *dir) {
+    std::lock_guard<std::mutex> l(mutex_);
+    spill_dir_ = dir;
+}
+
+void BitmapPool::Trim() {
+    std::lock_guard<std::mutex> l(mutex_);
+    TrimLocked();
+}
+
+void BitmapPool::TrimLocked() {
+    for (auto &it : cached_) free(it.second);
+    cached_.clear();
+}
+
+size_t BitmapPool::bytes_in_use() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return in_use_;
+}
+
+size_t BitmapPool::peak_bytes_in_use() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return peak_;
+}
+
+size_t BitmapPool::mapped_bytes_in_use() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return mapped_in_use_;
+}
+
+size_t BitmapPool::bytes_allocated() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return allocated_;
+}
+
+void BitmapPool::ResetPeak() {
+    std::lock_guard<std::mutex> l(mutex_);
+    peak_ = in_use_;
+}
+
+RowTiles::RowTiles(size_t row_bytes, int rows)
+    : row_bytes_(row_bytes), rows_(rows), tile_shift_(3) {
+    while (tile_shift_ < 30 && ((int64_t)1 << (tile_shift_ + 1)) < rows_
+           && (row_bytes_ << (tile_shift_ + 1)) <= kMaxTileBytes) {
+        ++tile_shift_;
+    }
+    tile_mask_ = (1 << tile_shift_) - 1;
+    const int count = (rows_ + tile_mask_) >> tile_shift_;
+    for (int t = 0; t < count; ++t)
+        tiles_.push_back(BitmapPool::instance()->AllocateZeroed(tile_bytes(t)));
+}
+
+RowTiles::RowTiles(const RowTiles &other)
+    : row_bytes_(other.row_bytes_), rows_(other.rows_),
+      tile_shift_(other.tile_shift_), tile_mask_(other.tile_mask_) {
+    for (int t = 0; t < other.tile_count(); ++t) {
+        tiles_.push_back(BitmapPool::instance()->Allocate(tile_bytes(t)));
+        memcpy(tiles_[t], other.tiles_[t], tile_bytes(t));
+    }
+}
+
+RowTiles::RowTiles(RowTiles &&other)
+    : row_bytes_(other.row_bytes_), rows_(other.rows_),
+      tile_shift_(other.tile_shift_), tile_mask_(other.tile_mask_),
+      tiles_(std::move(other.tiles_)) {
+    other.rows_ = 0;
+    other.tiles_.clear();
+}
+
+RowTiles::~RowTiles() {
+    Release();
+}
+
+RowTiles &RowTiles::operator=(RowTiles &&other) {
+    std::swap(row_bytes_, other.row_bytes_);
+    std::swap(rows_, other.rows_);
+    std::swap(tile_shift_, other.tile_shift_);
+    std::swap(tile_mask_, other.tile_mask_);
+    tiles_.swap(other.tiles_);
+    return *this;
+}
+
+void RowTiles::Release() {
+    for (int t = 0; t < tile_count(); ++t)
+        BitmapPool::instance()->Free(tiles_[t], tile_bytes(t));
+    tiles_.clear();
+}
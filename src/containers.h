@@ -19,41 +19,126 @@
 #ifndef LDGRAPHY_CONTAINERS_H
 #define LDGRAPHY_CONTAINERS_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 
-class BitArray {
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Provider of 64-byte (cache-line) aligned buffers for bitmaps.
+//
+// Image processing stages tend to allocate and release buffers of the same
+// size over and over (rotating an image several times, re-running SetImage()
+// in a focus loop). A released buffer is kept and handed out again for the
+// next request of the same size. Cached buffers that don't match are released
+// before a new allocation, so they never add to the peak memory.
+//
+// Also keeps track of the bytes in use, so that we can report the peak memory
+// needed for processing an image.
+//
+// If memory in use would exceed the memory limit, buffers are instead mapped
+// from unlinked temporary files, so that the kernel can page them out; this
+// allows images larger than RAM.
+class BitmapPool {
 public:
-    explicit BitArray(size_t size)
-        : size_(size), buffer_(new uint8_t[(size_+7)/8]) {
-        Clear();
+    static BitmapPool *instance();
+
+    // Buffer with undefined content.
+    uint8_t *Allocate(size_t bytes);
+    // Buffer with all zero bytes. Cheaper than Allocate() and clearing, as
+    // a buffer mapped from a file is zero already.
+    uint8_t *AllocateZeroed(size_t bytes);
+    void Free(uint8_t *buffer, size_t bytes);
+
+    // Release all cached buffers.
+    void Trim();
+
+    // Bytes of memory to use before falling back to file mapped buffers.
+    // Default is half the physical memory.
+    void SetMemoryLimit(size_t bytes);
+
+    // Directory for the temporary files. Default is $TMPDIR or /var/tmp,
+    // as /tmp is often in memory. The string is not copied.
+    void SetSpillDirectory(const char *dir);
+
+    size_t bytes_in_use() const;        // Memory only
+    size_t peak_bytes_in_use() const;
+    size_t mapped_bytes_in_use() const;
+    size_t bytes_allocated() const;     // All allocations ever, for profiling.
+    void ResetPeak();   // Start new peak measurement from current use.
+
+private:
+    BitmapPool();
+
+    uint8_t *AllocateLocked(size_t bytes, bool *zeroed);
+    uint8_t *MapFromFile(size_t bytes);
+    void TrimLocked();
+
+    mutable std::mutex mutex_;
+    std::multimap<size_t, uint8_t*> cached_;
+    std::map<uint8_t*, size_t> mapped_;  // File mapped buffers in use.
+    size_t in_use_;
+    size_t peak_;
+    size_t mapped_in_use_;
+    size_t allocated_;
+    size_t memory_limit_;
+    const char *spill_dir_;
+};
+
+// Rows of bytes, stored in tiles of a power-of-two number of rows, each
+// tile allocated separately from the BitmapPool. So no single allocation gets
+// huge, and tiles can be file mapped if memory is short. Sizes and offsets
+// are 64 bit; only the number of rows is limited to int.
+//
+// Within a tile, rows are consecutive in memory; code that processes whole
+// blocks of rows works tile by tile.
+class RowTiles {
+public:
+    // All bytes are zero initially.
+    RowTiles(size_t row_bytes, int rows);
+    RowTiles(const RowTiles &other);
+    RowTiles(RowTiles &&other);
+    ~RowTiles();
+
+    // Exchange storage; the old one is released with "other".
+    RowTiles &operator=(RowTiles &&other);
+
+    uint8_t *row(int r) {
+        return tiles_[r >> tile_shift_] + (r & tile_mask_) * row_bytes_;
     }
-    BitArray(const BitArray &other)
-        : size_(other.size_), buffer_(new uint8_t[(size_+7)/8]) {
-        memcpy(buffer_, other.buffer_, (size_+7)/8);
+    const uint8_t *row(int r) const {
+        return tiles_[r >> tile_shift_] + (r & tile_mask_) * row_bytes_;
     }
-    ~BitArray() { delete [] buffer_; }
 
-    void Clear() {  bzero(buffer_, (size_+7)/8); }
+    int rows() const { return rows_; }
+    size_t row_bytes() const { return row_bytes_; }
+    size_t size_bytes() const { return row_bytes_ * rows_; }
 
-    inline void Set(int bit, bool value) {
-        if (bit < 0 || bit >= size_) return;
-        if (value)
-            buffer_[bit / 8] |= 1 << (7 - bit % 8);
-        else
-            buffer_[bit / 8] &= ~(1 << (7 - bit % 8));
+    int tile_count() const { return tiles_.size(); }
+    int tile_rows() const { return tile_mask_ + 1; }
+    // Number of rows starting at "r" that are consecutive in memory.
+    int rows_in_tile(int r) const {
+        return std::min(tile_rows() - (r & tile_mask_), rows_ - r);
     }
-    inline bool Get(int bit) const {
-        return buffer_[bit / 8] & (1 << (7 - bit % 8));
+    uint8_t *tile(int t) { return tiles_[t]; }
+    const uint8_t *tile(int t) const { return tiles_[t]; }
+    size_t tile_bytes(int t) const {
+        return rows_in_tile(t << tile_shift_) * row_bytes_;
     }
 
-    uint8_t *buffer() { return buffer_; }
-    int size_bits() const { return size_; }
-
 private:
-    const int size_;
-    uint8_t *const buffer_;
+    void Release();
+
+    size_t row_bytes_;
+    int rows_;
+    int tile_shift_;
+    int tile_mask_;
+    std::vector<uint8_t*> tiles_;
 };
 
 
@@ -0,0 +1,239 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "http-util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Limit for request line and headers; we don't expect anything fancy.
+static constexpr size_t kMaxHeaderBytes = 8192;
+
+// A machine only replies to an upload once the image is decoded.
+static constexpr int kClientTimeoutSeconds = 120;
+
+int ListenLocalhost(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket()");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // Local only.
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(fd, 4) < 0) {
+        perror("Listening for jobs");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool SendAll(int fd, const char *data, size_t len, int flags) {
+    while (len > 0) {
+        const ssize_t w = send(fd, data, len, flags | MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+void SendResponse(int fd, const char *status, const char *body) {
+    char header[256];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\nContent-Type: application/json\r\n"
+             "Content-Length: %d\r\nConnection: close\r\n\r\n",
+             status, (int)strlen(body));
+    SendAll(fd, header, strlen(header)) && SendAll(fd, body, strlen(body));
+}
+
+bool ReadMore(int fd, std::string *buffer) {
+    char buf[65536];
+    ssize_t r;
+    do {
+        r = read(fd, buf, sizeof(buf));
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) return false;
+    buffer->append(buf, r);
+    return true;
+}
+
+bool ReadLine(int fd, std::string *buffer, std::string *line) {
+    for (;;) {
+        const size_t eol = buffer->find("\r\n");
+        if (eol != std::string::npos) {
+            line->assign(*buffer, 0, eol);
+            buffer->erase(0, eol + 2);
+            return true;
+        }
+        if (buffer->size() > kMaxHeaderBytes || !ReadMore(fd, buffer))
+            return false;
+    }
+}
+
+bool ReadRequestHeader(int fd, std::string *pending,
+                       HttpRequestHeader *header) {
+    char method[16] = {}, path[256] = {};
+    std::string line;
+    if (!ReadLine(fd, pending, &line)
+        || sscanf(line.c_str(), "%15s %255s", method, path) != 2) {
+        return false;
+    }
+    header->method = method;
+    header->path = path;
+    header->query.clear();
+    const size_t query_start = header->path.find('?');
+    if (query_start != std::string::npos) {
+        header->query = header->path.substr(query_start + 1);
+        header->path.resize(query_start);
+    }
+    header->content_length = -1;
+    header->chunked = false;
+    while (ReadLine(fd, pending, &line)) {
+        if (line.empty())
+            return true;
+        if (strncasecmp(line.c_str(), "Content-Length:", 15) == 0)
+            header->content_length = atol(line.c_str() + 15);
+        else if (strncasecmp(line.c_str(), "Transfer-Encoding:", 18) == 0)
+            header->chunked = (strcasestr(line.c_str() + 18, "chunked") != NULL);
+    }
+    return false;   // Connection went away.
+}
+
+bool ReadRequestBody(int fd, const HttpRequestHeader &header,
+                     std::string *pending,
+                     const std::function<bool(const char *, size_t)> &consumer) {
+    bool success = true;
+    long received = 0;
+    auto forward = [&](size_t len) {
+        success = consumer(pending->data(), len);
+        pending->erase(0, len);
+        received += len;
+    };
+
+    if (header.chunked) {
+        std::string line;
+        while (success && ReadLine(fd, pending, &line)) {
+            long chunk_size = strtol(line.c_str(), NULL, 16);
+            if (chunk_size == 0) {
+                while (ReadLine(fd, pending, &line) && !line.empty()) {}
+                return success;   // Ignoring trailers.
+            }
+            while (success && chunk_size > 0) {
+                if (pending->empty() && !ReadMore(fd, pending)) break;
+                const size_t n = std::min<size_t>(chunk_size, pending->size());
+                forward(n);
+                chunk_size -= n;
+            }
+            if (chunk_size > 0 || !ReadLine(fd, pending, &line)) break;
+        }
+        return false;
+    }
+
+    while (success && received < header.content_length) {
+        if (pending->empty() && !ReadMore(fd, pending)) break;
+        forward(std::min<size_t>(header.content_length - received,
+                                 pending->size()));
+    }
+    return success && received == header.content_length;
+}
+
+static int ConnectTo(const char *host, int port) {
+    struct addrinfo hints, *addresses;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &addresses) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        struct timeval timeout = { kClientTimeoutSeconds, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+int HttpRequest(const char *host, int port, const char *method,
+                const char *path, const std::string &body,
+                std::string *response_body) {
+    const int fd = ConnectTo(host, port);
+    if (fd < 0) return -1;
+    char header[512];
+    snprintf(header, sizeof(header),
+             "%s %s HTTP/1.1\r\nHost: %s:%d\r\nContent-Length: %d\r\n"
+             "Connection: close\r\n\r\n",
+             method, path, host, port, (int)body.size());
+    if (!SendAll(fd, header, strlen(header))
+        || !SendAll(fd, body.data(), body.size())) {
+        close(fd);
+        return -1;
+    }
+
+    // Replies have Connection: close, so everything up to the end of stream.
+    std::string response;
+    while (ReadMore(fd, &response)) {}
+    close(fd);
+    int status;
+    const size_t body_start = response.find("\r\n\r\n");
+    if (body_start == std::string::npos
+        || sscanf(response.c_str(), "HTTP/%*s %d", &status) != 1) {
+        return -1;
+    }
+    response_body->assign(response, body_start + 4, std::string::npos);
+    return status;
+}
+
+uint64_t HashContent(const char *data, size_t len, uint64_t hash) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,77 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_HTTP_UTIL_H
+#define LDGRAPHY_HTTP_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+// Just enough HTTP/1.1 for the job server and the job dispatcher talking
+// to each other: one request per connection.
+
+// Listen on localhost with the given port. Returns the socket or -1 and
+// prints a message on failure.
+int ListenLocalhost(int port);
+
+bool SendAll(int fd, const char *data, size_t len, int flags = 0);
+
+// Send complete response with the JSON "body".
+void SendResponse(int fd, const char *status, const char *body);
+
+// Read more data from socket and append to "buffer". Returns false on
+// end of stream or error.
+bool ReadMore(int fd, std::string *buffer);
+
+// Read a CRLF terminated line; remaining data is left in "buffer".
+bool ReadLine(int fd, std::string *buffer, std::string *line);
+
+struct HttpRequestHeader {
+    std::string method;
+    std::string path;          // Without query.
+    std::string query;         // After '?', if any.
+    long content_length;       // -1 if not given.
+    bool chunked;
+};
+
+// Read request line and headers. Data read beyond is left in "pending".
+bool ReadRequestHeader(int fd, std::string *pending, HttpRequestHeader *header);
+
+// Read the body of a request and pass it to "consumer" as it arrives; data
+// already read is in "pending". Returns true if the body is complete and the
+// consumer accepted all of it; the consumer returns false to stop.
+bool ReadRequestBody(int fd, const HttpRequestHeader &header,
+                     std::string *pending,
+                     const std::function<bool(const char *, size_t)> &consumer);
+
+// Send a request with optional body to "host" and wait for the response.
+// Returns the HTTP status code and the response body, or -1 if the request
+// could not be done.
+int HttpRequest(const char *host, int port, const char *method,
+                const char *path, const std::string &body,
+                std::string *response_body);
+
+// Identifies uploaded content; FNV-1a, can be fed in pieces.
+static constexpr uint64_t kInitialContentHash = 0xcbf29ce484222325ULL;
+uint64_t HashContent(const char *data, size_t len,
+                     uint64_t hash = kInitialContentHash);
+
+#endif  // LDGRAPHY_HTTP_UTIL_H
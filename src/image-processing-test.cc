@@ -0,0 +1,106 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the gathering of placed images against the plain ImageTransform::Map()
+// of each pixel. Run with 'make test'; exit code is non-zero on failure.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "image-processing.h"
+
+// Compare GatherRotatedRows() with sampling each pixel at Map(). Returns
+// number of differing pixels.
+static int CheckGather(const char *name, const BitmapImage &img,
+                       const ImageTransform &placement) {
+    // One column per placed row, with varying offsets, some out of range.
+    const int columns = placement.height() + 3;
+    std::vector<int> column_source_row(columns), column_x_offset(columns);
+    for (int c = 0; c < columns; ++c) {
+        column_source_row[c] = (c % 17 == 5) ? -1 : c;
+        column_x_offset[c] = (c * 7) % 23 - 11;
+    }
+    const int rows = placement.width() + 10;
+    const int stride = (columns + 7) / 8;
+    std::vector<uint8_t> out(rows * stride);
+    GatherRotatedRows(img, placement, column_source_row, column_x_offset,
+                      0, rows, out.data(), stride);
+
+    int errors = 0;
+    for (int c = 0; c < columns; ++c) {
+        for (int r = 0; r < rows; ++r) {
+            bool expected = false;
+            const int row = column_source_row[c];
+            if (row >= 0 && row < placement.height()) {
+                double sx, sy;
+                placement.Map(r + column_x_offset[c], row, &sx, &sy);
+                const int x = floor(sx), y = floor(sy);
+                expected = (x >= 0 && x < img.width()
+                            && y >= 0 && y < img.height() && img.Get(x, y));
+            }
+            const bool got = out[r * stride + c / 8] & (0x80 >> (c % 8));
+            if (got != expected && errors++ == 0) {
+                fprintf(stderr, "%s: column %d, row %d: expected %d\n",
+                        name, c, r, expected);
+            }
+        }
+    }
+    return errors;
+}
+
+int main() {
+    BitmapImage img(223, 100);
+    srand(42);
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x)
+            img.Set(x, y, rand() % 2);
+    }
+
+    struct {
+        float angle;
+        bool mirror;
+        float mm_x, mm_y;
+    } const kTransforms[] = {
+        { 0, false, 0.01, 0.01 },
+        { 90, true, 0.01, 0.02 },
+        { 270, false, 0.03, 0.01 },
+        { 144.37, true, 0.0254, 0.0127 },
+        { 144.37, false, 0.0127, 0.0254 },
+        { 33.3, true, 0.01, 0.01 },
+        { -7.5, false, 0.02, 0.015 },
+    };
+    int failures = 0;
+    for (const auto &t : kTransforms) {
+        char name[64];
+        snprintf(name, sizeof(name), "%.2f°%s %.4fx%.4fmm", t.angle,
+                 t.mirror ? " mirrored" : "", t.mm_x, t.mm_y);
+        const ImageTransform placement(img.width(), img.height(), t.angle,
+                                       t.mirror, t.mm_x, t.mm_y);
+        const int errors = CheckGather(name, img, placement);
+        if (errors) {
+            fprintf(stderr, "%s: %d pixels differ from Map()\n", name, errors);
+            ++failures;
+        }
+    }
+    if (failures == 0) fprintf(stderr, "All gather checks passed.\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -20,38 +20,129 @@
 #include "image-processing.h"
 #include <png.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 
-#include <functional>
+#include <algorithm>
+#include <thread>
+
+#include "metrics.h"
+#include "morphology.h"
 
 void BitmapImage::ToPBM(FILE *file) const {
     fprintf(file, "P4\n%d %d\n", width_, height_);
-    fwrite(bits_->buffer(), 1, width_ * height_ / 8, file);
+    for (int t = 0; t < bits_.tile_count(); ++t)
+        fwrite(bits_.tile(t), 1, bits_.tile_bytes(t), file);
     fclose(file);
 }
 
 bool BitmapImage::CopyFrom(const BitmapImage &other) {
     if (other.width_ != width_ || other.height_ != height_) return false;
-    memcpy(bits_->buffer(), other.bits_->buffer(), bits_->size_bits() / 8);
+    // Same size, so same tiling.
+    for (int t = 0; t < bits_.tile_count(); ++t)
+        memcpy(bits_.tile(t), other.bits_.tile(t), bits_.tile_bytes(t));
+    occupancy_ = other.occupancy_;
+    tile_row_indexed_ = other.tile_row_indexed_;
     return true;
 }
 
-BitmapImage *LoadPNGImage(const char *filename, bool invert, double *dpi) {
-    //  More or less textbook libpng tutorial.
+void BitmapImage::IndexOccupancy(int tile_row) {
+    constexpr int kTileBytes = kOccupancyTile / 8;
+    const int tiles_x = (width_ + kOccupancyTile - 1) / kOccupancyTile;
+    const int tiles_y = (height_ + kOccupancyTile - 1) / kOccupancyTile;
+    if (tile_row_indexed_.empty()) {
+        occupancy_.assign(tiles_x * tiles_y, MIXED);
+        tile_row_indexed_.assign(tiles_y, false);
+    }
+
+    // Per tile, OR and AND of all its 64 bit words. The last tile can be
+    // narrower; its missing bytes count as set for the AND.
+    const int row_bytes = width_ / 8;
+    const int last_bytes = row_bytes - (tiles_x - 1) * kTileBytes;
+    uint64_t last_padding = 0;
+    memset((uint8_t*)&last_padding + last_bytes, 0xff,
+           sizeof(last_padding) - last_bytes);
+    std::vector<uint64_t> any_set(tiles_x, 0);
+    std::vector<uint64_t> all_set(tiles_x, ~0ULL);
+    const int last_row = std::min(height_, (tile_row + 1) * kOccupancyTile);
+    for (int y = tile_row * kOccupancyTile; y < last_row; ++y) {
+        const uint8_t *const row = bits_.row(y);
+        for (int t = 0; t < tiles_x - 1; ++t) {
+            uint64_t word;
+            memcpy(&word, row + t * kTileBytes, sizeof(word));
+            any_set[t] |= word;
+            all_set[t] &= word;
+        }
+        uint64_t word = 0;
+        memcpy(&word, row + (tiles_x - 1) * kTileBytes, last_bytes);
+        any_set[tiles_x - 1] |= word;
+        all_set[tiles_x - 1] &= word | last_padding;
+    }
+    for (int t = 0; t < tiles_x; ++t) {
+        occupancy_[tile_row * tiles_x + t] = (any_set[t] == 0 ? EMPTY
+                                              : all_set[t] == ~0ULL ? FULL
+                                              : MIXED);
+    }
+    tile_row_indexed_[tile_row] = true;
+}
+
+void BitmapImage::IndexOccupancy() {
+    const int tiles_y = (height_ + kOccupancyTile - 1) / kOccupancyTile;
+    for (int t = 0; t < tiles_y; ++t) {
+        if (tile_row_indexed_.empty() || !tile_row_indexed_[t])
+            IndexOccupancy(t);
+    }
+}
+
+BitmapImage::Occupancy BitmapImage::GetOccupancy(int x0, int y0,
+                                                 int x1, int y1) const {
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, width_);
+    y1 = std::min(y1, height_);
+    if (x0 >= x1 || y0 >= y1) return EMPTY;
+    if (tile_row_indexed_.empty()) return MIXED;
+    const int tiles_x = (width_ + kOccupancyTile - 1) / kOccupancyTile;
+    bool empty = true, full = true;
+    for (int ty = y0 / kOccupancyTile; ty <= (y1 - 1) / kOccupancyTile; ++ty) {
+        if (!tile_row_indexed_[ty]) return MIXED;
+        for (int tx = x0 / kOccupancyTile; tx <= (x1 - 1) / kOccupancyTile;
+             ++tx) {
+            const uint8_t o = occupancy_[ty * tiles_x + tx];
+            if (o == MIXED) return MIXED;
+            empty &= (o == EMPTY);
+            full &= (o == FULL);
+        }
+    }
+    return empty ? EMPTY : (full ? FULL : MIXED);
+}
+
+BitmapImage *LoadPNGImage(const char *filename, bool invert,
+                          double *dpi_x, double *dpi_y) {
     FILE *fp = fopen(filename, "r");
     if (!fp) {
         perror("Opening image");
         return NULL;
     }
-    const png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+    BitmapImage *result = ReadPNGImage(fp, filename, invert, dpi_x, dpi_y);
+    fclose(fp);
+    return result;
+}
+
+BitmapImage *ReadPNGImage(FILE *fp, const char *name, bool invert,
+                          double *dpi_x, double *dpi_y) {
+    ScopedStageTimer timer(Metrics::STAGE_DECODE);
+    //  More or less textbook libpng tutorial.
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
                                                    NULL, NULL, NULL);
     if (!png) return NULL;
 
-    const png_infop info = png_create_info_struct(png);
+    png_infop info = png_create_info_struct(png);
     if (!info) return NULL;
 
     if (setjmp(png_jmpbuf(png))) {
-        fprintf(stderr, "Issue reading %s\n", filename);
+        fprintf(stderr, "Issue reading %s\n", name);
+        png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
 
@@ -88,7 +179,9 @@ BitmapImage *LoadPNGImage(const char *filename, bool invert, double *dpi) {
     png_uint_32 res_x = 0, res_y = 0;
     int unit;
     png_get_pHYs(png, info, &res_x, &res_y, &unit);
-    *dpi = (unit == PNG_RESOLUTION_METER) ? res_x / (1000 / 25.4) : res_x;
+    const double to_dpi = (unit == PNG_RESOLUTION_METER) ? 1000 / 25.4 : 1;
+    *dpi_x = res_x / to_dpi;
+    *dpi_y = res_y / to_dpi;
 
     png_read_update_info(png, info);
 
@@ -104,7 +197,7 @@ BitmapImage *LoadPNGImage(const char *filename, bool invert, double *dpi) {
     // we allocate potential free space beyond what png would write.
     png_byte *const row_data = new png_byte[bytes_per_pixel * result->width()]();
 
-    //fprintf(stderr, "Reading %dx%d image (res=%.f).\n", width, height, *dpi);
+    //fprintf(stderr, "Reading %dx%d image (res=%.f).\n", width, height, *dpi_x);
     for (int y = 0; y < height; ++y) {
         png_read_row(png, row_data, NULL);
         png_byte *from_pixel = row_data;
@@ -121,63 +214,19 @@ BitmapImage *LoadPNGImage(const char *filename, bool invert, double *dpi) {
             if (invert) *to_byte = ~*to_byte;
             to_byte += 1;
         }
+        // The rounded up rows at the end are in the last row of tiles.
+        if ((y + 1) % BitmapImage::kOccupancyTile == 0 || y == height - 1)
+            result->IndexOccupancy(y / BitmapImage::kOccupancyTile);
     }
 
     delete [] row_data;
 
-    fclose(fp);
+    png_destroy_read_struct(&png, &info, NULL);
     return result;
 }
 
-static void ThinOneDimension(int radius, int max,
-                             std::function<bool (int pos)> get_at,
-                             std::function<void (int pos, bool)> set_at) {
-    // For debugging: choose a value != 0, so that we can see the effect
-    // of the adjustment in a ToPGM() output, but low enough that it gets cut
-    // off when converting to bitmap.
-    for (int pos = 0; pos < max; /**/) {
-        while (pos < max && get_at(pos) == 0)
-            ++pos;  // skip 'blackspace'.
-        int start_on = pos;
-        while (pos < max && get_at(pos) != 0)
-            ++pos;
-        int end_on = pos;
-        if (end_on - start_on <= 2*radius) {
-            // Less than radius; erase all and keep single middle pixel.
-            for (int i = start_on; i < end_on; ++i)
-                set_at(i, false);
-            if (start_on < max)
-                set_at((start_on + end_on) / 2, true);
-        } else {
-            for (int i = start_on; i < start_on + radius && i < max; ++i)
-                set_at(i, false);
-            for (int i = end_on - radius; i < end_on; ++i)
-                set_at(i, false);
-        }
-    }
-}
-
-// (very simplistic for now, adjusting each direction separately.). Essentially
-// erosion, but keep the last bit.
-// TODO: this can use some optimization with a kernel; also: speed.
 void ThinImageStructures(BitmapImage *img, int x_radius, int y_radius) {
-    BitmapImage res(*img);
-    //fprintf(stderr, "Thin pixel structure by %dx%d\n", x_radius, y_radius);
-    if (x_radius) {
-        for (int y = 0; y < img->height(); ++y) {
-            ThinOneDimension(x_radius, img->width(),
-                             [y, img](int p) -> bool { return img->Get(p, y); },
-                             [y, &res](int p, bool v) { res.Set(p, y, v); });
-        }
-    }
-    if (y_radius) {
-        for (int x = 0; x < img->width(); ++x) {
-            ThinOneDimension(y_radius, img->height(),
-                             [x, img](int p) -> bool { return img->Get(x, p); },
-                             [x, &res](int p, bool v) { res.Set(x, p, v); });
-        }
-    }
-    img->CopyFrom(res);
+    ThinImage(img, EllipticalKernel(x_radius, y_radius));
 }
 
 BitmapImage *CreateThinningTestChart(float mm_per_pixel, float line_width_mm,
@@ -199,15 +248,17 @@ BitmapImage *CreateThinningTestChart(float mm_per_pixel, float line_width_mm,
     }
     fprintf(stderr, "\nChart squares:");
     float dia_mm = start_diameter;
+    BitmapImage chart(chart_template.width(), chart_template.height());
     for (int i = 0; i < count; ++i) {
-        BitmapImage chart(chart_template);
+        chart.CopyFrom(chart_template);
         int thin_radius = dia_mm * pixel_per_mm / 2;
         fprintf(stderr, "[%.3fmm] ", dia_mm);
         ThinImageStructures(&chart, thin_radius, thin_radius);
-        for (int y = 0; y < chart.height(); ++y)
-            for (int x = 0; x < chart.width(); ++x)
-                result->Set(x, result->height() - 1 - y - i * chart_square_pixels,
-                            chart.Get(x, y));
+        for (int y = 0; y < chart.height(); ++y) {
+            memcpy(result->GetMutableRow(result->height() - 1 - y
+                                         - i * chart_square_pixels),
+                   chart.GetRow(y), chart.width() / 8);
+        }
         dia_mm += step;
     }
     fprintf(stderr, "\n\n");
@@ -238,17 +289,461 @@ static void transpose8(const uint8_t *in, int m,
     out[3*n]=y>>24;  out[2*n]=y>>16;  out[1*n]=y>>8;  out[0*n]=y;
 }
 
-BitmapImage *CreateRotatedImage(const BitmapImage &img) {
-    BitmapImage *const result = new BitmapImage(img.height(), img.width());
-    const int in_stride = img.width() / 8;
-    const int out_stride = result->width() / 8;
-    for (int y = 0; y < img.height(); y+=8) {
-        const uint8_t *in_row = img.GetRow(y);
-        for (int x = 0; x < img.width(); x+=8) {
-            uint8_t *out_row = result->GetMutableRow(result->height()-x-8)+y/8;
-            transpose8(in_row, in_stride, out_row, out_stride);
-            in_row++;
+ImageTransform::ImageTransform(int source_width, int source_height,
+                               float rotate_degrees, bool mirror,
+                               float mm_per_pixel_x, float mm_per_pixel_y) {
+    double angle = fmod(rotate_degrees, 360.0);
+    if (angle < 0) angle += 360;
+    double c, s;
+    if (fmod(angle, 90.0) == 0) {
+        // Exact for quarter turns, so that no pixel is sampled twice.
+        static const int kCos[] = { 1, 0, -1, 0 };
+        const int quarter = angle / 90;
+        c = kCos[quarter];
+        s = kCos[(quarter + 3) % 4];
+    } else {
+        c = cos(angle * M_PI / 180);
+        s = sin(angle * M_PI / 180);
+    }
+    identity_ = (angle == 0 && !mirror);
+    quarter_turn_ = (fmod(angle, 90.0) == 0);
+    if (s == 0) {
+        mm_per_pixel_x_ = mm_per_pixel_x;
+        mm_per_pixel_y_ = mm_per_pixel_y;
+    } else if (c == 0) {
+        mm_per_pixel_x_ = mm_per_pixel_y;
+        mm_per_pixel_y_ = mm_per_pixel_x;
+    } else {
+        mm_per_pixel_x_ = mm_per_pixel_y_ = std::min(mm_per_pixel_x,
+                                                     mm_per_pixel_y);
+    }
+
+    // Size of a placed pixel in source pixels; exactly 1 for the same
+    // resolution, so that the common case has no rounding errors.
+    const double sx = mm_per_pixel_x_ / mm_per_pixel_x;  // Placed x, y in
+    const double sy = mm_per_pixel_y_ / mm_per_pixel_x;  // source x ...
+    const double tx = mm_per_pixel_x_ / mm_per_pixel_y;  // ... and source y
+    const double ty = mm_per_pixel_y_ / mm_per_pixel_y;
+    width_ = ceil(fabs(source_width * c) / sx + fabs(source_height * s) / tx
+                  - 1e-6);
+    height_ = ceil(fabs(source_width * s) / sy + fabs(source_height * c) / ty
+                   - 1e-6);
+
+    // Relative to the centers, a placed position (x, y) comes from the source
+    // position (x*c - y*s, x*s + y*c); mirrored it is negative in x.
+    const double m = mirror ? -1 : 1;
+    const double px = 0.5 - width_ / 2.0;
+    const double py = 0.5 - height_ / 2.0;
+    xx_ = m * c * sx;
+    xy_ = -m * s * sy;
+    x0_ = source_width / 2.0 + m * (px * c * sx - py * s * sy);
+    yx_ = s * tx;
+    yy_ = c * ty;
+    y0_ = source_height / 2.0 + px * s * tx + py * c * ty;
+}
+
+// Get 8 pixels starting at "x" from a row "width" pixels wide as byte.
+// Pixels outside the row are zero.
+static inline uint8_t GetByteAt(const uint8_t *row, int width, int x) {
+    if (x <= -8 || x >= width) return 0;
+    if (x % 8 == 0) return row[x / 8];
+    const int byte_pos = (x >= 0) ? x / 8 : -1;   // Round towards -infinity
+    const int shift = x - 8 * byte_pos;
+    const uint8_t hi = (byte_pos >= 0) ? row[byte_pos] : 0;
+    const uint8_t lo = (byte_pos + 1 < width / 8) ? row[byte_pos + 1] : 0;
+    return (hi << shift) | (lo >> (8 - shift));
+}
+
+// Reverse the order of the pixels in a byte.
+static inline uint8_t ReverseBits(uint8_t b) {
+    b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+    b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+// Row "y" of the image or nullptr if outside.
+static inline const uint8_t *GetRowOrNull(const BitmapImage &img, int y) {
+    return (y >= 0 && y < img.height()) ? img.GetRow(y) : nullptr;
+}
+
+// Write the 8 source bytes of the 8 columns in "block" as byte "b" of up to
+// 8 output rows, starting at "out_row".
+static inline void WriteTransposedBlock(const uint8_t *block, bool any_bit,
+                                        int rows, uint8_t *out_row,
+                                        int out_stride, int b) {
+    // The transpose8() rotates, so we write rows from the bottom up.
+    if (rows == 8) {
+        if (any_bit)
+            transpose8(block, 1, out_row + 7 * out_stride + b, -out_stride);
+        else
+            for (int i = 0; i < 8; ++i) out_row[i * out_stride + b] = 0;
+    } else {
+        uint8_t tail[8];
+        transpose8(block, 1, tail + 7, -1);
+        for (int i = 0; i < rows; ++i)
+            out_row[i * out_stride + b] = tail[i];
+    }
+}
+
+// Gather for quarter turns and mirroring. Placed pixels map one to one to
+// source pixels, so 8 output rows of a column are 8 source pixels in a row,
+// possibly backwards, or 8 source pixels in a column. The former are read
+// as byte like in the identity gather, the latter are transposed out of 8
+// source rows, shared by neighboring columns reading the same source byte.
+static void GatherQuarterTurnRows(const BitmapImage &img,
+                                  const ImageTransform &placement,
+                                  const std::vector<int> &column_source_row,
+                                  const std::vector<int> &column_x_offset,
+                                  int first_row, int count,
+                                  uint8_t *out, int out_stride) {
+    const int columns = column_source_row.size();
+    const int out_bytes = (columns + 7) / 8;
+    const int step_x = lround(placement.dx_source_x());
+    const int step_y = lround(placement.dx_source_y());
+    // Source pixel of each column in the first row. Columns only crossing
+    // empty tiles are not active.
+    std::vector<int> start_x(out_bytes * 8), start_y(out_bytes * 8);
+    std::vector<bool> active(out_bytes * 8, false);
+    bool any_source = false;
+    for (int c = 0; c < columns; ++c) {
+        const int row = column_source_row[c];
+        if (row < 0 || row >= placement.height()) continue;
+        double sx, sy;
+        placement.Map(first_row + column_x_offset[c], row, &sx, &sy);
+        const int x = floor(sx);
+        const int y = floor(sy);
+        const int ex = x + step_x * (count - 1);
+        const int ey = y + step_y * (count - 1);
+        if (img.GetOccupancy(std::min(x, ex), std::min(y, ey),
+                             std::max(x, ex) + 1, std::max(y, ey) + 1)
+            == BitmapImage::EMPTY) {
+            continue;
         }
+        start_x[c] = x;
+        start_y[c] = y;
+        active[c] = true;
+        any_source = true;
+    }
+    if (!any_source) {
+        for (int r = 0; r < count; ++r)
+            memset(out + r * out_stride, 0, out_bytes);
+        return;
     }
+
+    // Source byte last transposed for reading along columns.
+    int cached_byte = -1, cached_y = 0;
+    uint8_t source_bytes[8];
+    uint8_t column_bytes[8];
+    uint8_t block[8];
+    for (int r = 0; r < count; r += 8) {
+        const int rows = std::min(8, count - r);
+        uint8_t *const out_row = out + r * out_stride;
+        for (int b = 0; b < out_bytes; ++b) {
+            bool any_bit = false;
+            for (int j = 0; j < 8; ++j) {
+                const int c = 8 * b + j;
+                block[j] = 0;
+                if (!active[c]) continue;
+                const int x = start_x[c] + step_x * r;
+                const int y = start_y[c] + step_y * r;
+                if (step_y == 0) {
+                    const uint8_t *row = GetRowOrNull(img, y);
+                    if (!row) continue;
+                    block[j] = (step_x > 0)
+                        ? GetByteAt(row, img.width(), x)
+                        : ReverseBits(GetByteAt(row, img.width(), x - 7));
+                } else {
+                    if (x < 0 || x >= img.width()) continue;
+                    if (x / 8 != cached_byte || y != cached_y) {
+                        for (int i = 0; i < 8; ++i) {
+                            const uint8_t *row
+                                = GetRowOrNull(img, y + i * step_y);
+                            source_bytes[i] = row ? row[x / 8] : 0;
+                        }
+                        // Bytes of the 8 pixel columns, first row in MSB.
+                        transpose8(source_bytes, 1, column_bytes + 7, -1);
+                        cached_byte = x / 8;
+                        cached_y = y;
+                    }
+                    block[j] = column_bytes[x % 8];
+                }
+                any_bit |= block[j];
+            }
+            WriteTransposedBlock(block, any_bit, rows, out_row, out_stride, b);
+        }
+    }
+}
+
+// Gather for arbitrary angles: each pixel is sampled from the source image
+// at the position Map() gives for it. Accumulating the step instead would
+// drift from that by rounding, and pick neighboring pixels on edges.
+static void GatherTransformedRows(const BitmapImage &img,
+                                  const ImageTransform &placement,
+                                  const std::vector<int> &column_source_row,
+                                  const std::vector<int> &column_x_offset,
+                                  int first_row, int count,
+                                  uint8_t *out, int out_stride) {
+    const int columns = column_source_row.size();
+    const int out_bytes = (columns + 7) / 8;
+    for (int r = 0; r < count; ++r)
+        memset(out + r * out_stride, 0, out_bytes);
+
+    const double step_x = placement.dx_source_x();
+    const double step_y = placement.dx_source_y();
+    for (int c = 0; c < columns; ++c) {
+        const int row = column_source_row[c];
+        if (row < 0 || row >= placement.height()) continue;
+        double sx, sy;
+        placement.Map(first_row + column_x_offset[c], row, &sx, &sy);
+        // Nothing to sample if the column only crosses empty tiles. One
+        // pixel margin for the rounding of the steps.
+        const double ex = sx + step_x * (count - 1);
+        const double ey = sy + step_y * (count - 1);
+        if (img.GetOccupancy(floor(std::min(sx, ex)) - 1,
+                             floor(std::min(sy, ey)) - 1,
+                             floor(std::max(sx, ex)) + 2,
+                             floor(std::max(sy, ey)) + 2)
+            == BitmapImage::EMPTY) {
+            continue;
+        }
+        const uint8_t bit = 0x80 >> (c % 8);
+        uint8_t *pos = out + c / 8;
+        const int placed_x = first_row + column_x_offset[c];
+        for (int r = 0; r < count; ++r, pos += out_stride) {
+            placement.Map(placed_x + r, row, &sx, &sy);
+            const int x = floor(sx);
+            const int y = floor(sy);
+            if (x >= 0 && x < img.width() && y >= 0 && y < img.height()
+                && img.Get(x, y)) {
+                *pos |= bit;
+            }
+        }
+    }
+}
+
+void GatherRotatedRows(const BitmapImage &img,
+                       const ImageTransform &placement,
+                       const std::vector<int> &column_source_row,
+                       const std::vector<int> &column_x_offset,
+                       int first_row, int count,
+                       uint8_t *out, int out_stride) {
+    if (placement.is_quarter_turn() && !placement.is_identity()) {
+        GatherQuarterTurnRows(img, placement, column_source_row,
+                              column_x_offset, first_row, count,
+                              out, out_stride);
+        return;
+    }
+    if (!placement.is_identity()) {
+        GatherTransformedRows(img, placement, column_source_row,
+                              column_x_offset, first_row, count,
+                              out, out_stride);
+        return;
+    }
+    const int columns = column_source_row.size();
+    const int out_bytes = (columns + 7) / 8;
+    // Columns only reading uniform tiles don't touch the image: empty ones
+    // have no source, full ones read from a row of all ones.
+    std::vector<const uint8_t *> source(out_bytes * 8, nullptr);
+    std::vector<uint8_t> all_set;
+    bool any_source = false;
+    for (int c = 0; c < columns; ++c) {
+        const int row = column_source_row[c];
+        if (row < 0 || row >= img.height()) continue;
+        const int x = first_row + column_x_offset[c];
+        switch (img.GetOccupancy(x, row, x + count, row + 1)) {
+        case BitmapImage::EMPTY:
+            continue;
+        case BitmapImage::FULL:
+            if (all_set.empty()) all_set.assign(img.width() / 8, 0xff);
+            source[c] = all_set.data();
+            break;
+        case BitmapImage::MIXED:
+            source[c] = img.GetRow(row);
+            break;
+        }
+        any_source = true;
+    }
+    if (!any_source) {
+        for (int r = 0; r < count; ++r)
+            memset(out + r * out_stride, 0, out_bytes);
+        return;
+    }
+
+    uint8_t block[8];
+    for (int r = first_row; r < first_row + count; r += 8) {
+        const int rows = std::min(8, first_row + count - r);
+        uint8_t *const out_row = out + (r - first_row) * out_stride;
+        for (int b = 0; b < out_bytes; ++b) {
+            bool any_bit = false;
+            for (int j = 0; j < 8; ++j) {
+                const int c = 8 * b + j;
+                block[j] = source[c]
+                    ? GetByteAt(source[c], img.width(), r + column_x_offset[c])
+                    : 0;
+                any_bit |= block[j];
+            }
+            WriteTransposedBlock(block, any_bit, rows, out_row, out_stride, b);
+        }
+    }
+}
+
+BitmapImage *CreateGatheredRotatedImage(const BitmapImage &img,
+                                        const ImageTransform &placement,
+                                        const std::vector<int> &column_source_row,
+                                        const std::vector<int> &column_x_offset,
+                                        int height) {
+    BitmapImage *const result = new BitmapImage(column_source_row.size(),
+                                                height);
+    const int stride = result->width() / 8;
+    // Bands of multiple of 8 rows, one per CPU.
+    const int threads = std::max(1U, std::thread::hardware_concurrency());
+    const int band = ((height + threads - 1) / threads + 7) & ~0x7;
+    std::vector<std::thread> workers;
+    for (int start = 0; start < height; start += band) {
+        const int count = std::min(band, height - start);
+        workers.push_back(std::thread([&, start, count]() {
+                    // Only consecutive rows can be written at once.
+                    for (int r = start; r < start + count; /**/) {
+                        const int rows = std::min(start + count - r,
+                                                  result->ConsecutiveRows(r));
+                        GatherRotatedRows(img, placement, column_source_row,
+                                          column_x_offset, r, rows,
+                                          result->GetMutableRow(r), stride);
+                        r += rows;
+                    }
+                }));
+    }
+    for (std::thread &t : workers) t.join();
     return result;
 }
+
+bool ParseLayerOp(const char *name, LayerOp *op) {
+    if (strcasecmp(name, "or") == 0) *op = LAYER_OR;
+    else if (strcasecmp(name, "and") == 0) *op = LAYER_AND;
+    else if (strcasecmp(name, "xor") == 0) *op = LAYER_XOR;
+    else if (strcasecmp(name, "andnot") == 0) *op = LAYER_ANDNOT;
+    else return false;
+    return true;
+}
+
+// -- Layer composition on 64 bit words. The first pixel is in the most
+// significant bit, just as it is in the bytes of BitmapImage.
+namespace {
+struct OrLayer {
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a | b; }
+};
+struct AndLayer {
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a & b; }
+};
+struct XorLayer {
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a ^ b; }
+};
+struct AndNotLayer {
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a & ~b; }
+};
+}
+
+static inline uint64_t LoadBigEndian(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void StoreBigEndian(uint64_t v, uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+// Get 64 pixels starting at "x" from a row of "bytes" bytes. The pixels can
+// be partially or entirely outside the row; these are zero.
+static inline uint64_t GetWordAt(const uint8_t *row, int bytes, int64_t x) {
+    const int64_t first = x >> 3;   // Round towards -infinity
+    const int shift = x & 7;
+    uint64_t hi, lo;
+    if (first >= 0 && first + 9 <= bytes) {
+        hi = LoadBigEndian(row + first);
+        lo = row[first + 8];
+    } else {
+        if (first >= bytes || first + 9 <= 0) return 0;
+        hi = 0;
+        for (int i = 0; i < 8; ++i) {
+            const int64_t b = first + i;
+            hi = (hi << 8) | ((b >= 0 && b < bytes) ? row[b] : 0);
+        }
+        lo = (first + 8 >= 0 && first + 8 < bytes) ? row[first + 8] : 0;
+    }
+    return shift ? (hi << shift) | (lo >> (8 - shift)) : hi;
+}
+
+template <class Op>
+static void ComposeRow(uint8_t *row, int bytes,
+                       const uint8_t *layer_row, int layer_bytes, int dx) {
+    int b = 0;
+    for (/**/; b + 8 <= bytes; b += 8) {
+        const uint64_t l = GetWordAt(layer_row, layer_bytes, 8LL * b - dx);
+        StoreBigEndian(Op::Apply(LoadBigEndian(row + b), l), row + b);
+    }
+    if (b < bytes) {   // Less than a word left.
+        const uint64_t v = Op::Apply(GetWordAt(row, bytes, 8LL * b),
+                                     GetWordAt(layer_row, layer_bytes,
+                                               8LL * b - dx));
+        for (int i = 0; b + i < bytes; ++i)
+            row[b + i] = v >> (56 - 8 * i);
+    }
+}
+
+template <class Op>
+static void ComposeRows(BitmapImage *img, const BitmapImage &layer,
+                        int dx, int dy, int start, int count) {
+    const int bytes = img->width() / 8;
+    const int layer_bytes = layer.width() / 8;
+    for (int y = start; y < start + count; ++y) {
+        const int layer_y = y - dy;
+        if (layer_y >= 0 && layer_y < layer.height()) {
+            ComposeRow<Op>(img->GetMutableRow(y), bytes,
+                           layer.GetRow(layer_y), layer_bytes, dx);
+        } else if (Op::Apply(~0ULL, 0) != ~0ULL) {
+            // Only AND changes the image where the layer is empty.
+            memset(img->GetMutableRow(y), 0, bytes);
+        }
+    }
+}
+
+void ComposeLayer(BitmapImage *img, const BitmapImage &layer, LayerOp op,
+                  int dx, int dy) {
+    ScopedStageTimer timer(Metrics::STAGE_DECODE);
+    const int height = img->height();
+    // Bands of whole rows of occupancy tiles, one per CPU.
+    const int threads = std::max(1U, std::thread::hardware_concurrency());
+    const int band = ((height + threads - 1) / threads
+                      + BitmapImage::kOccupancyTile - 1)
+        & ~(BitmapImage::kOccupancyTile - 1);
+    std::vector<std::thread> workers;
+    for (int start = 0; start < height; start += band) {
+        const int count = std::min(band, height - start);
+        workers.push_back(std::thread([=, &layer]() {
+                    switch (op) {
+                    case LAYER_OR:
+                        ComposeRows<OrLayer>(img, layer, dx, dy, start, count);
+                        break;
+                    case LAYER_AND:
+                        ComposeRows<AndLayer>(img, layer, dx, dy, start, count);
+                        break;
+                    case LAYER_XOR:
+                        ComposeRows<XorLayer>(img, layer, dx, dy, start, count);
+                        break;
+                    case LAYER_ANDNOT:
+                        ComposeRows<AndNotLayer>(img, layer, dx, dy,
+                                                 start, count);
+                        break;
+                    }
+                }));
+    }
+    for (std::thread &t : workers) t.join();
+}
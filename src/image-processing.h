@@ -29,52 +29,129 @@
 
 // A bitmap image with packed bits and direct access.
 // Image width is aligned to the next full byte.
+// Storage is in tiles of rows (see RowTiles) from the BitmapPool, so images
+// can be larger than memory and than 2^31 bits. It is moved, not copied, when
+// an image is moved.
+//
+// Optionally, the image keeps an index of square tiles that are entirely
+// empty or full, so that processing can skip the large uniform areas of a
+// typical board without looking at the pixels.
 class BitmapImage {
 public:
+    enum Occupancy { EMPTY, FULL, MIXED };
+    static constexpr int kOccupancyTile = 64;   // Pixels; multiple of 8.
+
     BitmapImage(int width, int height)
         : width_((width + 7) & ~0x7), height_(height),
-          bits_(new BitArray(width_ * height)) {}
+          bits_(width_ / 8, height) {}
     BitmapImage(const BitmapImage &o)
-        : width_(o.width_), height_(o.height_), bits_(new BitArray(*o.bits_)) {
+        : width_(o.width_), height_(o.height_), bits_(o.bits_),
+          occupancy_(o.occupancy_), tile_row_indexed_(o.tile_row_indexed_) {
+    }
+    BitmapImage(BitmapImage &&o)
+        : width_(o.width_), height_(o.height_), bits_(std::move(o.bits_)),
+          occupancy_(std::move(o.occupancy_)),
+          tile_row_indexed_(std::move(o.tile_row_indexed_)) {
+        o.width_ = o.height_ = 0;
     }
 
-    ~BitmapImage() { delete bits_; }
+    BitmapImage &operator=(BitmapImage &&o) {
+        std::swap(width_, o.width_);
+        std::swap(height_, o.height_);
+        bits_ = std::move(o.bits_);
+        occupancy_.swap(o.occupancy_);
+        tile_row_indexed_.swap(o.tile_row_indexed_);
+        return *this;
+    }
 
     int width() const { return width_; }
     int height() const { return height_; }
 
+    // Bytes used by the image data.
+    size_t size_bytes() const { return bits_.size_bytes(); }
+
     inline bool Get(int x, int y) const {
         assert(x >= 0 && x < width_ && y >= 0 && y < height_);
-        return bits_->Get(width_ * y + x);
+        return bits_.row(y)[x / 8] & (0x80 >> (x % 8));
     }
     inline void Set(int x, int y, bool value) {
         assert(x >= 0 && x < width_ && y >= 0 && y < height_);
-        bits_->Set(width_ * y + x, value);
+        DropOccupancy(y);
+        if (value)
+            bits_.row(y)[x / 8] |= 0x80 >> (x % 8);
+        else
+            bits_.row(y)[x / 8] &= ~(0x80 >> (x % 8));
     }
 
     // Raw read access to a full row.
-    const uint8_t *GetRow(int r) const {
-        return bits_->buffer() + r * width_ / 8;
-    }
-    uint8_t *GetMutableRow(int r) { return bits_->buffer() + r * width_ / 8; }
+    const uint8_t *GetRow(int r) const { return bits_.row(r); }
+    uint8_t *GetMutableRow(int r) { DropOccupancy(r); return bits_.row(r); }
+
+    // Number of rows starting with "r" that are consecutive in memory, i.e.
+    // that can be accessed with the stride of width() / 8 from GetRow(r).
+    int ConsecutiveRows(int r) const { return bits_.rows_in_tile(r); }
 
     bool CopyFrom(const BitmapImage &other);
     void ToPBM(FILE *file) const;
 
+    // Index the occupancy of the tiles in row "tile_row" of tiles, e.g.
+    // right after writing its pixels, while they are still in the cache.
+    // Modifying pixels drops the index of their row of tiles again.
+    void IndexOccupancy(int tile_row);
+    // Index all rows of tiles that are not indexed.
+    void IndexOccupancy();
+
+    // Occupancy of the rectangle [x0, x1) x [y0, y1) within the image;
+    // pixels outside are not considered. MIXED if not indexed.
+    Occupancy GetOccupancy(int x0, int y0, int x1, int y1) const;
+
 private:
-    const int width_, height_;
-    BitArray *const bits_;
+    void DropOccupancy(int y) {
+        if (!tile_row_indexed_.empty())
+            tile_row_indexed_[y / kOccupancyTile] = false;
+    }
+
+    int width_, height_;
+    RowTiles bits_;
+    std::vector<uint8_t> occupancy_;         // Occupancy per tile.
+    std::vector<uint8_t> tile_row_indexed_;  // Empty if no index yet.
 };
 
 // Load PNG file, convert to grayscale and return result as allocated
 // SimpleImage. NULL on failure.
-// Returns the image dpi if it was stored in the meta data.
-BitmapImage *LoadPNGImage(const char *filename, bool invert, double *dpi);
+// Returns the image dpi in x and y direction if it was stored in the meta
+// data; they can be different.
+BitmapImage *LoadPNGImage(const char *filename, bool invert,
+                          double *dpi_x, double *dpi_y);
 
-// Thin out contiguous regions in x and y direction by x_radius, y_radius,
+// Same, but read from an already open stream, e.g. a pipe that is still being
+// filled. Decodes rows as the data arrives. "name" is only used in messages.
+BitmapImage *ReadPNGImage(FILE *fp, const char *name, bool invert,
+                          double *dpi_x, double *dpi_y);
+
+// Thin out structures by an elliptical laser dot with x_radius, y_radius,
 // but never in a way that pixels are eliminated entirely.
 void ThinImageStructures(BitmapImage *img, int x_radius, int y_radius);
 
+// Boolean operation to combine layers, e.g. copper with drill holes, or
+// solder mask with keep-out areas.
+enum LayerOp {
+    LAYER_OR,
+    LAYER_AND,
+    LAYER_XOR,
+    LAYER_ANDNOT,   // Pixels of the image not set in the layer.
+};
+
+// Parse "or", "and", "xor" or "andnot". Returns false if unknown.
+bool ParseLayerOp(const char *name, LayerOp *op);
+
+// Combine "layer" into "img" in place: img = img <op> layer, with the
+// top left corner of the layer at pixel ("dx", "dy") of the image. Where the
+// layer doesn't cover the image, its pixels count as not set.
+// Works on 64 pixels at a time; bands of rows are processed in parallel.
+void ComposeLayer(BitmapImage *img, const BitmapImage &layer, LayerOp op,
+                  int dx, int dy);
+
 // Create a test-chart with pre-thinned lines of "line_width_mm" size. Creates
 // "count" sample charts, starting with "start_diameter" and steps.
 // Each sample will be 1 cm long and 2 cm wide.
@@ -82,7 +159,77 @@ BitmapImage *CreateThinningTestChart(float mm_per_pixel, float line_width_mm,
                                      int count,
                                      float start_diameter, float step);
 
-// Create a new bitmap, that is rotated by 90 degrees.
-BitmapImage *CreateRotatedImage(const BitmapImage &img);
+// Placement of an image: optionally mirrored left to right, then turned
+// left by any angle. It is never applied to the image as a whole; instead,
+// pixels of the placed image are mapped back to the source image while
+// gathering.
+//
+// Pixels don't need to be square. With quarter turns, the placed image
+// keeps the resolution of the source axes, with other angles it gets the
+// finer of both in either direction.
+class ImageTransform {
+public:
+    // Transform for an image of the given size and pixel size in mm. The
+    // placed image is the bounding box of the turned image.
+    ImageTransform(int source_width, int source_height,
+                   float rotate_degrees = 0, bool mirror = false,
+                   float mm_per_pixel_x = 1, float mm_per_pixel_y = 1);
+
+    // Placed image is the same as the source image.
+    bool is_identity() const { return identity_; }
+
+    // Quarter turns, possibly mirrored: each placed pixel maps to exactly one
+    // source pixel, and the steps dx_source_x(), dx_source_y() are 0 or +/-1.
+    bool is_quarter_turn() const { return quarter_turn_; }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Pixel size of the placed image.
+    float mm_per_pixel_x() const { return mm_per_pixel_x_; }
+    float mm_per_pixel_y() const { return mm_per_pixel_y_; }
+
+    // Position in the source image of the center of pixel (x, y) in the
+    // placed image. Round down for the source pixel.
+    void Map(int x, int y, double *source_x, double *source_y) const {
+        *source_x = xx_ * x + xy_ * y + x0_;
+        *source_y = yx_ * x + yy_ * y + y0_;
+    }
+
+    // Change of source position per pixel in x direction of the placed image.
+    double dx_source_x() const { return xx_; }
+    double dx_source_y() const { return yx_; }
+
+private:
+    bool identity_;
+    bool quarter_turn_;
+    int width_, height_;
+    float mm_per_pixel_x_, mm_per_pixel_y_;
+    double xx_, xy_, x0_;
+    double yx_, yy_, y0_;
+};
+
+// Gather rows of the placed "img" into a bitmap rotated by 90 degrees, in one
+// pass. Each output column "c" is taken from placed row column_source_row[c]:
+// output pixel (c, r) is placed pixel (r + column_x_offset[c],
+// column_source_row[c]). Columns with a negative source row as well as
+// pixels outside the input stay empty.
+//
+// The result has column_source_row.size() columns and "height" rows.
+// Bands of output rows are processed in parallel.
+BitmapImage *CreateGatheredRotatedImage(const BitmapImage &img,
+                                        const ImageTransform &placement,
+                                        const std::vector<int> &column_source_row,
+                                        const std::vector<int> &column_x_offset,
+                                        int height);
+
+// Like CreateGatheredRotatedImage(), but only fill output rows
+// [first_row, first_row + count) into "out", "out_stride" bytes per row.
+void GatherRotatedRows(const BitmapImage &img,
+                       const ImageTransform &placement,
+                       const std::vector<int> &column_source_row,
+                       const std::vector<int> &column_x_offset,
+                       int first_row, int count,
+                       uint8_t *out, int out_stride);
 
 #endif  // LDGRAPHY_IMAGE_PROCESSING_H
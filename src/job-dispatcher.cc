@@ -0,0 +1,319 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job-dispatcher.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "http-util.h"
+
+static constexpr int kPollIntervalMs = 1000;
+
+// Rough rate of uploading and decoding an image on a machine, to weigh the
+// upload against waiting for a machine that has the artwork already.
+static constexpr double kUploadBytesPerSecond = 2e6;
+
+// Assumed time until a busy machine is done if it can't tell, e.g. while
+// preparing the image or waiting for the operator to take the board.
+static constexpr int kUnknownBusySeconds = 60;
+
+static const char kPngSignature[] = "\x89PNG\r\n\x1a\n";
+
+// Value of "key" in the flat JSON object "json"; strings without quotes.
+// Good enough for what the job server sends.
+static bool JsonValue(const std::string &json, const char *key,
+                      std::string *value) {
+    const std::string quoted_key = std::string("\"") + key + "\":";
+    size_t pos = json.find(quoted_key);
+    if (pos == std::string::npos) return false;
+    pos = json.find_first_not_of(' ', pos + quoted_key.size());
+    if (pos == std::string::npos) return false;
+    size_t end;
+    if (json[pos] == '"') {
+        end = json.find('"', ++pos);
+    } else if (json[pos] == '[') {
+        end = json.find(']', pos) + 1;
+    } else {
+        end = json.find_first_of(",}", pos);
+    }
+    if (end == std::string::npos) return false;
+    value->assign(json, pos, end - pos);
+    return true;
+}
+
+static int JsonInt(const std::string &json, const char *key, int fallback) {
+    std::string value;
+    return JsonValue(json, key, &value) ? atoi(value.c_str()) : fallback;
+}
+
+static int BusySeconds(const std::string &state, int remaining_sec) {
+    if (state == "idle") return 0;
+    return remaining_sec >= 0 ? remaining_sec : kUnknownBusySeconds;
+}
+
+JobDispatcher::JobDispatcher() : listen_fd_(-1), next_job_id_(1) {}
+
+JobDispatcher::~JobDispatcher() {
+    if (listen_fd_ >= 0) {
+        shutdown(listen_fd_, SHUT_RDWR);
+        accept_thread_.join();
+        close(listen_fd_);
+    }
+    for (PendingJob *job : pending_) delete job;
+    for (Machine *machine : machines_) delete machine;
+}
+
+bool JobDispatcher::AddMachine(const char *address) {
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || atoi(colon + 1) <= 0) {
+        fprintf(stderr, "Expected <host>:<port> for machine, got '%s'\n",
+                address);
+        return false;
+    }
+    Machine *machine = new Machine();
+    machine->address = address;
+    machine->host.assign(address, colon - address);
+    machine->port = atoi(colon + 1);
+    machine->reachable = false;
+    machine->state = "unknown";
+    machine->remaining_sec = -1;
+    machine->queued = 0;
+    machine->jobs_sent = 0;
+    std::lock_guard<std::mutex> l(mutex_);
+    machines_.push_back(machine);
+    return true;
+}
+
+bool JobDispatcher::Start(int port) {
+    listen_fd_ = ListenLocalhost(port);
+    if (listen_fd_ < 0)
+        return false;
+    accept_thread_ = std::thread(&JobDispatcher::AcceptLoop, this);
+    fprintf(stderr, "Waiting for jobs on http://localhost:%d/job "
+            "(fleet: /status)\n", port);
+    return true;
+}
+
+void JobDispatcher::AcceptLoop() {
+    for (;;) {
+        const int fd = accept(listen_fd_, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // Listening socket shut down.
+        }
+        // Requests are short, so one at a time is good enough.
+        HandleConnection(fd);
+        close(fd);
+    }
+}
+
+void JobDispatcher::HandleConnection(int fd) {
+    std::string pending;
+    HttpRequestHeader header;
+    if (!ReadRequestHeader(fd, &pending, &header))
+        return;
+    if (header.method == "GET" && header.path == "/status") {
+        SendStatus(fd);
+        return;
+    }
+    if (header.method != "POST" || header.path != "/job") {
+        SendResponse(fd, "404 Not Found", "{}");
+        return;
+    }
+    if (!header.chunked && header.content_length < 0) {
+        SendResponse(fd, "411 Length Required", "{}");
+        return;
+    }
+
+    PendingJob *job = new PendingJob();
+    const bool complete = ReadRequestBody(
+        fd, header, &pending, [job](const char *data, size_t len) {
+            job->png.append(data, len);
+            return true;
+        });
+    if (!complete || job->png.compare(0, 8, kPngSignature, 8) != 0) {
+        SendResponse(fd, "400 Bad Request",
+                     complete ? "{\"error\": \"Not a PNG image\"}"
+                     : "{\"error\": \"Incomplete\"}");
+        delete job;
+        return;
+    }
+    job->artwork = HashContent(job->png.data(), job->png.size());
+    char body[128];
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        job->id = next_job_id_++;
+        snprintf(body, sizeof(body), "{\"job\": %d, \"artwork\": "
+                 "\"%016llx\", \"queued\": %d}", job->id,
+                 (unsigned long long)job->artwork, (int)pending_.size() + 1);
+        pending_.push_back(job);
+    }
+    job_added_.notify_all();
+    SendResponse(fd, "200 OK", body);
+}
+
+void JobDispatcher::SendStatus(int fd) {
+    std::string body;
+    char buf[256];
+    std::lock_guard<std::mutex> l(mutex_);
+    snprintf(buf, sizeof(buf), "{\"queued\": %d, \"machines\": [",
+             (int)pending_.size());
+    body = buf;
+    for (size_t i = 0; i < machines_.size(); ++i) {
+        const Machine *m = machines_[i];
+        snprintf(buf, sizeof(buf), "%s\n  {\"address\": \"%s\", "
+                 "\"state\": \"%s\", \"remaining_sec\": %d, \"queued\": %d, "
+                 "\"jobs_sent\": %d}", i > 0 ? "," : "", m->address.c_str(),
+                 m->state.c_str(), m->remaining_sec, m->queued, m->jobs_sent);
+        body.append(buf);
+    }
+    body.append("]}\n");
+    SendResponse(fd, "200 OK", body.c_str());
+}
+
+void JobDispatcher::PollStatus(Machine *machine) {
+    std::string reply;
+    const int status = HttpRequest(machine->host.c_str(), machine->port,
+                                   "GET", "/status", "", &reply);
+    std::string state, artwork_list;
+    const bool valid = (status == 200 && JsonValue(reply, "state", &state));
+
+    std::lock_guard<std::mutex> l(mutex_);
+    if (valid != machine->reachable) {
+        fprintf(stderr, "Machine %s %s\n", machine->address.c_str(),
+                valid ? "is ready" : "is not reachable");
+    }
+    machine->reachable = valid;
+    if (!valid) {
+        machine->state = "unreachable";
+        return;
+    }
+    machine->state = state;
+    machine->remaining_sec = JsonInt(reply, "remaining_sec", -1);
+    machine->queued = JsonInt(reply, "queued", 0);
+    machine->artwork.clear();
+    if (JsonValue(reply, "artwork", &artwork_list)) {
+        const char *pos = artwork_list.c_str();
+        while ((pos = strchr(pos, '"')) != NULL) {
+            unsigned long long id;
+            if (sscanf(pos + 1, "%llx", &id) == 1)
+                machine->artwork.insert(id);
+            pos = strchr(pos + 1, '"');
+            if (pos) ++pos; else break;
+        }
+    }
+}
+
+void JobDispatcher::DispatchPending() {
+    for (;;) {
+        PendingJob *job;
+        Machine *best = nullptr;
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            if (pending_.empty()) return;
+            job = pending_.front();
+            double best_start = 0;
+            for (Machine *m : machines_) {
+                // One job in advance, so that the upload happens while the
+                // machine is still busy, but not more: a job queued on a
+                // machine can't go to another one that becomes free earlier.
+                if (!m->reachable || m->queued > 0) continue;
+                double start = BusySeconds(m->state, m->remaining_sec);
+                if (!m->artwork.count(job->artwork))
+                    start += job->png.size() / kUploadBytesPerSecond;
+                if (!best || start < best_start) {
+                    best = m;
+                    best_start = start;
+                }
+            }
+            if (!best) return;
+            pending_.pop_front();
+        }
+
+        const bool success = SendJob(best, *job);
+        std::lock_guard<std::mutex> l(mutex_);
+        if (success) {
+            best->queued++;   // Until we see the next status.
+            best->jobs_sent++;
+            best->artwork.insert(job->artwork);
+            delete job;
+        } else if (!best->reachable) {
+            pending_.push_front(job);   // Another machine might take it.
+        } else {
+            delete job;   // The machine rejected it; no use to retry.
+        }
+    }
+}
+
+bool JobDispatcher::SendJob(Machine *machine, const PendingJob &job) {
+    bool cached;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        cached = machine->artwork.count(job.artwork) > 0;
+    }
+    std::string reply;
+    int status = -1;
+    if (cached) {
+        char path[64];
+        snprintf(path, sizeof(path), "/job?artwork=%016llx",
+                 (unsigned long long)job.artwork);
+        status = HttpRequest(machine->host.c_str(), machine->port, "POST",
+                             path, "", &reply);
+        cached = (status == 200);   // Else it dropped out of the cache.
+    }
+    if (!cached) {
+        status = HttpRequest(machine->host.c_str(), machine->port, "POST",
+                             "/job", job.png, &reply);
+    }
+
+    if (status == 200) {
+        fprintf(stderr, "Job #%d -> %s (%s), machine job #%d\n", job.id,
+                machine->address.c_str(), cached ? "cached artwork" : "upload",
+                JsonInt(reply, "job", -1));
+        return true;
+    }
+    std::lock_guard<std::mutex> l(mutex_);
+    if (status < 0) {
+        fprintf(stderr, "Job #%d: machine %s not reachable.\n", job.id,
+                machine->address.c_str());
+        machine->reachable = false;
+        machine->state = "unreachable";
+    } else {
+        fprintf(stderr, "Job #%d rejected by %s: %s\n", job.id,
+                machine->address.c_str(), reply.c_str());
+    }
+    return false;
+}
+
+void JobDispatcher::Run(const std::function<bool()> &keep_running) {
+    while (keep_running()) {
+        for (Machine *machine : machines_)
+            PollStatus(machine);
+        DispatchPending();
+        std::unique_lock<std::mutex> l(mutex_);
+        job_added_.wait_for(l, std::chrono::milliseconds(kPollIntervalMs));
+    }
+}
@@ -0,0 +1,96 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_JOB_DISPATCHER_H
+#define LDGRAPHY_JOB_DISPATCHER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Holds a queue of jobs and hands them to several machines, each running
+// the job server (ldgraphy -W <port>). Accepts jobs the same way:
+//
+//   POST /job   PNG image as body. Replies with the job id.
+//   GET /status Queue length and state of each machine as JSON.
+//
+// Machines are polled for their state. A machine gets a job only if it has
+// none queued; of those, the job goes to the one that is expected to start
+// it first: now if idle, else when the current job is done. Uploading
+// counts as well, so a machine that has the artwork cached and is done soon
+// can win over an idle one.
+class JobDispatcher {
+public:
+    JobDispatcher();
+    ~JobDispatcher();
+
+    // Add machine with the job server at "host:port". Returns false if
+    // the address can't be parsed.
+    bool AddMachine(const char *address);
+
+    // Accept jobs on localhost with given port. Returns false and prints a
+    // message on failure.
+    bool Start(int port);
+
+    // Poll machines and dispatch jobs as long as "keep_running" returns true.
+    void Run(const std::function<bool()> &keep_running);
+
+private:
+    struct Machine {
+        std::string address;      // As given; for messages.
+        std::string host;
+        int port;
+        bool reachable;
+        std::string state;        // As reported by the machine.
+        int remaining_sec;        // -1: unknown.
+        int queued;
+        std::set<uint64_t> artwork;  // Ids of cached artwork.
+        int jobs_sent;
+    };
+    struct PendingJob {
+        int id;
+        uint64_t artwork;
+        std::string png;
+    };
+
+    void AcceptLoop();
+    void HandleConnection(int fd);
+    void SendStatus(int fd);
+
+    void PollStatus(Machine *machine);
+    void DispatchPending();
+    bool SendJob(Machine *machine, const PendingJob &job);
+
+    int listen_fd_;
+    std::thread accept_thread_;
+    int next_job_id_;
+
+    std::mutex mutex_;
+    std::condition_variable job_added_;
+    std::deque<PendingJob*> pending_;
+    std::vector<Machine*> machines_;
+};
+
+#endif  // LDGRAPHY_JOB_DISPATCHER_H
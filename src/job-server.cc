@@ -0,0 +1,351 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job-server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Report upload progress every this many bytes.
+static constexpr long kUploadProgressBytes = 256 << 10;
+
+// Uploaded images kept to expose them again without upload.
+static constexpr size_t kMaxCachedArtwork = 3;
+
+// Write all to the pipe to the decoder.
+static bool WriteAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+JobServer::JobServer(bool invert)
+    : invert_(invert), listen_fd_(-1), shutdown_(false), next_job_id_(1),
+      active_handlers_(0), machine_state_(MACHINE_IDLE), current_job_id_(-1),
+      remaining_sec_(0) {
+}
+
+JobServer::~JobServer() {
+    Shutdown();
+}
+
+bool JobServer::Start(int port) {
+    listen_fd_ = ListenLocalhost(port);
+    if (listen_fd_ < 0)
+        return false;
+    accept_thread_ = std::thread(&JobServer::AcceptLoop, this);
+    fprintf(stderr, "Waiting for jobs on http://localhost:%d/job "
+            "(progress: /events)\n", port);
+    return true;
+}
+
+void JobServer::AcceptLoop() {
+    for (;;) {
+        const int fd = accept(listen_fd_, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // Listening socket shut down.
+        }
+        std::lock_guard<std::mutex> l(mutex_);
+        if (shutdown_) {
+            close(fd);
+            return;
+        }
+        connections_.insert(fd);
+        ++active_handlers_;
+        std::thread(&JobServer::HandleConnection, this, fd).detach();
+    }
+}
+
+void JobServer::HandleConnection(int fd) {
+    std::string pending;
+    HttpRequestHeader header;
+    bool keep_open = false;
+
+    if (ReadRequestHeader(fd, &pending, &header)) {
+        if (header.method == "POST" && header.path == "/job") {
+            if (!header.query.empty())
+                HandleCachedArtwork(fd, header.query);
+            else if (!header.chunked && header.content_length < 0)
+                SendResponse(fd, "411 Length Required", "{}");
+            else
+                HandleUpload(fd, header, &pending);
+        } else if (header.method == "GET" && header.path == "/status") {
+            SendStatus(fd);
+        } else if (header.method == "GET" && header.path == "/events") {
+            static const char kEventHeader[] =
+                "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                "Cache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+            if (SendAll(fd, kEventHeader, strlen(kEventHeader))) {
+                std::lock_guard<std::mutex> l(mutex_);
+                if (!shutdown_) {
+                    event_listeners_.push_back(fd);
+                    keep_open = true;
+                }
+            }
+        } else {
+            SendResponse(fd, "404 Not Found", "{}");
+        }
+    }
+
+    std::lock_guard<std::mutex> l(mutex_);
+    connections_.erase(fd);
+    if (!keep_open) close(fd);
+    if (--active_handlers_ == 0) handlers_done_.notify_all();
+}
+
+void JobServer::HandleUpload(int fd, const HttpRequestHeader &header,
+                             std::string *pending) {
+    Job *job = new Job();
+    job->dpi_x = job->dpi_y = -1;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        job->id = next_job_id_++;
+    }
+
+    // The decoder reads from a pipe that we fill while the data arrives, so
+    // that decoding is finished shortly after the last byte.
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe()");
+        SendResponse(fd, "500 Internal Server Error", "{}");
+        delete job;
+        return;
+    }
+    std::thread decoder([this, job, &pipe_fds]() {
+            char name[32];
+            snprintf(name, sizeof(name), "upload #%d", job->id);
+            FILE *in = fdopen(pipe_fds[0], "r");
+            job->image.reset(ReadPNGImage(in, name, invert_,
+                                          &job->dpi_x, &job->dpi_y));
+            // Consume whatever comes after the image, so the writer never
+            // blocks on a full pipe.
+            char buf[4096];
+            while (fread(buf, 1, sizeof(buf), in) > 0) {}
+            fclose(in);
+        });
+
+    long received = 0;
+    long last_report = 0;
+    uint64_t artwork_id = kInitialContentHash;
+    std::string *const png = new std::string();
+    std::shared_ptr<const std::string> owned_png(png);
+    const bool complete = ReadRequestBody(
+        fd, header, pending, [&](const char *data, size_t len) {
+            artwork_id = HashContent(data, len, artwork_id);
+            png->append(data, len);
+            received += len;
+            if (received - last_report >= kUploadProgressBytes) {
+                PublishJobProgress(job->id, "upload", received);
+                last_report = received;
+            }
+            return WriteAll(pipe_fds[1], data, len);
+        });
+    close(pipe_fds[1]);
+    decoder.join();
+    PublishJobProgress(job->id, "upload", received);
+
+    if (complete && job->image) {
+        // Keep the upload, so that the job can be repeated without it.
+        Artwork *artwork = new Artwork();
+        artwork->id = artwork_id;
+        artwork->png = owned_png;
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            artwork_.push_front(artwork);
+            while (artwork_.size() > kMaxCachedArtwork) {
+                delete artwork_.back();
+                artwork_.pop_back();
+            }
+        }
+        QueueJob(fd, job, artwork_id, received);
+    } else {
+        char body[128];
+        snprintf(body, sizeof(body), "{\"job\": %d, \"error\": \"%s\"}",
+                 job->id, complete ? "Not a valid PNG image" : "Incomplete");
+        PublishEvent("error", body);
+        SendResponse(fd, "400 Bad Request", body);
+        delete job;
+    }
+}
+
+void JobServer::HandleCachedArtwork(int fd, const std::string &query) {
+    unsigned long long artwork_id;
+    if (sscanf(query.c_str(), "artwork=%llx", &artwork_id) != 1) {
+        SendResponse(fd, "400 Bad Request", "{}");
+        return;
+    }
+    std::shared_ptr<const std::string> png;
+    int job_id = -1;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        for (size_t i = 0; i < artwork_.size(); ++i) {
+            Artwork *artwork = artwork_[i];
+            if (artwork->id != artwork_id) continue;
+            png = artwork->png;
+            job_id = next_job_id_++;
+            artwork_.erase(artwork_.begin() + i);
+            artwork_.push_front(artwork);
+            break;
+        }
+    }
+    if (!png) {
+        SendResponse(fd, "404 Not Found", "{\"error\": \"Unknown artwork\"}");
+        return;
+    }
+    Job *job = new Job();
+    job->id = job_id;
+    job->dpi_x = job->dpi_y = -1;
+    char name[32];
+    snprintf(name, sizeof(name), "artwork for #%d", job->id);
+    FILE *in = fmemopen((void*) png->data(), png->size(), "r");
+    if (in) {
+        job->image.reset(ReadPNGImage(in, name, invert_,
+                                      &job->dpi_x, &job->dpi_y));
+        fclose(in);
+    }
+    if (!job->image) {
+        SendResponse(fd, "500 Internal Server Error",
+                     "{\"error\": \"Can't decode artwork\"}");
+        delete job;
+        return;
+    }
+    QueueJob(fd, job, artwork_id, 0);
+}
+
+void JobServer::QueueJob(int fd, Job *job, uint64_t artwork_id, long bytes) {
+    char body[160];
+    snprintf(body, sizeof(body), "{\"job\": %d, \"width\": %d, "
+             "\"height\": %d, \"artwork\": \"%016llx\"}",
+             job->id, job->image->width(), job->image->height(),
+             (unsigned long long)artwork_id);
+    const int id = job->id;
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        jobs_.push_back(job);
+    }
+    job_available_.notify_all();
+    PublishJobProgress(id, "queued", bytes);
+    SendResponse(fd, "200 OK", body);
+}
+
+void JobServer::SendStatus(int fd) {
+    static const char *const kStateNames[] = {
+        "idle", "loading", "exposing", "unloading"
+    };
+    std::string body;
+    char buf[160];
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        snprintf(buf, sizeof(buf), "{\"state\": \"%s\", \"job\": %d, "
+                 "\"remaining_sec\": %d, \"queued\": %d, \"artwork\": [",
+                 kStateNames[machine_state_], current_job_id_, remaining_sec_,
+                 (int)jobs_.size());
+        body = buf;
+        for (size_t i = 0; i < artwork_.size(); ++i) {
+            snprintf(buf, sizeof(buf), "%s\"%016llx\"",
+                     i > 0 ? ", " : "", (unsigned long long)artwork_[i]->id);
+            body.append(buf);
+        }
+    }
+    body.append("]}");
+    SendResponse(fd, "200 OK", body.c_str());
+}
+
+void JobServer::SetMachineState(MachineState state, int remaining_sec) {
+    std::lock_guard<std::mutex> l(mutex_);
+    machine_state_ = state;
+    remaining_sec_ = remaining_sec;
+}
+
+bool JobServer::NextJob(Job *job) {
+    std::unique_lock<std::mutex> l(mutex_);
+    machine_state_ = MACHINE_IDLE;
+    current_job_id_ = -1;
+    remaining_sec_ = 0;
+    job_available_.wait(l, [this]() { return shutdown_ || !jobs_.empty(); });
+    if (jobs_.empty()) return false;
+    Job *next = jobs_.front();
+    jobs_.pop_front();
+    machine_state_ = MACHINE_LOADING;
+    current_job_id_ = next->id;
+    remaining_sec_ = -1;
+    job->id = next->id;
+    job->image = std::move(next->image);
+    job->dpi_x = next->dpi_x;
+    job->dpi_y = next->dpi_y;
+    delete next;
+    return true;
+}
+
+void JobServer::PublishJobProgress(int job_id, const char *type, long bytes) {
+    char data[64];
+    snprintf(data, sizeof(data), "{\"job\": %d, \"bytes\": %ld}",
+             job_id, bytes);
+    PublishEvent(type, data);
+}
+
+void JobServer::PublishEvent(const char *type, const char *json_data) {
+    std::string event = "event: ";
+    event.append(type).append("\ndata: ").append(json_data).append("\n\n");
+    std::lock_guard<std::mutex> l(mutex_);
+    for (size_t i = 0; i < event_listeners_.size(); /**/) {
+        // Never block on a slow listener; it just loses the connection.
+        if (SendAll(event_listeners_[i], event.data(), event.size(),
+                    MSG_DONTWAIT)) {
+            ++i;
+        } else {
+            close(event_listeners_[i]);
+            event_listeners_.erase(event_listeners_.begin() + i);
+        }
+    }
+}
+
+void JobServer::Shutdown() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (shutdown_) return;
+        shutdown_ = true;
+        for (int fd : connections_) shutdown(fd, SHUT_RDWR);
+        for (int fd : event_listeners_) close(fd);
+        event_listeners_.clear();
+    }
+    job_available_.notify_all();
+    if (listen_fd_ >= 0) {
+        shutdown(listen_fd_, SHUT_RDWR);
+        accept_thread_.join();
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+    std::unique_lock<std::mutex> l(mutex_);
+    handlers_done_.wait(l, [this]() { return active_handlers_ == 0; });
+    for (Job *job : jobs_) delete job;
+    jobs_.clear();
+    for (Artwork *artwork : artwork_) delete artwork;
+    artwork_.clear();
+}
@@ -0,0 +1,122 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_JOB_SERVER_H
+#define LDGRAPHY_JOB_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http-util.h"
+#include "image-processing.h"
+
+// Minimal HTTP server, only listening on localhost, to upload images to
+// expose.
+//
+//   POST /job   PNG image as body; chunked transfer encoding or with
+//               Content-Length. The image is decoded while it is uploaded,
+//               so it is ready right after the last byte arrived. Replies
+//               with the job id and the artwork id once the job is queued.
+//   POST /job?artwork=<id>
+//               Expose the same artwork again, if it is still cached; no body.
+//               Replies 404 if not.
+//   GET /events Server-sent events with the progress of all jobs: upload,
+//               queued, exposing and done.
+//   GET /status Machine state, remaining time, queue length and cached
+//               artwork ids as JSON; for the job dispatcher.
+class JobServer {
+public:
+    enum MachineState {
+        MACHINE_IDLE,        // Waiting for a job.
+        MACHINE_LOADING,     // Preparing image, moving the sled.
+        MACHINE_EXPOSING,
+        MACHINE_UNLOADING,   // Waiting for the board to be taken out.
+    };
+
+    struct Job {
+        int id;
+        std::unique_ptr<BitmapImage> image;
+        double dpi_x, dpi_y;   // As found in the image; -1 if not known.
+    };
+
+    // "invert" is passed to the PNG decoding.
+    explicit JobServer(bool invert);
+    ~JobServer();
+
+    // Start listening on the given port. Returns false and prints a message
+    // on failure.
+    bool Start(int port);
+
+    // Wait until the next job is fully received and decoded and return it.
+    // Returns false if the server is shut down.
+    bool NextJob(Job *job);
+
+    // Send event of given type with the JSON "data" to all event listeners.
+    void PublishEvent(const char *type, const char *json_data);
+
+    // Report what the machine is doing for /status, with the estimated
+    // seconds until done with the current job; -1 if not known. NextJob()
+    // switches to idle while waiting and to loading once it has a job.
+    void SetMachineState(MachineState state, int remaining_sec);
+
+    void Shutdown();
+
+private:
+    void AcceptLoop();
+    void HandleConnection(int fd);
+    // Uploaded PNG, decoded again when exposed again. Keeping the compressed
+    // image instead of the bitmap costs a fraction of the memory.
+    struct Artwork {
+        uint64_t id;       // Hash of the uploaded PNG.
+        std::shared_ptr<const std::string> png;
+    };
+
+    void HandleUpload(int fd, const HttpRequestHeader &header,
+                      std::string *pending);
+    void HandleCachedArtwork(int fd, const std::string &query);
+    void SendStatus(int fd);
+    void QueueJob(int fd, Job *job, uint64_t artwork_id, long bytes);
+    void PublishJobProgress(int job_id, const char *type, long bytes);
+
+    const bool invert_;
+    int listen_fd_;
+    std::thread accept_thread_;
+
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    bool shutdown_;
+    int next_job_id_;
+    std::deque<Job*> jobs_;
+    std::set<int> connections_;          // Active, for shutdown.
+    int active_handlers_;
+    std::condition_variable handlers_done_;
+    std::vector<int> event_listeners_;
+
+    MachineState machine_state_;
+    int current_job_id_;
+    int remaining_sec_;
+    std::deque<Artwork*> artwork_;       // Most recently used first.
+};
+
+#endif  // LDGRAPHY_JOB_SERVER_H
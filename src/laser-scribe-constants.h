@@ -20,36 +20,100 @@
 #define LASER_SCRIBE_CONSTANTS_H
 
 // Commands sent in the header.
-#define CMD_EMPTY   0
+#define CMD_EMPTY   0  // Not in an item; the PRU's view of an empty ring.
 #define CMD_SCAN_DATA  1
 #define CMD_SCAN_DATA_NO_SLED  2
 #define CMD_EXIT    3
-#define CMD_DONE    4
+#define CMD_SPINUP  5  // Only spin up mirror and sync; data follows later.
 
 // Potential error reporting
 #define ERROR_NONE         0
 #define ERROR_DEBUG_BREAK  1  // For debugging 'breakpoints'
 #define ERROR_MIRROR_SYNC  2  // Mirror failed to sync.
-#define ERROR_TIME_OVERRUN 3  // state machine did not finish within TICK_DELAY
+#define ERROR_TIME_OVERRUN 3  // state machine did not finish within tick delay
 
 // The data per segment is sent in a bit-array. The laser covers about half
 // the range of the 120 degrees it can do, wo we only send bits for the
 // first half of global time ticks.
-#define SCANLINE_HEADER_SIZE 1   // A single byte containing the command.
-#define SCANLINE_DATA_SIZE 512   // Bytes that follow, containing the bit-set.
+// The number of bits per line depends on the machine profile. Each item
+// has room for the whole line, but only a window of it is read, typically
+// the bytes between the first and last one that has any dots set. Bytes are
+// at their position in the line, so the host can write lines right into an
+// item. Everything outside the window is laser off.
+#define SCANLINE_HEADER_SIZE 8   // Command byte, data window, padding.
+#define SCANLINE_WINDOW_POS  2   // uint16_t start, uint16_t length in bytes.
+#define SCANLINE_DATA_SIZE 512   // Default bytes per line.
+#define SCANLINE_MAX_DATA_SIZE 1536  // Leaves room for five items in DRAM.
 
-#define SCANLINE_ITEM_SIZE (SCANLINE_HEADER_SIZE + SCANLINE_DATA_SIZE)
+// Layout of the PRU data memory shared with the host.
+#define PRU_DATA_RAM_SIZE 8192
+#define ERROR_RESULT_POS 0   // Byte with error status.
+#define HALTED_POS       1   // Byte set to 1 by the PRU once it stopped.
+#define PARAMETER_POS    4   // uint32_t parameters, written by host.
+#define PARAM_TICK_DELAY               (PARAMETER_POS + 0)
+#define PARAM_TICKS_PER_MIRROR_SEGMENT (PARAMETER_POS + 4)
+#define PARAM_JITTER_ALLOW             (PARAMETER_POS + 8)
+#define PARAM_ITEM_SIZE                (PARAMETER_POS + 12)  // Ring item
+#define PARAM_RINGBUFFER_END           (PARAMETER_POS + 16)
+#define PARAM_STABLE_FACETS            (PARAMETER_POS + 20)  // Up to 255.
+#define PARAM_LOW_WATER                (PARAMETER_POS + 24)  // Items
+#define CYCLE_STATS_POS 32   // NUM_STATE_IDS uint32_t
 
-#define QUEUE_LEN 8
+// The ring buffer is owned via two free running uint32_t item counters, each
+// written by one side only and in a cache line of its own: the host
+// publishes items by advancing the producer index, the PRU hands them back
+// by advancing the consumer index. Items from consumer to producer index
+// belong to the PRU. The PRU only interrupts the host when no more than
+// PARAM_LOW_WATER items are left, so the host can refill many at once.
+#define PRODUCER_INDEX_POS 128
+#define CONSUMER_INDEX_POS 192
+#define START_RINGBUFFER   256  // Items of PARAM_ITEM_SIZE until end of memory.
+
+// State machine states, as index into the cycle statistics: for each state,
+// the PRU records the maximum CPU cycles used in a tick as uint32_t.
+#define STATE_ID_IDLE               0
+#define STATE_ID_SPINUP             1
+#define STATE_ID_WAIT_STABLE        2
+#define STATE_ID_CONFIRM_STABLE     3
+#define STATE_ID_HOLD_SYNC          4
+#define STATE_ID_DATA_WAIT_FOR_SYNC 5
+#define STATE_ID_DATA_RUN           6
+#define STATE_ID_ADVANCE_RINGBUFFER 7
+#define STATE_ID_AWAIT_MORE_DATA    8
+#define NUM_STATE_IDS               9
+
+// Defaults for the timing parameters; the actual values come from the
+// machine profile (see machine-profile.h) and are passed at runtime.
 
 // This is the CPU cycles (on the 200Mhz CPU) between each laser dot,
 // determining the pixel clock.
 // Other values are derived from this.
 #define TICK_DELAY 75
 
+// The PRU cycle counter, reset at the beginning of each tick.
+#define PRUSS_PRU_CTL         0x22000
+#define CYCLE_COUNTER_OFFSET  0x0C
+
+// Cycles per tick used for reading the counter and waiting for the next
+// tick; the rest of the tick delay is available to the states. The build
+// checks with pru-cycle-budget that the worst case fits.
+#define TICK_OVERHEAD_CYCLES 14
+
 // Each mirror segment is this number of pixel ticks long (only the first
 // 8*SCANLINE_DATA_SIZE are filled with pixels, the rest is dead part of the
 // segment).
 #define TICKS_PER_MIRROR_SEGMENT 11000
 
+// Time in ticks the state machine waits in certain states.
+#define SPINUP_MIN_TICKS      400000  // Spinup, laser off
+#define SPINUP_TICKS         4000000  // Spinup time of a mirror from standstill.
+#define MAX_WAIT_STABLE_TIME 3000000  // laser pulsed, while waiting for sync.
+
+// After the minimum spinup, we look for the mirror to be stable for a
+// number of consecutive facets. Give up if this takes longer than a full
+// spinup and waiting for sync.
+#define SPINUP_TIMEOUT (SPINUP_TICKS - SPINUP_MIN_TICKS + MAX_WAIT_STABLE_TIME)
+#define END_OF_DATA_WAIT     2000000  // No data for this time - finish.
+#define SPINUP_HOLD_WAIT   160000000  // ~1min synced after CMD_SPINUP w/o data
+
 #endif // LASER_SCRIBE_CONSTANTS_H
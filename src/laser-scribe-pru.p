@@ -28,12 +28,6 @@
 #define PRU0_ARM_INTERRUPT 19
 #define CONST_PRUDRAM	   C24
 
-#define ERROR_RESULT_POS 0
-#define START_RINGBUFFER 1
-
-#define PRUSS_PRU_CTL      0x22000
-#define CYCLE_COUNTER_OFFSET  0x0C
-
 #define GPIO_0_BASE       0x44e07000
 #define GPIO_1_BASE       0x4804c000
 
@@ -50,31 +44,31 @@
 #define GPIO_SLED_DIR 18      // GPIO_1, PIN_P9_14
 #define GPIO_SLED_STEP 16     // GPIO_1, PIN_P9_15
 
-#define JITTER_ALLOW (TICKS_PER_MIRROR_SEGMENT/100)
-
-// Cycles to spin up mirror.
-#define SPINUP_TICKS         4000000 ; Spinup, laser off
-#define MAX_WAIT_STABLE_TIME 3000000 ; laser on, while waiting for sync.
-#define END_OF_DATA_WAIT     2000000 ; No data for this time - finish.
-
 // Mapping some fixed registers to named variables.
 // We have enough registers to keep things readable.
 .struct Variables
 	;; Some convenient constants. 32 bit values cannot be given as
 	;; immediate, so we have to store them in registers.
-	.u32 gpio_0_read
-	.u32 gpio_1_read
 	.u32 gpio_0_write
 	.u32 gpio_1_write
 
-	.u32 ringbuffer_size
-	.u32 item_size
+	.u32 ringbuffer_end
+	.u16 data_begin		; Window of current line with data, in bytes.
+	.u16 data_end
 
 	.u32 start_sync_after	; time after which we should start sync.
 
+	;; Timing parameters from the machine profile, set by the host.
+	.u32 tick_delay		; CPU cycles per tick.
+	.u32 ticks_per_segment	; Ticks per mirror segment.
+	.u32 jitter_allow	; Allowed hsync period deviation in ticks.
+
 	;; Variables used.
 	.u32 gpio_out0	   ; Stuff we write out GPIO. Bits for polygon + laser
 	.u32 gpio_out1	   ; Stuff we write out to GPIO. Bits step/dir/enable
+	.u8  sled_owned	   ; If 0, host still moves sled: don't write GPIO-1
+	.u8  stable_facets	; Hsyncs needed in a row for stable mirror.
+	.u8  stable_count	; Hsyncs in a row so far.
 
 	.u32 global_time	; our cycle time.
 
@@ -86,16 +80,16 @@
 
 
 	.u32 item_start	   ; Start position of current item in ringbuffer
-	.u32 item_pos		; position within item.
+	.u32 item_pos		; byte position within line.
 
 	.u16 state		; Current state machine state.
 	.u8  bit_loop		; bit loop
 	.u8  last_hsync_bit	; so that we can trigger on an edge
 .ends
-.assign Variables, r10, r27, v
+.assign Variables, r10, r29, v
 
 ;; Registers
-;; r1 ... r9 : common use
+;; r1 ... r9 : common use, except r4: state for cycle statistics.
 ;; r10 ... named variables
 
 .macro branch_if_not_between
@@ -109,7 +103,8 @@
 // HSync reading via LBBO. Seems to be pretty slow.
 .macro branch_if_hsync_gpio
 .mparam to_label
-	LBBO r5, v.gpio_1_read, 0, 4
+	MOV r5, GPIO_1_BASE | GPIO_DATAIN
+	LBBO r5, r5, 0, 4
 	QBBC bit_is_clear, r5, GPIO_HSYNC_IN
 	QBEQ no_hsync, v.last_hsync_bit, 1 ; we are only interested in 0->1 edge
 	MOV v.last_hsync_bit, 1
@@ -152,13 +147,60 @@ no_hsync:
 	SBBO r6, r5, 0, 4
 .endm
 
+// Account the cycles of the current tick to the given state (STATE_ID_*).
+// r4 is reserved for this: it holds the position of the state in the cycle
+// statistics table in DRAM.
+.macro account_to_state
+.mparam id
+	MOV r4, CYCLE_STATS_POS + 4 * id
+.endm
+
+;; Read the data window from the header of the current item and start at
+;; the beginning of the line.
+.macro load_data_window
+	ADD r2, v.item_start, SCANLINE_WINDOW_POS
+	LBCO r1, CONST_PRUDRAM, r2, 4	; r1.w0: start; r1.w2: length
+	MOV v.data_begin, r1.w0
+	ADD v.data_end, r1.w0, r1.w2
+	MOV v.item_pos, 0
+	MOV v.bit_loop, 7
+.endm
+
+;; Done with the current item: hand it back to the host and go to the next.
+;; The host is only interrupted once the ring buffer runs low, so that it
+;; refills many items in one go.
+.macro consume_item
+	LBCO r2, CONST_PRUDRAM, CONSUMER_INDEX_POS, 4
+	ADD r2, r2, 1
+	SBCO r2, CONST_PRUDRAM, CONSUMER_INDEX_POS, 4
+
+	LBCO r3, CONST_PRUDRAM, PARAM_ITEM_SIZE, 4
+	ADD v.item_start, v.item_start, r3 ; advance in ringbuffer
+	QBLT rb_advanced, v.ringbuffer_end, v.item_start ; item_start < rb_end
+	MOV v.item_start, START_RINGBUFFER	; Wrap around
+rb_advanced:
+	LBCO r3, CONST_PRUDRAM, PRODUCER_INDEX_POS, 4
+	SUB r3, r3, r2			; Items left.
+	LBCO r2, CONST_PRUDRAM, PARAM_LOW_WATER, 4
+	QBLT consume_done, r3, r2	; Still more than low water.
+	MOV R31.b0, PRU0_ARM_INTERRUPT+16 ; tell host to refill.
+consume_done:
+.endm
+
 .macro wait_to_next_tick_and_reset
-.mparam value
+.mparam cycles			; Register containing cycles per tick.
 	MOV r7, PRUSS_PRU_CTL
 	// Reading this register takes 4 cpu cycles. So we read it and
 	// then do the remaining time with a busy loop.
 	LBBO r9, r7, CYCLE_COUNTER_OFFSET, 4 ; get current counter
-	MOV r8, (value - 10)		     ; account for some overhead
+
+	// Keep maximum cycles used per state, so that the host can see how
+	// much headroom we have.
+	LBCO r8, CONST_PRUDRAM, r4, 4	     ; max cycles seen so far
+	QBGE no_new_max, r9, r8		     ; if (r9 <= max) goto no_new_max
+	SBCO r9, CONST_PRUDRAM, r4, 4
+no_new_max:
+	SUB r8, cycles, TICK_OVERHEAD_CYCLES ; account for some overhead
 	QBGT REPORT_ERROR_TIME_OVERRUN, r8, r9 ; Error. Optimize state machine!
 	SUB r9, r8, r9			     ; remaining CPU cycles
 	QBGE end_loop, r9, 1		     ; if (i <= 1) goto end_loop
@@ -181,16 +223,21 @@ INIT:
 	SBCO r0, C4, 4, 4
 
 	;; Populate some constants
-	MOV v.gpio_0_read, GPIO_0_BASE | GPIO_DATAIN
-	MOV v.gpio_1_read, GPIO_1_BASE | GPIO_DATAIN
 	MOV v.gpio_0_write, GPIO_0_BASE | GPIO_DATAOUT
 	MOV v.gpio_1_write, GPIO_1_BASE | GPIO_DATAOUT
-	MOV v.item_size, SCANLINE_ITEM_SIZE
-	MOV v.ringbuffer_size, SCANLINE_ITEM_SIZE * QUEUE_LEN
+
+	;; Timing parameters and line length depend on the machine, the host
+	;; tells us.
+	LBCO v.ringbuffer_end, CONST_PRUDRAM, PARAM_RINGBUFFER_END, 4
+	LBCO v.tick_delay, CONST_PRUDRAM, PARAM_TICK_DELAY, 4
+	LBCO v.ticks_per_segment, CONST_PRUDRAM, PARAM_TICKS_PER_MIRROR_SEGMENT, 4
+	LBCO v.jitter_allow, CONST_PRUDRAM, PARAM_JITTER_ALLOW, 4
+	LBCO v.stable_facets, CONST_PRUDRAM, PARAM_STABLE_FACETS, 1
 
 	;; switch the laser full on at this period so that we reliably hit the
 	;; hsync sensor.
-	MOV v.start_sync_after, TICKS_PER_MIRROR_SEGMENT - 2*JITTER_ALLOW
+	SUB v.start_sync_after, v.ticks_per_segment, v.jitter_allow
+	SUB v.start_sync_after, v.start_sync_after, v.jitter_allow
 
 	;; Set GPIO bits to writable. Output bits need to be set to 0.
 	;; GPIO-0
@@ -205,6 +252,7 @@ INIT:
 
 	MOV v.gpio_out0, 0
 	MOV v.gpio_out1, 0
+	MOV v.sled_owned, 0	; Until we get data, the host might move the sled.
 
 	SET v.gpio_out1, GPIO_MOTORS_ENABLE ; negative logic, so motors off.
 	CLR v.gpio_out1, GPIO_SLED_DIR ; direction needs changing later.
@@ -212,73 +260,99 @@ INIT:
 
 	MOV v.item_start, START_RINGBUFFER    ; Byte position in DRAM
 	MOV v.state, STATE_IDLE
+	account_to_state STATE_ID_IDLE
 
 	start_cpu_cycle_counter
 
 MAIN_LOOP:
+	;; Command of the current item in r1.b0 for the states; CMD_EMPTY if
+	;; the host has not published it yet.
+	MOV r1.b0, CMD_EMPTY
+	LBCO r2, CONST_PRUDRAM, PRODUCER_INDEX_POS, 4
+	LBCO r3, CONST_PRUDRAM, CONSUMER_INDEX_POS, 4
+	QBEQ main_loop_dispatch, r2, r3
 	LBCO r1.b0, CONST_PRUDRAM, v.item_start, 1 ; read header
 	QBEQ FINISH, r1.b0, CMD_EXIT		   ; react to exit immediately
-
+main_loop_dispatch:
 	JMP v.state		; switch/case with direct jump :)
 
-	;; Each of these states must not use more than TICK_DELAY steps
+	;; Each of these states must not use more than tick_delay steps
 
 	;; Waiting for Data to arrive
 STATE_IDLE:
+	account_to_state STATE_ID_IDLE
 	;; Command is in r1.b0
 	QBEQ FINISH, r1.b0, CMD_EXIT
 	QBEQ MAIN_LOOP_NEXT, r1.b0, CMD_EMPTY
+	QBNE idle_data_arrived, r1.b0, CMD_SPINUP
+	;; Only spin up for now; the host is still busy moving the sled, so
+	;; we leave GPIO-1 alone. Acknowledge by consuming the item.
+	consume_item
+	JMP idle_start_spinup
+idle_data_arrived:
+	MOV v.sled_owned, 1
+	CLR v.gpio_out1, GPIO_MOTORS_ENABLE ; negative logic
+idle_start_spinup:
 	MOV v.global_time, 0	; have monotone increasing time for 1h or so
-	MOV v.wait_countdown, SPINUP_TICKS
+	MOV v.wait_countdown, SPINUP_MIN_TICKS
 	MOV v.polygon_time, 0
 	MOV v.state, STATE_SPINUP
-	CLR v.gpio_out1, GPIO_MOTORS_ENABLE ; negative logic
-
-	;; prepare data
-	MOV v.item_pos, SCANLINE_HEADER_SIZE 		; Start after header
-	MOV v.bit_loop, 7
-
 	JMP MAIN_LOOP_NEXT
 
-	;; Spinup. The mirror takes a second or so until it is ready,
-	;; don't switch on the laser quite yet.
+	;; Spinup. From standstill, the mirror takes a second or so until it is
+	;; ready, but it might just as well be running already. Wait a little
+	;; with the laser off, so that it is at least moving.
 STATE_SPINUP:
+	account_to_state STATE_ID_SPINUP
 	SUB v.wait_countdown, v.wait_countdown, 1
 	QBEQ spinup_done, v.wait_countdown, 0
 	JMP MAIN_LOOP_NEXT
 spinup_done:
-	SET v.gpio_out0, GPIO_LASER_DATA	; Now: laser on
-	MOV v.wait_countdown, MAX_WAIT_STABLE_TIME
+	MOV v.wait_countdown, SPINUP_TIMEOUT
+	MOV v.stable_count, 0
+	MOV v.sync_laser_on_time, 0	; laser on until the first hsync
 	MOV v.state, STATE_WAIT_STABLE
 	JMP MAIN_LOOP_NEXT
 
-	;; Switch on the laser the full time and wait until we get it within
-	;; some acceptable margin. Sometimes, mirrors have a harder time
-	;; synchronizing in the beginning. We wait until we are stable.
+	;; Wait until the hsync period is within the jitter window for
+	;; stable_facets facets in a row. Sometimes, mirrors have a harder time
+	;; synchronizing in the beginning. The laser is not on all the time:
+	;; after each hsync, it is off until shortly before the next one would
+	;; be expected at full speed. While the mirror is still slow, it stays
+	;; on from then until the late hsync arrives.
 STATE_WAIT_STABLE:
+	account_to_state STATE_ID_WAIT_STABLE
 	;; If we are too long waiting for a sync, assume there is an issue
 	;; with the laser not properly rotating or no feedback.
 	SUB v.wait_countdown, v.wait_countdown, 1
 	QBEQ REPORT_ERROR_MIRROR, v.wait_countdown, 0
 
+	QBLT MAIN_LOOP_NEXT, v.sync_laser_on_time, v.global_time ; not yet
+	SET v.gpio_out0, GPIO_LASER_DATA
 	branch_if_hsync wait_stable_hsync_seen
-	JMP MAIN_LOOP_NEXT	; todo: account for cpu-cycles
+	JMP MAIN_LOOP_NEXT
 wait_stable_hsync_seen:
+	CLR v.gpio_out0, GPIO_LASER_DATA   ; hsync finished.
+	ADD v.sync_laser_on_time, v.hsync_time, v.start_sync_after
 	SUB r1, v.hsync_time, v.last_hsync_time
 	MOV v.last_hsync_time, v.hsync_time
-	branch_if_not_between wait_stable_not_synced_yet, r1, TICKS_PER_MIRROR_SEGMENT-JITTER_ALLOW, TICKS_PER_MIRROR_SEGMENT+JITTER_ALLOW
-	CLR v.gpio_out0, GPIO_LASER_DATA   ; laser off for now
-	ADD v.sync_laser_on_time, v.hsync_time, v.start_sync_after ; laser on then
+	SUB r2, v.ticks_per_segment, v.jitter_allow
+	ADD r3, v.ticks_per_segment, v.jitter_allow
+	branch_if_not_between wait_stable_not_synced_yet, r1, r2, r3
+	ADD v.stable_count, v.stable_count, 1
+	QBGT MAIN_LOOP_NEXT, v.stable_count, v.stable_facets ; not long enough
 	MOV v.state, STATE_CONFIRM_STABLE
 	JMP MAIN_LOOP_NEXT
 
 wait_stable_not_synced_yet:
+	MOV v.stable_count, 0
 	JMP MAIN_LOOP_NEXT
 
 	;; We got synchronization and know when it is time to switch on
 	;; the laser to get the next synchronization. Let's see if we can repeat
 	;; this.
 STATE_CONFIRM_STABLE:
+	account_to_state STATE_ID_CONFIRM_STABLE
 	QBLT MAIN_LOOP_NEXT, v.sync_laser_on_time, v.global_time
 	SET v.gpio_out0, GPIO_LASER_DATA
 confirm_stable_test_for_hsync:
@@ -288,11 +362,42 @@ confirm_stable_hsync_seen:
 	CLR v.gpio_out0, GPIO_LASER_DATA ; hsync finished.
 	ADD v.sync_laser_on_time, v.hsync_time, v.start_sync_after
 	/* todo: test if in between expected range, otherwise state wait stable */
+	QBNE start_data_run, r1.b0, CMD_EMPTY ; command from MAIN_LOOP
+	;; Spun up with CMD_SPINUP, but no data yet. Stay in sync until it comes.
+	MOV v.wait_countdown, SPINUP_HOLD_WAIT
+	MOV v.state, STATE_HOLD_SYNC
+	JMP MAIN_LOOP_NEXT
+start_data_run:
+	MOV v.sled_owned, 1	; Host is done with the sled once data arrives.
+	CLR v.gpio_out1, GPIO_MOTORS_ENABLE ; negative logic
+	load_data_window
 	MOV v.state, STATE_DATA_RUN
 	JMP MAIN_LOOP_NEXT
 
+	;; Mirror is synchronized, but the first data has not arrived yet. Keep
+	;; following the hsync, so that we can start right away once it does.
+STATE_HOLD_SYNC:
+	account_to_state STATE_ID_HOLD_SYNC
+	SUB v.wait_countdown, v.wait_countdown, 1
+	QBEQ hold_sync_timeout, v.wait_countdown, 0
+	QBLT MAIN_LOOP_NEXT, v.sync_laser_on_time, v.global_time ; not yet
+	SET v.gpio_out0, GPIO_LASER_DATA
+	branch_if_hsync hold_sync_hsync_seen
+	JMP MAIN_LOOP_NEXT
+hold_sync_hsync_seen:
+	CLR v.gpio_out0, GPIO_LASER_DATA ; hsync finished.
+	ADD v.sync_laser_on_time, v.hsync_time, v.start_sync_after
+	QBNE start_data_run, r1.b0, CMD_EMPTY ; command from MAIN_LOOP
+	JMP MAIN_LOOP_NEXT
+hold_sync_timeout:
+	;; Nobody sent data. Go back to idle; data will trigger a new spinup.
+	CLR v.gpio_out0, GPIO_LASER_DATA
+	MOV v.state, STATE_IDLE
+	JMP MAIN_LOOP_NEXT
+
 	;; Sync step between data lines.
 STATE_DATA_WAIT_FOR_SYNC:
+	account_to_state STATE_ID_DATA_WAIT_FOR_SYNC
 	QBLT MAIN_LOOP_NEXT, v.sync_laser_on_time, v.global_time ; not yet
 	;; Now we are close enough to the hsync-block, switch on the laser.
 	SET v.gpio_out0, GPIO_LASER_DATA
@@ -310,17 +415,22 @@ wait_for_sync_hsync_seen:
 	JMP MAIN_LOOP_NEXT
 
 	;; Loop to send all the data. We go through each byte, and within that
-	;; through each bit, once per state.
+	;; through each bit, once per state. Before the data window, the laser
+	;; stays off; once we reach its end, the line is done.
 STATE_DATA_RUN:
-	MOV r1, v.item_size
-	QBLT data_run_data_output, r1, v.item_pos
+	account_to_state STATE_ID_DATA_RUN
+	QBLT data_run_data_output, v.data_end, v.item_pos ; item_pos < data_end
 	MOV v.state, STATE_ADVANCE_RINGBUFFER
 	JMP MAIN_LOOP_NEXT
 data_run_data_output:
+	QBLE data_run_in_window, v.item_pos, v.data_begin ; data_begin <= item_pos
+	CLR v.gpio_out0, GPIO_LASER_DATA
+	JMP data_laser_set_done
+data_run_in_window:
 	;; super lazy, we read the full byte every time, this needs
 	;; to be optimized.
-	MOV r2, v.item_start
-	ADD r2, r2, v.item_pos
+	ADD r2, v.item_pos, v.item_start
+	ADD r2, r2, SCANLINE_HEADER_SIZE
 	LBCO r1.b0, CONST_PRUDRAM, r2, 1
 
 	QBBS data_laser_set_on, r1.b0, v.bit_loop
@@ -340,6 +450,7 @@ data_run_next_byte:
 
 	;;  not really necessary to be its own state.
 STATE_ADVANCE_RINGBUFFER:
+	account_to_state STATE_ID_ADVANCE_RINGBUFFER
 	CLR v.gpio_out0, GPIO_LASER_DATA ; not needed now.
 
 	;; check if we need to advance stepper
@@ -347,20 +458,13 @@ STATE_ADVANCE_RINGBUFFER:
 	QBEQ advance_sled_done, r1.b0, CMD_SCAN_DATA_NO_SLED
 	SET v.gpio_out1, GPIO_SLED_STEP
 advance_sled_done:
-	;; signal host that we're done with this item.
-	MOV r1.b0, CMD_EMPTY
-	SBCO r1.b0, CONST_PRUDRAM, v.item_start, 1
-	MOV R31.b0, PRU0_ARM_INTERRUPT+16 ; tell that status changed.
-
-	ADD v.item_start, v.item_start, v.item_size ; advance in ringbuffer
-	QBLT rb_advanced, v.ringbuffer_size, v.item_start ; item_start < rb_sizes
-	MOV v.item_start, START_RINGBUFFER	; Wrap around
-rb_advanced:
+	consume_item
 	MOV v.wait_countdown, END_OF_DATA_WAIT
 	MOV v.state, STATE_AWAIT_MORE_DATA
 	JMP MAIN_LOOP_NEXT
 
 STATE_AWAIT_MORE_DATA:
+	account_to_state STATE_ID_AWAIT_MORE_DATA
 	SUB v.wait_countdown, v.wait_countdown, 1
 	QBNE active_data_wait, v.wait_countdown, 0
 	;; ok, we waited too long, let's switch off motors and go back
@@ -370,12 +474,9 @@ STATE_AWAIT_MORE_DATA:
 	JMP MAIN_LOOP_NEXT
 
 active_data_wait:
-	LBCO r1.b0, CONST_PRUDRAM, v.item_start, 1 ; read header
-	QBEQ FINISH, r1.b0, CMD_EXIT
-	QBEQ MAIN_LOOP_NEXT, r1.b0, CMD_EMPTY
+	QBEQ MAIN_LOOP_NEXT, r1.b0, CMD_EMPTY ; command from MAIN_LOOP
 
-	MOV v.item_pos, SCANLINE_HEADER_SIZE 		; Start after header
-	MOV v.bit_loop, 7
+	load_data_window
 
 	MOV v.state, STATE_DATA_WAIT_FOR_SYNC
 	JMP MAIN_LOOP_NEXT
@@ -383,7 +484,7 @@ active_data_wait:
 MAIN_LOOP_NEXT:
 	;; The current state set whatever state it needed, now wait for the
 	;; end of our period to execute the actions: set GPIO bits.
-	wait_to_next_tick_and_reset TICK_DELAY
+	wait_to_next_tick_and_reset v.tick_delay
 	XOR r30, r30, (1<<5)	; debug output
 
 	;; Global time update. The global time wraps around after 1h or so
@@ -392,7 +493,7 @@ MAIN_LOOP_NEXT:
 
 	;; time for mirror toggle ?
 	ADD v.polygon_time, v.polygon_time, 1
-	MOV r1, TICKS_PER_MIRROR_SEGMENT/2
+	LSR r1, v.ticks_per_segment, 1	; half a segment
 	QBLT mirror_toggle_done, r1, v.polygon_time
 	MOV r1, (1<<GPIO_MIRROR_CLOCK)
 	XOR v.gpio_out0, v.gpio_out0, r1
@@ -401,7 +502,9 @@ mirror_toggle_done:
 
 	;; GPIO out, once per loop.
 	SBBO v.gpio_out0, v.gpio_0_write, 0, 4
+	QBEQ gpio_1_done, v.sled_owned, 0 ; Host still moving sled; hands off.
 	SBBO v.gpio_out1, v.gpio_1_write, 0, 4
+gpio_1_done:
 
 	JMP MAIN_LOOP
 
@@ -412,9 +515,9 @@ FINISH:
 	SET r1, r1, GPIO_MOTORS_ENABLE ; Well, and the motor ~enable
 	SBBO r1, v.gpio_1_write, 0, 4
 
-	;; Tell host that we've seen the CMD_EXIT and acknowledge with CMD_DONE
-	MOV r1.b0, CMD_DONE
-	SBCO r1.b0, CONST_PRUDRAM, v.item_start, 1
+	;; Tell host that we've seen the CMD_EXIT or stopped with an error.
+	MOV r1.b0, 1
+	SBCO r1.b0, CONST_PRUDRAM, HALTED_POS, 1
 	MOV R31.b0, PRU0_ARM_INTERRUPT+16 ; Tell that we're done.
 
 	HALT
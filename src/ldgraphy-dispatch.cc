@@ -0,0 +1,81 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Job queue in front of several LDGraphy machines.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "job-dispatcher.h"
+
+volatile bool s_interrupt_received = false;
+static void InterruptHandler(int) {
+  s_interrupt_received = true;
+}
+
+static int usage(const char *progname, const char *errmsg = NULL) {
+    if (errmsg) {
+        fprintf(stderr, "\n%s\n\n", errmsg);
+    }
+    fprintf(stderr, "Usage:\n%s [options] <host:port> [<host:port>...]\n"
+            "Dispatch jobs to machines, each running 'ldgraphy -W <port>'.\n",
+            progname);
+    fprintf(stderr, "Options:\n"
+            "\t-W <port>  : Accept jobs on http://localhost:<port>/job; "
+            "required.\n"
+            "\t-h         : This help\n");
+    return errmsg ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int port = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "hW:")) != -1) {
+        switch (opt) {
+        case 'h': return usage(argv[0]);
+        case 'W':
+            port = atoi(optarg);
+            if (port <= 0)
+                return usage(argv[0], "Invalid port");
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (port < 0)
+        return usage(argv[0], "Need a port to accept jobs on.");
+    if (optind >= argc)
+        return usage(argv[0], "Need at least one machine.");
+
+    JobDispatcher dispatcher;
+    for (int i = optind; i < argc; ++i) {
+        if (!dispatcher.AddMachine(argv[i]))
+            return usage(argv[0]);
+    }
+    if (!dispatcher.Start(port))
+        return 1;
+
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGINT, InterruptHandler);
+    dispatcher.Run([]() { return !s_interrupt_received; });
+    fprintf(stderr, "Exiting; jobs not dispatched yet are dropped.\n");
+    return 0;
+}
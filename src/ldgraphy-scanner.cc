@@ -24,9 +24,13 @@
 #include <string.h>
 
 #include "scanline-sender.h"
+#include "scanline-source.h"
 #include "image-processing.h"
 #include "laser-scribe-constants.h"
+#include "machine-profile.h"
+#include "metrics.h"
 #include "sled-control.h"
+#include "test-pattern.h"
 
 #ifndef LDGRAPHY_DEBUG_OUTPUTS
 #  define LDGRAPHY_DEBUG_OUTPUTS 0
@@ -38,6 +42,9 @@
 // Output images to TMP to observe the image processing progress.
 constexpr bool debug_images = false;
 
+// Number of scanlines prepared ahead of the exposure.
+constexpr int kScanlinesReadAhead = 1024;
+
 /*
  * Most of the following parameters are dependent on the particular
  * machine built. We should probably have a common header or configuration
@@ -63,68 +70,58 @@ constexpr float kLaserOpticalPowerMilliwatt = 100;
 constexpr float kFocus_Sled_Dia = 0.07; // mm sled direction X
 constexpr float kFocus_Scan_Dia = 0.1;  // mm scan direction Y
 
-constexpr int SCAN_PIXELS = SCANLINE_DATA_SIZE * 8;
 constexpr float deg2rad = 2*M_PI/360;
 
-/*
- * These are constants that depend on the set-up of the LDGraphy hardware.
- */
-constexpr int kHSyncShoulder = 200;   // Distance between sensor and start
-
-// The kMirrorFrequency is a multiple of the laser pixel clock frequency.
-constexpr float kMirrorTicks = TICKS_PER_MIRROR_SEGMENT;
-constexpr float kLaserPixelFrequency = 200e6 / TICK_DELAY;
-constexpr float kMirrorLineFrequency = kLaserPixelFrequency / kMirrorTicks;
-
-// The SCAN_PIXELS only cover part of the full segment, to better utilize
-// the bits in the usable area.
-constexpr float kDataFraction = SCAN_PIXELS / kMirrorTicks;
-
-constexpr int kMirrorFaces = 6;
-// Reflection is 2*angle.
-constexpr float kMirrorThrowAngleRad = 2 * (360 / kMirrorFaces) * deg2rad;
-constexpr float kSegmentAngleRad = kMirrorThrowAngleRad * kDataFraction;
-
 // TODO(hzeller): read these numbers from the same source in the PostScript
 // file and here.
 constexpr float bed_length = 162.0;  // Sled length.
 
-// Width of the laser to throw. Comes from the case calculation.
-// Fudge value from real life :)
+// The hardware dependent values, such as the pixel clock, mirror and
+// geometry of the laser scan are coming from the MachineProfile.
+#if LDGRAPHY_CONE_MIRROR
+// Cone mirror. Experimental. The bed width is derived from the fixed radius.
+constexpr float kConeRadiusMM = 53.0f;
+#endif
+
+// Distance between the polygon mirror and the bed.
+static float ScanRadiusMM(const MachineProfile &profile) {
 #if !LDGRAPHY_CONE_MIRROR
-// straight mirror
-constexpr float bed_width_fudge_value = -1.88;  // Measured :)
-constexpr float bed_width  = 102.0 + bed_width_fudge_value;
-constexpr float kScanAngleRad = 40.0 * deg2rad;
-constexpr float kRadiusMM = (bed_width/2) / tan(kScanAngleRad / 2);
+    return (profile.bed_width_mm / 2) / tan(profile.scan_angle_rad() / 2);
 #else
-// Cone mirror. Experimental.
-constexpr float kScanAngleRad = 90.0f * deg2rad;
-constexpr float kRadiusMM = 53.0f;
-constexpr float bed_width = 2 * sin(kScanAngleRad/2) * kRadiusMM;
+    return kConeRadiusMM;
 #endif
+}
 
-LDGraphyScanner::LDGraphyScanner(float exposure_factor)
-    : exposure_factor_(roundf(exposure_factor)),  // We only do integer for now.
+LDGraphyScanner::LDGraphyScanner(const MachineProfile &profile,
+                                 float exposure_factor)
+    : profile_(profile),
+      exposure_factor_(roundf(exposure_factor)),  // We only do integer for now.
       laser_sled_dot_size_(kFocus_Sled_Dia),
-      laser_scan_dot_size_(kFocus_Scan_Dia)
+      laser_scan_dot_size_(kFocus_Scan_Dia),
+      source_used_(false)
 {
     assert(exposure_factor >= 1);
+#if LDGRAPHY_CONE_MIRROR
+    profile_.bed_width_mm = 2 * sin(profile_.scan_angle_rad()/2) * kConeRadiusMM;
+#endif
 #if LDGRAPHY_DEBUG_OUTPUTS
-    constexpr float laser_dots_per_mm =
-        SCAN_PIXELS * (kScanAngleRad / kSegmentAngleRad) / bed_width;
+    const float laser_dots_per_mm = profile_.data_dots
+        * (profile_.scan_angle_rad() / profile_.segment_angle_rad())
+        / profile_.bed_width_mm;
     fprintf(stderr, "Mirror freq: %.1fHz; Pixel clock: %.3fMHz; "
             "Avg. laser resolution: %.4fmm (%.0fdpi)\n"
             "Data covering %.2f°/%.0f°, "
             "mechanically used: %.2f°, using %.1f%% data bits.\n",
-            kMirrorLineFrequency, kLaserPixelFrequency / 1e6,
+            profile_.line_frequency(), profile_.pixel_frequency() / 1e6,
             1 / laser_dots_per_mm, laser_dots_per_mm * 25.4,
-            kSegmentAngleRad / deg2rad, kMirrorThrowAngleRad / deg2rad,
-            kScanAngleRad/deg2rad, 100 * kScanAngleRad / kSegmentAngleRad);
+            profile_.segment_angle_rad() / deg2rad,
+            profile_.mirror_throw_angle_rad() / deg2rad,
+            profile_.scan_angle_deg,
+            100 * profile_.scan_angle_rad() / profile_.segment_angle_rad());
 #endif
     // Need to have enough data fraction to cover our angle. More mechanically
     // used than our data fraction allows. See above output.
-    assert(kSegmentAngleRad >= kScanAngleRad);
+    assert(profile_.segment_angle_rad() >= profile_.scan_angle_rad());
 }
 
 LDGraphyScanner::~LDGraphyScanner() {
@@ -147,12 +144,13 @@ void LDGraphyScanner::SetLaserDotSize(float sled_dot_size_mm,
 // will return less as we only cover a smaller segment.
 #if LDGRAPHY_CONE_MIRROR
 static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
+                                       float segment_angle_rad,
                                        float scan_range_pixels,
                                        size_t num) {
     std::vector<int> result;
     const float scan_angle_range = angle_rad;
     const float scan_angle_start = -scan_angle_range/2;
-    const float angle_step = kSegmentAngleRad / num;  // Overall arc mapped to full
+    const float angle_step = segment_angle_rad / num;  // Overall arc mapped to full
     const float scan_center = scan_range_pixels / 2;
     // only the values between -angle_range/2 .. angle_range/2
     for (size_t i = 0; i < num; ++i) {
@@ -164,10 +162,8 @@ static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
         result.push_back(y_pixel);
     }
 #if LDGRAPHY_DEBUG_OUTPUTS
-    fprintf(stderr, "Last Y coordinate full width = %d; "
-            "mapped to %d + %d shoulder = %d\n",
-            result.back(), (int)result.size(),
-            kHSyncShoulder, (int)result.size() + kHSyncShoulder);
+    fprintf(stderr, "Last Y coordinate full width = %d; mapped to %d\n",
+            result.back(), (int)result.size());
 #endif
     return result;
 }
@@ -176,11 +172,12 @@ static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
 // is obviously circular shaped, but there can be additional factors such
 // inaccuracies in mirrors that we can calibrate here.
 static std::vector<int> PrepareXOffset(float radius_pixels, float angle_rad,
+                                       float segment_angle_rad,
                                        size_t num, int *max_offset) {
     std::vector<int> result;
     const float scan_angle_range = angle_rad;
     const float scan_angle_start = -scan_angle_range/2;
-    const float angle_step = kSegmentAngleRad / num;
+    const float angle_step = segment_angle_rad / num;
     // only the values between -angle_range/2 .. angle_range/2
     for (size_t i = 0; i < num; ++i) {
         const float a = scan_angle_start + i * angle_step;
@@ -193,12 +190,13 @@ static std::vector<int> PrepareXOffset(float radius_pixels, float angle_rad,
 }
 #else
 static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
+                                       float segment_angle_rad,
                                        float scan_range_pixels,
                                        size_t num) {
     std::vector<int> result;
     const float scan_angle_range = angle_rad;
     const float scan_angle_start = -scan_angle_range/2;
-    const float angle_step = kSegmentAngleRad / num;  // Overall arc mapped to full
+    const float angle_step = segment_angle_rad / num;  // Overall arc mapped to full
     const float scan_center = scan_range_pixels / 2;
     // only the values between -angle_range/2 .. angle_range/2
     for (size_t i = 0; i < num; ++i) {
@@ -209,10 +207,8 @@ static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
         result.push_back(y_pixel);
     }
 #if LDGRAPHY_DEBUG_OUTPUTS
-    fprintf(stderr, "Last Y coordinate full width = %d; "
-            "mapped to %d + %d shoulder = %d\n",
-            result.back(), (int)result.size(),
-            kHSyncShoulder, (int)result.size() + kHSyncShoulder);
+    fprintf(stderr, "Last Y coordinate full width = %d; mapped to %d\n",
+            result.back(), (int)result.size());
 #endif
     return result;
 }
@@ -220,7 +216,7 @@ static std::vector<int> PrepareYLookup(float radius_pixels, float angle_rad,
 // Given data position, what is the x-offset there. For a arc-cone mirror, this
 // is obviously circular shaped, but there can be additional factors such
 // inaccuracies in mirrors that we can calibrate here.
-static std::vector<int> PrepareXOffset(float, float,
+static std::vector<int> PrepareXOffset(float, float, float,
                                        size_t num, int *max_offset) {
     // With a straight mirror, we never offset in X axis.
     std::vector<int> result(num, 0);
@@ -229,42 +225,29 @@ static std::vector<int> PrepareXOffset(float, float,
 }
 #endif
 
-uint8_t flip_bits(uint8_t b) {
-    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-    return b;
-}
-// Copy and mirror line. Essentially memcpy() but backwards and bits reversed
-static void mirror_copy(uint8_t *to, size_t offset,
-                        const uint8_t *const src, size_t n) {
-    // TODO: we should allow bit-wise offset. For now, we're a bit more
-    // coarse-grained.
-    to += offset / 8;
-    const uint8_t *from = src + n - 1;
-    while (from >= src)
-        *to++ = flip_bits(*from--);
-}
-
-static bool WouldFitRotated(const BitmapImage &img, float mm_per_pixel) {
-    return img.width() * mm_per_pixel <= bed_width
-        && img.height() * mm_per_pixel <= bed_length;
+static bool WouldFitRotated(const ImageTransform &img, float bed_width) {
+    return img.width() * img.mm_per_pixel_x() <= bed_width
+        && img.height() * img.mm_per_pixel_y() <= bed_length;
 }
 
-static bool TestImageFitsOnBed(const BitmapImage &img, float mm_per_pixel) {
-    if (mm_per_pixel * img.width() > bed_length) {
+// Test if the placed image fits; "offset_y" is added along the laser scan.
+static bool TestImageFitsOnBed(const ImageTransform &img, float offset_y,
+                               float bed_width) {
+    const float length = img.width() * img.mm_per_pixel_x();
+    const float height = img.height() * img.mm_per_pixel_y();
+    if (length > bed_length) {
         fprintf(stderr, "Board too long (%.1fmm), does not fit in %.0fmm "
-                "bed along sled.", mm_per_pixel * img.width(), bed_length);
-        fprintf(stderr, WouldFitRotated(img, mm_per_pixel)
+                "bed along sled.", length, bed_length);
+        fprintf(stderr, WouldFitRotated(img, bed_width)
                 ? "; it would fit rotated; use -R.\n"
                 : "; it would not even fit rotated.\n");
         return false;
     }
 
-    if (mm_per_pixel * img.height() > bed_width) {
+    if (height + offset_y > bed_width) {
         fprintf(stderr, "Board too high (%.1fmm), does not fit in %.0fmm bed "
-                "along laser scan", mm_per_pixel * img.height(), bed_width);
-        fprintf(stderr, WouldFitRotated(img, mm_per_pixel)
+                "along laser scan", height + offset_y, bed_width);
+        fprintf(stderr, WouldFitRotated(img, bed_width)
                 ? "; it would fit rotated, use -R.\n"
                 : "; it would not even fit rotated.\n");
         return false;
@@ -272,26 +255,35 @@ static bool TestImageFitsOnBed(const BitmapImage &img, float mm_per_pixel) {
     return true;
 }
 
-bool LDGraphyScanner::SetImage(BitmapImage *img,
-                               float image_resolution_mm_per_pixel) {
-    if (!TestImageFitsOnBed(*img, image_resolution_mm_per_pixel))
+bool LDGraphyScanner::PrepareGeometry(const ImageTransform &placed,
+                                      float offset_y_mm,
+                                      std::vector<int> *column_source_row,
+                                      std::vector<int> *column_x_offset,
+                                      int *output_height,
+                                      float *laser_mm_per_pixel) {
+    const float bed_width = profile_.bed_width_mm;
+    if (!TestImageFitsOnBed(placed, offset_y_mm, bed_width))
         return false;
+    const float sled_mm_per_pixel = placed.mm_per_pixel_x();
+    const float scan_mm_per_pixel = placed.mm_per_pixel_y();
 
-    sled_step_per_image_pixel_ = (image_resolution_mm_per_pixel
+    sled_step_per_image_pixel_ = (sled_mm_per_pixel
                                   / SledControl::kSledMMperStep);
 
     // Create lookup-table: data pixel position to actual position in image.
     // This is dependend on the resolution of the incoming image.
     std::vector<int> y_lookup
-        = PrepareYLookup(kRadiusMM / image_resolution_mm_per_pixel,
-                         kScanAngleRad,
-                         bed_width / image_resolution_mm_per_pixel,
-                         SCAN_PIXELS);
+        = PrepareYLookup(ScanRadiusMM(profile_) / scan_mm_per_pixel,
+                         profile_.scan_angle_rad(),
+                         profile_.segment_angle_rad(),
+                         bed_width / scan_mm_per_pixel,
+                         profile_.data_dots);
     int max_offset;
     std::vector<int> x_offset
-        = PrepareXOffset(kRadiusMM / image_resolution_mm_per_pixel,
-                         kScanAngleRad,
-                         SCAN_PIXELS, &max_offset);
+        = PrepareXOffset(ScanRadiusMM(profile_) / sled_mm_per_pixel,
+                         profile_.scan_angle_rad(),
+                         profile_.segment_angle_rad(),
+                         profile_.data_dots, &max_offset);
 
 #if 1
     // Due to the tangens, we have worse resolution at the edges. So look at the
@@ -300,94 +292,211 @@ bool LDGraphyScanner::SetImage(BitmapImage *img,
     const float laser_dots_per_image_pixel
         = 1.0 * beginning_pixel / (y_lookup[beginning_pixel] - y_lookup[0]);
     const float laser_dots_per_mm = (laser_dots_per_image_pixel
-                                     / image_resolution_mm_per_pixel);
+                                     / scan_mm_per_pixel);
+    const float length_mm = placed.width() * sled_mm_per_pixel;
+    const float height_mm = placed.height() * scan_mm_per_pixel;
     // Let's see what the range is we need to scan.
     fprintf(stderr, "Exposure size: "
             "(X=%.1fmm along sled; Y=%.1fmm wide laser scan).\n"
-            "Input image resolution %.0fdpi (%.3fmm/pixel)\n"
+            "Input image resolution X=%.0fdpi Y=%.0fdpi "
+            "(%.3fmm x %.3fmm/pixel)\n"
             "  %5.2f Sled steps per X-pixel.\n  %5.2f Laser dots per Y-pixel "
             "(Worst res: %.3fmm dots @ %.0fkHz pixel frequency (=%.0fdpi)).\n",
-            img->width() * image_resolution_mm_per_pixel,
-            img->height() * image_resolution_mm_per_pixel,
-            25.4f / image_resolution_mm_per_pixel, image_resolution_mm_per_pixel,
+            length_mm, height_mm,
+            25.4f / sled_mm_per_pixel, 25.4f / scan_mm_per_pixel,
+            sled_mm_per_pixel, scan_mm_per_pixel,
             sled_step_per_image_pixel_, laser_dots_per_image_pixel,
             1 / laser_dots_per_mm,
-            kMirrorLineFrequency * kMirrorTicks / 1000.0,
+            profile_.pixel_frequency() / 1000.0,
             laser_dots_per_mm * 25.4);
-    if (img->width() > img->height() + 5.0/image_resolution_mm_per_pixel
-        && WouldFitRotated(*img, image_resolution_mm_per_pixel)) {
+    if (length_mm > height_mm + 5.0 && WouldFitRotated(placed, bed_width)) {
         fprintf(stderr, "\n[ TIP: Currently the long side is along the sled. It "
                 "would be faster in portrait orientation; give -R option ]\n\n");
     }
 #endif
 
-    if (debug_images) img->ToPBM(fopen("/tmp/ld_0_input.pbm", "w"));
-
-    // Convert this into the image, tangens-corrected and rotated by
-    // 90 degrees, so that we can send it line-by-line.
-    scan_image_.reset(new BitmapImage(img->width() + max_offset, SCAN_PIXELS));
-    scanlines_ = scan_image_->width() * sled_step_per_image_pixel_;
-    fprintf(stderr, " Geometry preprocess to output image %dx%d\n",
-            scan_image_->width(), scan_image_->height());
+    // Scanlines are the image, tangens-corrected and rotated by
+    // 90 degrees, so that we can send it line-by-line. Each column in the
+    // output is gathered from the input row determined by the y_lookup.
+    // The y-offset just shifts the lookup; columns before the image stay
+    // empty.
+    const int offset_y_pixel = offset_y_mm / scan_mm_per_pixel;
+    *output_height = placed.width() + max_offset;
+    column_source_row->assign(profile_.data_dots, -1);
+    column_x_offset->assign(profile_.data_dots, 0);
     for (size_t i = 0; i < y_lookup.size(); ++i) {
-        const int from_y_pixel = img->height() - 1 - y_lookup[i];
+        const int from_y_pixel = (placed.height() - 1
+                                  - (y_lookup[i] - offset_y_pixel));
         if (from_y_pixel < 0) break;  // done.
-        const int to_y_pixel = i + kHSyncShoulder;
-        // TODO: the x offset should actually happen after thinning
-        mirror_copy(scan_image_->GetMutableRow(to_y_pixel),
-                    x_offset[i],
-                    img->GetRow(from_y_pixel), img->width() / 8);
+        if (from_y_pixel >= placed.height()) continue;
+        const int to_column = i + profile_.hsync_shoulder;
+        if (to_column >= profile_.data_dots) break;
+        (*column_source_row)[to_column] = from_y_pixel;
+        // TODO: we should allow bit-wise offset. For now, we're a bit more
+        // coarse-grained. Also: x offset should actually happen after thinning.
+        (*column_x_offset)[to_column] = (x_offset[i] / 8) * 8 - max_offset;
     }
-    delete img;
-    scan_image_.reset(CreateRotatedImage(*scan_image_));
+    scanlines_ = *output_height * sled_step_per_image_pixel_;
+    fprintf(stderr, " Geometry preprocess to output image %dx%d\n",
+            profile_.data_dots, *output_height);
+    *laser_mm_per_pixel = bed_width / y_lookup.size();
+    return true;
+}
+
+bool LDGraphyScanner::SetImage(BitmapImage *img,
+                               float mm_per_pixel_x, float mm_per_pixel_y,
+                               const Placement &placement) {
+    ScopedStageTimer timer(Metrics::STAGE_GEOMETRY);
+    // Decoded images are indexed already; others, e.g. test charts, now.
+    img->IndexOccupancy();
+    // The image as it is placed on the bed. From here on, all geometry is in
+    // coordinates of the placed image: x along the sled, y along the scan.
+    const ImageTransform placed(img->width(), img->height(),
+                                placement.rotate_degrees, placement.mirror,
+                                mm_per_pixel_x, mm_per_pixel_y);
+    std::vector<int> column_source_row, column_x_offset;
+    int output_height;
+    float laser_resolution_in_mm_per_pixel;
+    if (!PrepareGeometry(placed, placement.offset_y_mm, &column_source_row,
+                         &column_x_offset, &output_height,
+                         &laser_resolution_in_mm_per_pixel)) {
+        return false;
+    }
+
+    if (debug_images) img->ToPBM(fopen("/tmp/ld_0_input.pbm", "w"));
+
+    // Release the previous image before we allocate the new one.
+    scanline_source_.reset();
 
-    if (debug_images) scan_image_->ToPBM(fopen("/tmp/ld_1_geometry.pbm", "w"));
-    const float laser_resolution_in_mm_per_pixel = bed_width / y_lookup.size();
+    if (debug_images) {
+        std::unique_ptr<BitmapImage> geometry(
+            CreateGatheredRotatedImage(*img, placed, column_source_row,
+                                       column_x_offset, output_height));
+        geometry->ToPBM(fopen("/tmp/ld_1_geometry.pbm", "w"));
+    }
+
+    const float sled_mm_per_pixel = placed.mm_per_pixel_x();
     fprintf(stderr, " Thinning structures for (%.2f, %.2f) laser dot size...\n",
             laser_sled_dot_size_, laser_scan_dot_size_);
-    ThinImageStructures(
-        scan_image_.get(),
+    const EllipticalKernel thinning(
         laser_scan_dot_size_ / laser_resolution_in_mm_per_pixel / 2,
-        laser_sled_dot_size_ / image_resolution_mm_per_pixel / 2);
-    if (debug_images) scan_image_->ToPBM(fopen("/tmp/ld_2_thinned.pbm", "w"));
+        laser_sled_dot_size_ / sled_mm_per_pixel / 2);
+
+    // Scanlines are only created while exposing, a fixed number of lines
+    // ahead, so exposure can start right away regardless of image size.
+    scanline_source_.reset(
+        new ReadAheadScanlineSource(
+            new ImageScanlineSource(img, placed, column_source_row,
+                                    column_x_offset, output_height, thinning),
+            kScanlinesReadAhead));
+    source_used_ = false;
+
+    if (debug_images) {
+        BitmapImage thinned(profile_.data_dots, output_height);
+        for (int y = 0; y < output_height; ++y)
+            scanline_source_->ReadNext(thinned.GetMutableRow(y));
+        thinned.ToPBM(fopen("/tmp/ld_2_thinned.pbm", "w"));
+        source_used_ = true;
+    }
+
+    return true;
+}
 
+bool LDGraphyScanner::SetTestPattern(TestPattern *pattern,
+                                     float mm_per_pixel_x,
+                                     float mm_per_pixel_y,
+                                     float offset_y_mm) {
+    ScopedStageTimer timer(Metrics::STAGE_GEOMETRY);
+    std::unique_ptr<TestPattern> owned_pattern(pattern);
+    pattern->SetResolution(mm_per_pixel_x, mm_per_pixel_y);
+    const ImageTransform placed(pattern->width(), pattern->height(), 0, false,
+                                mm_per_pixel_x, mm_per_pixel_y);
+    std::vector<int> column_source_row, column_x_offset;
+    int output_height;
+    float laser_mm_per_pixel;
+    if (!PrepareGeometry(placed, offset_y_mm, &column_source_row,
+                         &column_x_offset, &output_height,
+                         &laser_mm_per_pixel)) {
+        return false;
+    }
+    scanline_source_.reset(
+        new ReadAheadScanlineSource(
+            new PatternScanlineSource(owned_pattern.release(),
+                                      column_source_row, column_x_offset,
+                                      output_height),
+            kScanlinesReadAhead));
+    source_used_ = false;
     return true;
 }
 
 float LDGraphyScanner::exposure_speed_mm_per_sec() const {
-    return (SledControl::kSledMMperStep * kMirrorLineFrequency) / exposure_factor_;
+    return (SledControl::kSledMMperStep * profile_.line_frequency())
+        / exposure_factor_;
 }
 
 float LDGraphyScanner::exposure_joule_per_cm2() const {
-    constexpr float kLaserUseFraction = kScanAngleRad / kMirrorThrowAngleRad;
-    return kLaserOpticalPowerMilliwatt * kLaserUseFraction   // -> mJ/s
+    const float laser_use_fraction = (profile_.scan_angle_rad()
+                                      / profile_.mirror_throw_angle_rad());
+    return kLaserOpticalPowerMilliwatt * laser_use_fraction   // -> mJ/s
         / exposure_speed_mm_per_sec()      // -> mJ/mm travelled
-        / bed_width                        // -> mJ/mm^2 spread over this
+        / profile_.bed_width_mm            // -> mJ/mm^2 spread over this
         / 10;                              // mm^2 = 100*cm^2; mJ/1000 = J
     return 1;
 }
 
 float LDGraphyScanner::estimated_time_seconds() const {
-    return exposure_factor_ * (scanlines_ / kMirrorLineFrequency);
+    return exposure_factor_ * (scanlines_ / profile_.line_frequency());
 }
 
 bool LDGraphyScanner::ScanExpose(bool do_move,
                                  std::function<bool(int d, int t)> progress_cont)
 {
-    if (!scan_image_) return true;
+    if (!scanline_source_) return true;
     if (!backend_) {
         fprintf(stderr, "No ScanLine backend provided\n");
         return false;
     }
-    const int max = scan_image_->height();
+    ScopedStageTimer timer(Metrics::STAGE_EXPOSE);
+    // Only rewind once we expose again: rewinding restarts the read-ahead,
+    // which would otherwise create lines nobody might ever need.
+    if (source_used_) scanline_source_->Rewind();
+    source_used_ = true;
+    const int row_bytes = scanline_source_->scanline_bytes();
+    // Window with dots of the current row. Only kept in row_data if the row
+    // is exposed more than once.
+    std::vector<uint8_t> row_data(row_bytes);
+    int window_start = 0, window_end = 0;
+    int current_row = -1;
     for (int scan = 0; scan < scanlines_ && progress_cont(scan, scanlines_); ++scan) {
         const int scan_pixel = roundf(scan / sled_step_per_image_pixel_);
-        if (scan_pixel >= max) break;   // could be due to rounding.
-        const uint8_t *row_data = scan_image_->GetRow(scan_pixel);
-        if (!backend_->EnqueueNextData(row_data, SCANLINE_DATA_SIZE, do_move))
+        if (current_row < scan_pixel) {
+            while (current_row < scan_pixel - 1
+                   && scanline_source_->ReadNext(row_data.data())) {
+                ++current_row;   // Skipped, between two scans.
+            }
+            // The first exposure of a row is created right in the backend.
+            volatile uint8_t *const slot = backend_->AcquireSlot();
+            if (!slot || current_row < scan_pixel - 1
+                || !scanline_source_->ReadNextToSlot(slot)) {
+                break;   // could be due to rounding.
+            }
+            ++current_row;
+            ScanLineSender::FindDataWindow(slot, row_bytes,
+                                           &window_start, &window_end);
+            if (exposure_factor_ > 1
+                || roundf((scan + 1) / sled_step_per_image_pixel_) <= scan_pixel) {
+                for (int i = window_start; i < window_end; ++i)
+                    row_data[i] = slot[i];
+            }
+            if (!backend_->Commit(do_move, window_start, window_end))
+                break;
+        } else if (!backend_->EnqueueWindow(row_data.data(), window_start,
+                                            window_end, do_move)) {
             break;
+        }
 	for (int i = 1; i < exposure_factor_; ++i) {
-            backend_->EnqueueNextData(row_data, SCANLINE_DATA_SIZE, false);
+            backend_->EnqueueWindow(row_data.data(), window_start, window_end,
+                                    false);
 	}
     }
     if (backend_->status() != ScanLineSender::STATUS_RUNNING) {
@@ -401,20 +510,18 @@ bool LDGraphyScanner::ScanExpose(bool do_move,
 
 void LDGraphyScanner::ExposeJitterTest(int mirrors, int repeats) {
     assert(backend_);
-    uint8_t *buffer = new uint8_t[mirrors * SCANLINE_DATA_SIZE]();
+    const int line_bytes = profile_.scanline_bytes();
     // Only use part of our scanline for the test.
-    const int mirror_line_len = (0.5 * SCANLINE_DATA_SIZE) / mirrors;
-    uint8_t *write_pos = buffer;
-    for (int m = 0; m < mirrors; ++m) {
-        memset(write_pos, 0xff, mirror_line_len);
-        write_pos += mirror_line_len + SCANLINE_DATA_SIZE;
-    }
+    const int mirror_line_len = (0.5 * line_bytes) / mirrors;
     for (int i = 0; i < repeats; ++i) {
         // We send six lines, one for each mirror. We don't know which mirror
         // is first currently, so it starts with whatever mirror was first.
         for (int m = 0; m < mirrors; ++m) {
-            backend_->EnqueueNextData(buffer + m*SCANLINE_DATA_SIZE,
-                                      SCANLINE_DATA_SIZE, false);
+            volatile uint8_t *const slot = backend_->AcquireSlot();
+            if (!slot) return;
+            const int start = m * mirror_line_len;
+            ScanLineSender::FillSlot(slot, 0xff, start, start + mirror_line_len);
+            backend_->Commit(false, start, start + mirror_line_len);
         }
     }
 }
@@ -21,9 +21,15 @@
 
 class ScanLineSender;
 class BitmapImage;
+class ImageTransform;
+class ReadAheadScanlineSource;
+class TestPattern;
 
 #include <memory>
 #include <functional>
+#include <vector>
+
+#include "machine-profile.h"
 
 // Laser Lithography scanner facade taking an image and operating the machinery
 // to expose it by scanning.
@@ -31,10 +37,10 @@ class LDGraphyScanner {
 public:
     ~LDGraphyScanner();
 
-    // Create an image scanner.
+    // Create an image scanner for a machine with the given profile.
     // Exposure factor above 1 indicates multiples of exposure time to
     // baseline (NB: right now, this only rounds to full integers).
-    LDGraphyScanner(float exposure_factor);
+    LDGraphyScanner(const MachineProfile &profile, float exposure_factor);
 
     // Set the laser dot size in X and Y direction. This affects image
     // correction in subsequent SetImage() calls. So this has to be called first.
@@ -42,11 +48,38 @@ public:
     void SetLaserDotSize(float sled_dot_size_mm,
                          float scan_dot_size_mm);
 
-    // Set new bitmap image with the given "mm_per_pixel" resolution.
+    // How the image is put on the bed.
+    struct Placement {
+        Placement() : rotate_degrees(0), mirror(false), offset_y_mm(0) {}
+        float rotate_degrees;  // Turn left, any angle.
+        bool mirror;           // Left to right before turning; bottom layers.
+        float offset_y_mm;     // Along the laser scan; must not be negative.
+    };
+
+    // Set new bitmap image with the given resolution and placement. The
+    // resolution can differ for x and y of the image: the laser resolves
+    // much finer along the scan than the sled steps do, or the other way
+    // around, so an image doesn't need more pixels than either axis can use.
     // Takes ownership of the image.
     // Returns boolean indicating if successful (e.g. it would not be successful
     // if it doesn't fit on the bed).
-    bool SetImage(BitmapImage *img, float mm_per_pixel);
+    //
+    // This only prepares the geometry; the actual scanlines are created
+    // lazily from the image while exposing, so no preprocessed copy of the
+    // image is kept in memory. The placement is part of that geometry: the
+    // image is never turned or mirrored as a whole.
+    bool SetImage(BitmapImage *img, float mm_per_pixel_x, float mm_per_pixel_y,
+                  const Placement &placement = Placement());
+
+    // Set a built-in test pattern to expose, rendered at the given resolution
+    // while exposing; nothing is prepared ahead, so this is quick for any
+    // resolution. The pattern is neither turned nor thinned; only the
+    // "offset_y_mm" of the placement applies.
+    // Takes ownership of the pattern.
+    // Returns boolean indicating if successful.
+    bool SetTestPattern(TestPattern *pattern,
+                        float mm_per_pixel_x, float mm_per_pixel_y,
+                        float offset_y_mm = 0);
 
     // Returns normalized exposure energy in J/cm^2 (guess unless we know
     // the actual laser diode output).
@@ -82,10 +115,21 @@ public:
     void ExposeJitterTest(int mirrors, int repeats);
 
 private:
+    // Scanline geometry for the "placed" image: which row of it each
+    // scanline column comes from (see CreateGatheredRotatedImage()), and the
+    // number of output rows. Returns false if the image doesn't fit on the
+    // bed.
+    bool PrepareGeometry(const ImageTransform &placed, float offset_y_mm,
+                         std::vector<int> *column_source_row,
+                         std::vector<int> *column_x_offset,
+                         int *output_height, float *laser_mm_per_pixel);
+
+    MachineProfile profile_;
     const int exposure_factor_;
     float laser_sled_dot_size_, laser_scan_dot_size_;
     std::unique_ptr<ScanLineSender> backend_;
-    std::unique_ptr<BitmapImage> scan_image_;  // preprocessed.
+    std::unique_ptr<ReadAheadScanlineSource> scanline_source_;
+    bool source_used_;   // Lines were read; rewind before the next exposure.
     int scanlines_;
     float sled_step_per_image_pixel_;
 };
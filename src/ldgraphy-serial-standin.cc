@@ -0,0 +1,225 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stand-in for a microcontroller speaking the serial protocol, to test
+// 'ldgraphy -s' without hardware. Creates a pseudo terminal and works
+// through the commands in the time the real machine would take.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "scanline-sender.h"
+#include "serial-protocol.h"
+
+// Simulated time to spin up and synchronize the mirror.
+static constexpr int64_t kSpinupMicros = 300000;
+
+struct Command {
+    uint8_t type;
+    uint8_t seq;
+    bool sled;
+    std::vector<uint8_t> line;
+    int64_t done_at;   // 0: not started yet.
+};
+
+static int64_t NowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options]\n"
+            "Pretend to be a microcontroller for 'ldgraphy -s <pty>'.\n"
+            "Options:\n"
+            "\t-w <lines> : Lines the device can buffer. Default 32.\n"
+            "\t-o <file>  : Write received scanlines to file.\n",
+            progname);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int window = 32;
+    FILE *output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:o:")) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            if (window < 1 || window > kSerialMaxWindow) return usage(argv[0]);
+            break;
+        case 'o':
+            output = fopen(optarg, "wb");
+            if (!output) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        perror("Can't create pseudo terminal");
+        return 1;
+    }
+    // Keep the other end open, so that we don't see hangups between jobs.
+    const int slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+    fprintf(stderr, "Serial device: %s\n", ptsname(fd));
+
+    SerialFrameReader reader(fd);
+    std::deque<Command> commands;
+    int line_bytes = 0;
+    int64_t line_micros = 0;
+    uint8_t expected_seq = 0;
+    int status = ScanLineSender::STATUS_RUNNING;
+    bool synced = false;
+    bool running_lines = false;
+    int64_t busy_until = 0;
+    int lines = 0, sled_steps = 0, underruns = 0;
+    int64_t received_bytes = 0;
+
+    for (;;) {
+        // Work through commands whose time has come; acknowledge all at once.
+        const int64_t now = NowMicros();
+        int acked = -1;
+        while (!commands.empty()) {
+            Command &c = commands.front();
+            if (c.done_at == 0) {
+                const int64_t start = std::max(now, busy_until);
+                if (c.type == FRAME_LINE && running_lines
+                    && start > busy_until + line_micros / 2) {
+                    ++underruns;   // Missed the mirror segment.
+                }
+                int64_t duration = 0;
+                if (!synced && c.type != FRAME_EXIT) duration += kSpinupMicros;
+                if (c.type == FRAME_LINE) duration += line_micros;
+                c.done_at = start + duration;
+            }
+            if (now < c.done_at) break;
+            busy_until = c.done_at;
+            synced = (c.type != FRAME_EXIT);
+            running_lines = (c.type == FRAME_LINE);
+            if (c.type == FRAME_LINE) {
+                ++lines;
+                if (c.sled) ++sled_steps;
+                if (output) fwrite(c.line.data(), 1, c.line.size(), output);
+            }
+            if (c.type == FRAME_EXIT) {
+                fprintf(stderr, "Done: %d lines, %d sled steps, %d underruns, "
+                        "%lld bytes received, %d garbled frames.\n",
+                        lines, sled_steps, underruns,
+                        (long long)received_bytes, reader.bad_frames());
+                if (output) fflush(output);
+            }
+            acked = c.seq;
+            commands.pop_front();
+        }
+        if (acked >= 0) {
+            std::string ack, out;
+            ack.push_back(acked);
+            ack.push_back(status);
+            EncodeFrame(FRAME_ACK, ack, &out);
+            WriteAll(fd, out);
+        }
+
+        int timeout_ms = -1;
+        if (!commands.empty()) {
+            timeout_ms = (commands.front().done_at - now + 999) / 1000;
+        }
+        std::string frame;
+        if (!reader.Read(timeout_ms, &frame))
+            continue;
+        received_bytes += frame.size();
+
+        if (frame[0] == FRAME_HELLO) {
+            if (frame.size() < 1 + 4 * kSerialHelloValues) continue;
+            const int tick_delay = ReadUInt32(&frame[1]);
+            const int ticks_per_segment = ReadUInt32(&frame[5]);
+            line_bytes = ReadUInt32(&frame[17]);
+            line_micros = (int64_t)tick_delay * ticks_per_segment / 200;
+            fprintf(stderr, "Hello: %d bytes per line, %.1f lines/s\n",
+                    line_bytes, 1e6 / line_micros);
+            commands.clear();
+            expected_seq = 0;
+            status = ScanLineSender::STATUS_RUNNING;
+            lines = sled_steps = underruns = 0;
+            received_bytes = 0;
+            std::string info, out;
+            info.push_back(window);
+            EncodeFrame(FRAME_INFO, info, &out);
+            WriteAll(fd, out);
+            continue;
+        }
+        if (frame.size() < 2 || status != ScanLineSender::STATUS_RUNNING)
+            continue;
+
+        Command c;
+        c.type = frame[0];
+        c.seq = frame[1];
+        c.sled = false;
+        c.done_at = 0;
+        bool valid = (c.seq == expected_seq && (int)commands.size() < window);
+        if (valid && c.type == FRAME_LINE) {
+            valid = (frame.size() >= 5);
+            if (valid) {
+                c.sled = frame[2] & LINE_FLAG_SLED;
+                const int start = ReadUInt16(&frame[3]);
+                c.line.resize(line_bytes);
+                valid = start <= line_bytes
+                    && UnpackBits(&frame[5], frame.size() - 5,
+                                  c.line.data() + start,
+                                  line_bytes - start) >= 0;
+            }
+        } else if (c.type != FRAME_SPINUP && c.type != FRAME_EXIT) {
+            valid = false;
+        }
+        if (!valid) {
+            fprintf(stderr, "Unexpected command %c, seq %d; stopping.\n",
+                    c.type, c.seq);
+            status = ScanLineSender::STATUS_ERR_PROTOCOL;
+            commands.clear();
+            std::string ack, out;
+            ack.push_back(expected_seq - 1);
+            ack.push_back(status);
+            EncodeFrame(FRAME_ACK, ack, &out);
+            WriteAll(fd, out);
+            continue;
+        }
+        expected_seq++;
+        commands.push_back(c);
+    }
+}
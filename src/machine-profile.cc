@@ -0,0 +1,208 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "machine-profile.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "laser-scribe-constants.h"
+#include "laser-scribe-pru_cycles.h"
+
+constexpr float deg2rad = 2*M_PI/360;
+
+// Minimum cycles per tick: the worst case of the PRU program, as found by
+// pru-cycle-budget when it was built, plus the overhead of the tick itself.
+constexpr int kMinTickDelay = PRU_WORST_TICK_CYCLES + TICK_OVERHEAD_CYCLES;
+
+MachineProfile::MachineProfile()
+    : tick_delay(TICK_DELAY),
+      ticks_per_mirror_segment(TICKS_PER_MIRROR_SEGMENT),
+      data_dots(8 * SCANLINE_DATA_SIZE),
+      mirror_faces(6),
+      spinup_stable_facets(12),   // Two turns of the mirror.
+      bed_width_mm(102.0 - 1.88),  // Case calculation + measured fudge value.
+      scan_angle_deg(40.0),
+      hsync_shoulder(200) {
+}
+
+float MachineProfile::scan_angle_rad() const {
+    return scan_angle_deg * deg2rad;
+}
+
+float MachineProfile::mirror_throw_angle_rad() const {
+    return 2 * (360.0 / mirror_faces) * deg2rad;
+}
+
+float MachineProfile::segment_angle_rad() const {
+    const float data_fraction = 1.0 * data_dots / ticks_per_mirror_segment;
+    return mirror_throw_angle_rad() * data_fraction;
+}
+
+bool MachineProfile::Validate() const {
+    if (tick_delay < kMinTickDelay) {
+        fprintf(stderr, "Profile: tick_delay needs to be at least %d\n",
+                kMinTickDelay);
+        return false;
+    }
+    if (data_dots <= 0 || data_dots % 8 != 0
+        || data_dots > 8 * SCANLINE_MAX_DATA_SIZE) {
+        fprintf(stderr, "Profile: data_dots needs to be a multiple of 8 "
+                "up to %d.\n", 8 * SCANLINE_MAX_DATA_SIZE);
+        return false;
+    }
+    if (ticks_per_mirror_segment < data_dots) {
+        fprintf(stderr, "Profile: ticks_per_mirror_segment needs to be at "
+                "least the %d data pixels.\n", data_dots);
+        return false;
+    }
+    if (spinup_stable_facets < 1 || spinup_stable_facets > 255) {
+        fprintf(stderr, "Profile: spinup_stable_facets needs to be "
+                "in range 1..255\n");
+        return false;
+    }
+    if (mirror_faces < 3 || bed_width_mm <= 0 || scan_angle_deg <= 0
+        || hsync_shoulder < 0 || hsync_shoulder >= data_dots) {
+        fprintf(stderr, "Profile: invalid geometry values.\n");
+        return false;
+    }
+    // Need to have enough data fraction to cover our angle.
+    if (segment_angle_rad() < scan_angle_rad()) {
+        fprintf(stderr, "Profile: data pixels only cover %.2f°, but scan "
+                "angle is %.2f°\n", segment_angle_rad() / deg2rad,
+                scan_angle_deg);
+        return false;
+    }
+    return true;
+}
+
+// Built-in profiles. Each is a sequence of "key = value" lines as in a file.
+static const struct {
+    const char *name;
+    const char *content;
+} kBuiltinProfiles[] = {
+    { "default", "" },  // Reference machine: MachineProfile defaults.
+};
+
+// The whole value needs to be an integer that fits.
+static bool ParseInt(const char *key, const char *value, int *result) {
+    char *end;
+    errno = 0;
+    const long v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE
+        || v < INT_MIN || v > INT_MAX) {
+        fprintf(stderr, "Profile: %s needs an integer value, got '%s'\n",
+                key, value);
+        return false;
+    }
+    *result = v;
+    return true;
+}
+
+static bool ParseFloat(const char *key, const char *value, float *result) {
+    char *end;
+    errno = 0;
+    const double v = strtod(value, &end);
+    if (end == value || *end != '\0' || errno == ERANGE || !isfinite(v)) {
+        fprintf(stderr, "Profile: %s needs a number, got '%s'\n",
+                key, value);
+        return false;
+    }
+    *result = v;
+    return true;
+}
+
+static bool SetValue(MachineProfile *profile, const char *key, const char *value) {
+    if (strcmp(key, "tick_delay") == 0)
+        return ParseInt(key, value, &profile->tick_delay);
+    if (strcmp(key, "ticks_per_mirror_segment") == 0)
+        return ParseInt(key, value, &profile->ticks_per_mirror_segment);
+    if (strcmp(key, "data_dots") == 0)
+        return ParseInt(key, value, &profile->data_dots);
+    if (strcmp(key, "mirror_faces") == 0)
+        return ParseInt(key, value, &profile->mirror_faces);
+    if (strcmp(key, "spinup_stable_facets") == 0)
+        return ParseInt(key, value, &profile->spinup_stable_facets);
+    if (strcmp(key, "bed_width_mm") == 0)
+        return ParseFloat(key, value, &profile->bed_width_mm);
+    if (strcmp(key, "scan_angle_deg") == 0)
+        return ParseFloat(key, value, &profile->scan_angle_deg);
+    if (strcmp(key, "hsync_shoulder") == 0)
+        return ParseInt(key, value, &profile->hsync_shoulder);
+    fprintf(stderr, "Profile: unknown key '%s'\n", key);
+    return false;
+}
+
+// Parse a single line. Empty lines and comments are ok.
+static bool ParseLine(char *line, MachineProfile *profile) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char key[64], value[64];
+    const int fields = sscanf(line, " %63[a-z_] = %63s", key, value);
+    if (fields == 2) return SetValue(profile, key, value);
+    char rest;
+    return sscanf(line, " %c", &rest) != 1;   // Only whitespace.
+}
+
+bool LoadMachineProfile(const char *name_or_file, MachineProfile *profile) {
+    *profile = MachineProfile();
+    for (const auto &builtin : kBuiltinProfiles) {
+        if (strcmp(builtin.name, name_or_file) != 0) continue;
+        // Built-in profiles are part of the program, so a mistake in them is
+        // a bug, not something to quietly ignore.
+        char buffer[1024];
+        if (strlen(builtin.content) >= sizeof(buffer)) {
+            fprintf(stderr, "Built-in profile '%s' too long.\n", builtin.name);
+            return false;
+        }
+        strcpy(buffer, builtin.content);
+        for (char *line = strtok(buffer, "\n"); line; line = strtok(NULL, "\n")) {
+            if (!ParseLine(line, profile)) {
+                fprintf(stderr, "Built-in profile '%s': Can't parse '%s'\n",
+                        builtin.name, line);
+                return false;
+            }
+        }
+        return profile->Validate();
+    }
+
+    FILE *f = fopen(name_or_file, "r");
+    if (!f) {
+        perror(name_or_file);
+        return false;
+    }
+    char line[256];
+    int line_no = 0;
+    bool success = true;
+    while (success && fgets(line, sizeof(line), f)) {
+        ++line_no;
+        line[strcspn(line, "\n")] = '\0';
+        if (!ParseLine(line, profile)) {
+            fprintf(stderr, "%s:%d: Can't parse '%s'\n",
+                    name_or_file, line_no, line);
+            success = false;
+        }
+    }
+    fclose(f);
+    return success && profile->Validate();
+}
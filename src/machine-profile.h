@@ -0,0 +1,73 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_MACHINE_PROFILE_H
+#define LDGRAPHY_MACHINE_PROFILE_H
+
+// Parameters that depend on the particular machine built: pixel clock,
+// mirror and geometry. Defaults are the values of the reference machine.
+struct MachineProfile {
+    MachineProfile();   // Default profile.
+
+    // CPU cycles (on the 200Mhz PRU) between each laser dot, determining
+    // the pixel clock.
+    int tick_delay;
+
+    // Each mirror segment is this number of pixel ticks long (only the first
+    // data_dots are filled with pixels).
+    int ticks_per_mirror_segment;
+
+    // Dots per scanline, starting at the hsync. Multiple of 8.
+    int data_dots;
+
+    int mirror_faces;
+
+    // The mirror is considered spun up once this many hsyncs in a row
+    // arrived within the allowed jitter. Up to 255.
+    int spinup_stable_facets;
+
+    float bed_width_mm;     // Width of the laser scan on the bed.
+    float scan_angle_deg;   // Angle used of the mirror throw to cover bed.
+    int hsync_shoulder;     // Data pixels between hsync sensor and bed start.
+
+    // -- Derived values.
+    float pixel_frequency() const { return 200e6 / tick_delay; }
+    int scanline_bytes() const { return data_dots / 8; }
+    float line_frequency() const {
+        return pixel_frequency() / ticks_per_mirror_segment;
+    }
+    float scan_angle_rad() const;
+    float mirror_throw_angle_rad() const;   // Reflection is 2*angle.
+    float segment_angle_rad() const;        // Angle covered by data pixels.
+
+    // Allowed deviation of hsync period in ticks while synchronizing.
+    int jitter_allow() const { return ticks_per_mirror_segment / 100; }
+
+    // Check that values are consistent, i.e. the data pixels can cover the
+    // scan angle. Prints a message to stderr and returns false if not.
+    bool Validate() const;
+};
+
+// Get the machine profile "name_or_file". This is either one of the
+// built-in profiles (e.g. "default") or the filename of a profile with
+// "key = value" lines ('#' starts a comment). Keys are the field names of
+// MachineProfile; fields not mentioned keep their default value.
+// Returns false and prints a message on stderr on failure.
+bool LoadMachineProfile(const char *name_or_file, MachineProfile *profile);
+
+#endif  // LDGRAPHY_MACHINE_PROFILE_H
@@ -18,6 +18,7 @@
  */
 
 #include <assert.h>
+#include <getopt.h>
 #include <math.h>
 #include <signal.h>
 #include <stdint.h>
@@ -28,17 +29,26 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "containers.h"
 #include "image-processing.h"
+#include "job-server.h"
 #include "laser-scribe-constants.h"
 #include "ldgraphy-scanner.h"
+#include "machine-profile.h"
+#include "metrics.h"
+#include "pru-emulator.h"
 #include "scanline-sender.h"
 #include "sled-control.h"
+#include "test-pattern.h"
 
 constexpr float kThinningChartResolution = 0.005; // mm per pixel
+constexpr float kDefaultTestPatternDpi = 2400;
 constexpr float kInitialSledOffsetMM = 3; // sled skip initial markings.
 
 // Interrupt handling. Provide a is_interrupted() function that reports
@@ -68,12 +78,36 @@ static int usage(const char *progname, const char *errmsg = NULL) {
     }
     fprintf(stderr, "Usage:\n%s [options] <png-image-file>\n", progname);
     fprintf(stderr, "Options:\n"
-            "\t-d <val>   : Override DPI of input image. Default -1\n"
+            "\t-d <x>[,<y>] : Override DPI of input image; y defaults to x. "
+            "Default -1\n"
             "\t-i         : Inverse image: black becomes laser on\n"
             "\t-x<val>    : Exposure factor. Default 1.\n"
-            "\t-o<val>    : Offset in sled direction in mm\n"
+            "\t-o<x>[,<y>] : Offset in mm; x in sled direction, y along "
+            "laser scan.\n"
             "\t-R         : Quarter image turn left; "
             "can be given multiple times.\n"
+            "\t-a<deg>    : Turn image left by any angle; adds to -R.\n"
+            "\t-B         : Mirror image left to right, e.g. for bottom "
+            "layer.\n"
+            "\t-L <op>:<png>[@<x>,<y>] : Combine image with another layer "
+            "of same DPI;\n\t\t     <op> is or, and, xor or andnot. "
+            "Layer top left at <x>,<y> mm\n\t\t     in the image. "
+            "Applied to laser-on pixels (after -i).\n\t\t     Can be "
+            "given multiple times.\n"
+            "\t-P <prof>  : Machine profile: built-in name or profile file. "
+            "Default 'default'.\n"
+            "\t-m <file>  : Write machine metrics in Prometheus text format "
+            "to file\n\t\t     every few seconds.\n"
+            "\t-W <port>  : Instead of an image file, expose jobs uploaded "
+            "to\n\t\t     http://localhost:<port>/job one after another.\n"
+            "\t--profile[=<file>] : Report wall and CPU time, bitmap "
+            "allocations and\n\t\t     peak memory per stage at the end; "
+            "also as JSON to file.\n"
+            "\t--memory-limit=<MiB> : Bitmap memory to use before images are "
+            "mapped from\n\t\t     files, so that the kernel can page them "
+            "out. Default: half the RAM.\n"
+            "\t--spill-dir=<dir> : Directory for these files. Default "
+            "$TMPDIR or /var/tmp.\n"
             "\t-h         : This help\n"
             "Mostly for testing or calibration:\n"
             "\t-S         : Skip sled loading; assume board already loaded.\n"
@@ -81,36 +115,130 @@ static int usage(const char *progname, const char *errmsg = NULL) {
             "\t-F         : Run a focus round until Ctrl-C\n"
             "\t-M         : Testing: Inhibit sled move.\n"
             "\t-n         : Dryrun. Do not do any scanning; laser off.\n"
+            "\t-e<lat>[,<jit>] : Emulate PRU in simulated time with host "
+            "latency up\n\t\t     to <lat> usec and <jit> ticks hsync jitter; "
+            "report underruns.\n"
+            "\t-s <dev>[,<baud>] : Send scanlines to microcontroller on "
+            "serial device\n\t\t     instead of the PRU; no sled moves "
+            "outside exposure.\n"
             "\t-j<exp>    : Mirror jitter test with given exposure repeat\n"
+            "\t-T         : Calibrate: sweep tick delay down from profile "
+            "value with running\n\t\t     mirror and report smallest "
+            "stable value.\n"
+            "\t-t <name>  : Expose built-in test pattern at -d resolution "
+            "(default %.0fdpi):\n\t\t     %s\n"
             "\t-D<line-width:start,step> : Laser Dot Diameter test chart.\n"
             "\t\tCreates a test-strip 10cm x 2cm with 10 samples with 'line-width' trace/clearance.\n"
-            "\t\tApply thinning to line beginning with 'start', increase for each of the 10 samples by 'step'. e.g. -D0.15:0.04,0.01\n");
+            "\t\tApply thinning to line beginning with 'start', increase for each of the 10 samples by 'step'. e.g. -D0.15:0.04,0.01\n",
+            kDefaultTestPatternDpi, TestPattern::AvailableNames());
     return errmsg ? 1 : 0;
 }
 
-// Given an image filename, create a LDGraphyScanner that can be used to expose
-// that image.
-bool LoadImage(LDGraphyScanner *scanner,
-               const char *filename, float override_dpi,
-               bool invert, int quarter_turns) {
-    if (!filename) return false;
-    double input_dpi = -1;
-    std::unique_ptr<BitmapImage> img(LoadPNGImage(filename, invert, &input_dpi));
-    if (img == nullptr) return false;
-
+// Resolution of one image axis: from the image, unless overridden or not
+// plausible. Returns false if the result is not plausible either.
+static bool ChooseDpi(double input_dpi, float override_dpi, double *dpi) {
     if (override_dpi > 0 || input_dpi < 100 || input_dpi > 20000)
         input_dpi = override_dpi;
+    *dpi = input_dpi;
+    return input_dpi >= 100 && input_dpi <= 20000;
+}
 
-    if (input_dpi < 100 || input_dpi > 20000) {
+// Another image to combine with the main one, given with -L.
+struct ImageLayer {
+    LayerOp op;
+    std::string filename;
+    float x_mm, y_mm;   // Position of top left corner in the main image.
+};
+
+// Parse -L argument "<op>:<png>[@<x>,<y>]".
+static bool ParseImageLayer(const char *arg, ImageLayer *layer) {
+    const char *colon = strchr(arg, ':');
+    if (!colon) return false;
+    if (!ParseLayerOp(std::string(arg, colon - arg).c_str(), &layer->op))
+        return false;
+    layer->filename = colon + 1;
+    layer->x_mm = layer->y_mm = 0;
+    const size_t at = layer->filename.rfind('@');
+    if (at != std::string::npos) {
+        if (sscanf(layer->filename.c_str() + at + 1, "%f,%f",
+                   &layer->x_mm, &layer->y_mm) != 2)
+            return false;
+        layer->filename.resize(at);
+    }
+    return !layer->filename.empty();
+}
+
+// Load layer and combine it into the image, which has the given DPI from
+// its file. Layer and image need to have the same resolution.
+static bool AddImageLayer(BitmapImage *img, double input_dpi_x,
+                          double input_dpi_y, float override_dpi_x,
+                          float override_dpi_y, bool invert,
+                          const ImageLayer &layer) {
+    double layer_input_dpi_x = -1, layer_input_dpi_y = -1;
+    std::unique_ptr<BitmapImage> layer_img(
+        LoadPNGImage(layer.filename.c_str(), invert,
+                     &layer_input_dpi_x, &layer_input_dpi_y));
+    if (!layer_img) return false;
+    double dpi_x, dpi_y, layer_dpi_x, layer_dpi_y;
+    if (!ChooseDpi(input_dpi_x, override_dpi_x, &dpi_x)
+        || !ChooseDpi(input_dpi_y, override_dpi_y, &dpi_y)
+        || !ChooseDpi(layer_input_dpi_x, override_dpi_x, &layer_dpi_x)
+        || !ChooseDpi(layer_input_dpi_y, override_dpi_y, &layer_dpi_y)) {
+        fprintf(stderr, "Couldn't extract usable DPI from image or layer. "
+                "Please provide -d <dpi>\n");
+        return false;
+    }
+    if (fabs(layer_dpi_x - dpi_x) > 0.005 * dpi_x
+        || fabs(layer_dpi_y - dpi_y) > 0.005 * dpi_y) {
+        fprintf(stderr, "Layer %s has %.0fx%.0fdpi, but the image "
+                "%.0fx%.0fdpi.\n", layer.filename.c_str(),
+                layer_dpi_x, layer_dpi_y, dpi_x, dpi_y);
+        return false;
+    }
+    ComposeLayer(img, *layer_img, layer.op,
+                 lround(layer.x_mm / 25.4 * dpi_x),
+                 lround(layer.y_mm / 25.4 * dpi_y));
+    return true;
+}
+
+// Prepare the LDGraphyScanner to expose the given image. Takes ownership of
+// the image.
+bool PrepareImage(LDGraphyScanner *scanner, BitmapImage *image,
+                  double input_dpi_x, double input_dpi_y,
+                  float override_dpi_x, float override_dpi_y,
+                  const LDGraphyScanner::Placement &placement) {
+    std::unique_ptr<BitmapImage> img(image);
+    double dpi_x, dpi_y;
+    if (!ChooseDpi(input_dpi_x, override_dpi_x, &dpi_x)
+        || !ChooseDpi(input_dpi_y, override_dpi_y, &dpi_y)) {
         fprintf(stderr, "Couldn't extract usable DPI from image. "
                 "Please provide -d <dpi>\n");
         return false;
     }
 
-    while (quarter_turns--)
-        img.reset(CreateRotatedImage(*img));
+    return scanner->SetImage(img.release(), 25.4 / dpi_x, 25.4 / dpi_y,
+                             placement);
+}
 
-    return scanner->SetImage(img.release(), 25.4 / input_dpi);
+// Given an image filename, create a LDGraphyScanner that can be used to expose
+// that image.
+// Layers are combined into the image right after loading.
+bool LoadImage(LDGraphyScanner *scanner, const char *filename,
+               const std::vector<ImageLayer> &layers,
+               float override_dpi_x, float override_dpi_y,
+               bool invert, const LDGraphyScanner::Placement &placement) {
+    if (!filename) return false;
+    double input_dpi_x = -1, input_dpi_y = -1;
+    std::unique_ptr<BitmapImage> img(LoadPNGImage(filename, invert,
+                                                  &input_dpi_x, &input_dpi_y));
+    if (img == nullptr) return false;
+    for (const ImageLayer &layer : layers) {
+        if (!AddImageLayer(img.get(), input_dpi_x, input_dpi_y,
+                           override_dpi_x, override_dpi_y, invert, layer))
+            return false;
+    }
+    return PrepareImage(scanner, img.release(), input_dpi_x, input_dpi_y,
+                        override_dpi_x, override_dpi_y, placement);
 }
 
 // Output a line with dots in regular distance for testing the set-up.
@@ -124,7 +252,7 @@ void RunFocusLine(LDGraphyScanner *scanner) {
     for (int mm = 0; mm < bed_width; mm += mark_interval) {
         img->Set(0, mm * res, true);
     }
-    scanner->SetImage(img, 0.01);
+    scanner->SetImage(img, 0.01, 0.01);
     ArmInterruptHandler();
     while (!is_interrupted()) {
         if (!scanner->ScanExpose(false,
@@ -135,12 +263,81 @@ void RunFocusLine(LDGraphyScanner *scanner) {
     fprintf(stderr, "Focus run done.\n");
 }
 
+// Run the mirror with decreasing tick delays (= increasing pixel clock),
+// starting with the one in the profile, and report the smallest one that
+// still works, i.e. the mirror synchronizes and the state machine does not
+// run out of cycles. Laser is off while scanning and the sled does not move.
+// The lines are all zero, but committed with the full width as window, so
+// that the PRU runs the data path for every dot like it does while exposing.
+static int RunTickDelayCalibration(const MachineProfile &profile) {
+    constexpr int kTestLines = 500;   // A few seconds per test.
+    const int line_bytes = profile.scanline_bytes();
+    int smallest_stable = -1;
+    for (MachineProfile test = profile;
+         test.Validate() && !is_interrupted(); --test.tick_delay) {
+        fprintf(stderr, "tick_delay %3d (%.3fMHz): ", test.tick_delay,
+                test.pixel_frequency() / 1e6);
+        std::unique_ptr<ScanLineSender> sender(PRUScanLineSender::Create(test));
+        if (!sender) {
+            fprintf(stderr, "Cannot initialize hardware.\n");
+            return 1;
+        }
+        bool success = true;
+        for (int i = 0; success && i < kTestLines && !is_interrupted(); ++i) {
+            volatile uint8_t *const slot = sender->AcquireSlot();
+            if (!slot) {
+                success = false;
+                break;
+            }
+            ScanLineSender::FillSlot(slot, 0, 0, line_bytes);
+            success = sender->Commit(false, 0, line_bytes);
+        }
+        const ScanLineSender::Status status = sender->status();
+        success &= sender->Shutdown();
+        const std::vector<int> cycles = sender->GetMaxStateCycles();
+        int max_cycles = 0;
+        for (int c : cycles) max_cycles = std::max(max_cycles, c);
+        fprintf(stderr, "%s; max %d cycles/tick\n",
+                success ? "ok" : ScanLineSender::StatusToString(status),
+                max_cycles);
+        for (size_t i = 0; i < cycles.size(); ++i) {
+            fprintf(stderr, "\t%-20s %3d\n",
+                    ScanLineSender::StateIdToString(i), cycles[i]);
+        }
+        if (!success) break;
+        smallest_stable = test.tick_delay;
+    }
+    if (smallest_stable < 0) {
+        fprintf(stderr, "No stable tick delay found.\n");
+        return 1;
+    }
+    fprintf(stderr, "Smallest stable tick_delay = %d; use this (or a bit "
+            "more for some margin) in the machine profile.\n",
+            smallest_stable);
+    return 0;
+}
+
 void UIMessage(const char *msg) {
     fprintf(stdout, "**********> %s\n", msg);
 }
 
+// Print the per-stage profile and optionally write it as JSON.
+static void ReportProfile(const char *json_file) {
+    fprintf(stderr, "\nProfile:\n%s",
+            Metrics::instance()->ProfileTable().c_str());
+    if (!json_file) return;
+    FILE *out = fopen(json_file, "w");
+    if (!out) {
+        perror(json_file);
+        return;
+    }
+    fputs(Metrics::instance()->ProfileJson().c_str(), out);
+    fclose(out);
+}
+
 int main(int argc, char *argv[]) {
-    double commandline_dpi = -1;
+    float commandline_dpi_x = -1;
+    float commandline_dpi_y = -1;
     bool dryrun = false;
     bool invert = false;
     bool do_focus = false;
@@ -148,18 +345,45 @@ int main(int argc, char *argv[]) {
     bool do_sled_loading_ui = true;
     bool do_sled_eject = true;
     std::unique_ptr<BitmapImage> dot_size_chart;
+    std::unique_ptr<TestPattern> test_pattern;
 
-    int quarter_turns = 0;
+    LDGraphyScanner::Placement placement;
     int mirror_adjust_exposure = 0;
     float offset_x = 0;
     float exposure_factor = 1.0f;
+    const char *machine_profile_name = "default";
+    bool do_tick_calibration = false;
+    bool emulate_pru = false;
+    int job_server_port = -1;
+    const char *metrics_file = nullptr;
+    bool do_profile = false;
+    const char *profile_json_file = nullptr;
+    int emulation_latency_usec = 0;
+    int emulation_hsync_jitter = 0;
+    std::string serial_device;
+    int serial_baud = 0;
+    std::vector<ImageLayer> layers;
+
+    enum { OPT_PROFILE = 1000, OPT_MEMORY_LIMIT, OPT_SPILL_DIR };
+    static const struct option long_options[] = {
+        { "profile", optional_argument, NULL, OPT_PROFILE },
+        { "memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT },
+        { "spill-dir", required_argument, NULL, OPT_SPILL_DIR },
+        { NULL, 0, NULL, 0 }
+    };
 
     int opt;
-    while ((opt = getopt(argc, argv, "MFhnid:x:j:o:SERD:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "MFhnid:x:j:o:SERa:BD:L:P:Te:W:m:t:s:",
+                              long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': return usage(argv[0]);
         case 'd':
-            commandline_dpi = atof(optarg);
+            switch (sscanf(optarg, "%f,%f", &commandline_dpi_x,
+                           &commandline_dpi_y)) {
+            case 1: commandline_dpi_y = commandline_dpi_x; break;
+            case 2: break;
+            default: return usage(argv[0], "Invalid DPI");
+            }
             break;
         case 'n':
             dryrun = true;
@@ -180,7 +404,11 @@ int main(int argc, char *argv[]) {
             mirror_adjust_exposure = atoi(optarg);
             break;
         case 'o':
-            offset_x = atof(optarg);   // TODO: also y. as x,y coordinate.
+            if (sscanf(optarg, "%f,%f", &offset_x,
+                       &placement.offset_y_mm) < 1
+                || placement.offset_y_mm < 0) {
+                return usage(argv[0], "Invalid offset");
+            }
             break;
         case 'S':
             do_sled_loading_ui = false;
@@ -189,7 +417,68 @@ int main(int argc, char *argv[]) {
             do_sled_eject = false;
             break;
         case 'R':
-            quarter_turns++;
+            placement.rotate_degrees += 90;
+            break;
+        case 'a':
+            placement.rotate_degrees += atof(optarg);
+            break;
+        case 'B':
+            placement.mirror = true;
+            break;
+        case 'L': {
+            ImageLayer layer;
+            if (!ParseImageLayer(optarg, &layer))
+                return usage(argv[0], "Invalid layer");
+            layers.push_back(layer);
+            break;
+        }
+        case 'P':
+            machine_profile_name = optarg;
+            break;
+        case 'T':
+            do_tick_calibration = true;
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case OPT_PROFILE:
+            do_profile = true;
+            profile_json_file = optarg;
+            break;
+        case OPT_MEMORY_LIMIT: {
+            const int limit_mib = atoi(optarg);
+            if (limit_mib <= 0)
+                return usage(argv[0], "Invalid memory limit");
+            BitmapPool::instance()->SetMemoryLimit((size_t)limit_mib << 20);
+            break;
+        }
+        case OPT_SPILL_DIR:
+            BitmapPool::instance()->SetSpillDirectory(optarg);
+            break;
+        case 'W':
+            job_server_port = atoi(optarg);
+            if (job_server_port <= 0)
+                return usage(argv[0], "Invalid job server port");
+            break;
+        case 'e':
+            emulate_pru = true;
+            if (sscanf(optarg, "%d,%d", &emulation_latency_usec,
+                       &emulation_hsync_jitter) < 1) {
+                return usage(argv[0], "Invalid PRU emulation params");
+            }
+            break;
+        case 's': {
+            const char *comma = strchr(optarg, ',');
+            serial_device.assign(optarg, comma ? comma - optarg
+                                 : strlen(optarg));
+            if (comma && (serial_baud = atoi(comma + 1)) <= 0)
+                return usage(argv[0], "Invalid baud rate");
+            break;
+        }
+        case 't':
+            test_pattern.reset(TestPattern::Create(optarg));
+            if (!test_pattern)
+                return usage(argv[0], "Unknown test pattern");
             break;
         case 'D': {
             float line_w, start, step;
@@ -214,16 +503,24 @@ int main(int argc, char *argv[]) {
         filename = argv[optind];
     }
 
+    if (!layers.empty() && filename == nullptr) {
+        return usage(argv[0], "Layers can only be combined with an image "
+                     "file.");
+    }
+
     if (exposure_factor < 1.0f) {
         return usage(argv[0], "Exposure factor needs to be at least 1.");
     }
 
-    if (filename && dot_size_chart) {
-        return usage(argv[0], "You can either expose an image or create a "
-                     "dot size chart, but not both.");
+    if ((filename != nullptr) + (dot_size_chart != nullptr)
+        + (test_pattern != nullptr) + (job_server_port > 0) > 1) {
+        return usage(argv[0], "You can either expose an image, create a "
+                     "dot size chart, expose a test pattern or run a job "
+                     "server, but only one.");
     }
 
-    if (!filename && !do_focus && !mirror_adjust_exposure && !dot_size_chart)
+    if (!filename && !do_focus && !mirror_adjust_exposure && !dot_size_chart
+        && !test_pattern && !do_tick_calibration && job_server_port < 0)
         return usage(argv[0]);   // Nothing to do.
 
     fprintf(stdout, "LDGraphy Copyright (C) 2017 Henner Zeller | http://ldgraphy.org/\n"
@@ -233,111 +530,224 @@ int main(int argc, char *argv[]) {
             "are met.\n"
             "See https://www.gnu.org/licenses/gpl.txt for details.\n\n");
 
-    bool do_image = false;
-    LDGraphyScanner *ldgraphy = new LDGraphyScanner(exposure_factor);
-    if (dot_size_chart) {
-        do_image = true;
-        ldgraphy->SetLaserDotSize(0, 0);  // Chart already thinned image.
-        ldgraphy->SetImage(dot_size_chart.release(), kThinningChartResolution);
-    } else {
-        do_image = LoadImage(ldgraphy, filename,
-                             commandline_dpi, invert, quarter_turns  % 4);
-        if (filename && !do_image) return 1;  // Got file, but failed loading.
+    if (do_profile) Metrics::instance()->EnableProfiling();
+
+    std::unique_ptr<MetricsFileExporter> metrics_exporter;
+    if (metrics_file)
+        metrics_exporter.reset(new MetricsFileExporter(metrics_file, 5));
+
+    MachineProfile profile;
+    if (!LoadMachineProfile(machine_profile_name, &profile))
+        return usage(argv[0], "Couldn't load machine profile.");
+
+    if (do_tick_calibration) {
+        fprintf(stderr, "== Tick delay calibration. Stop with Ctrl-C. ==\n");
+        ArmInterruptHandler();
+        return RunTickDelayCalibration(profile);
     }
 
-    if (do_image) {
-        const int eta = ldgraphy->estimated_time_seconds();
-        fprintf(stderr, "Estimated exposure time: %d:%02d min "
-                "(%.1fmm/min, "
-                // We don't actually know the optical power output of the
-                // laser diode, so let's just give it as comparative figure.
-                //"%.0fmJ/cm²)\n",
-                "normalized %.0f energy units/area)\n",
-                eta / 60, eta % 60, ldgraphy->exposure_speed_mm_per_sec() * 60,
-                ldgraphy->exposure_joule_per_cm2() * 1000);
+    std::unique_ptr<JobServer> job_server;
+    if (job_server_port > 0) {
+        job_server.reset(new JobServer(invert));
+        if (!job_server->Start(job_server_port))
+            return 1;
     }
 
-    SledControl sled(4000, do_move && !dryrun);
+    const bool expose_test_pattern = (test_pattern != nullptr);
+
+    // Without job server, this runs exactly once.
+    do {
+        // In server mode, only start the machine and ask for the board once
+        // there is something to expose.
+        JobServer::Job job;
+        job.id = -1;
+        if (job_server && !job_server->NextJob(&job))
+            break;   // Server shut down.
+        const int job_id = job.id;
+
+        LDGraphyScanner *ldgraphy = new LDGraphyScanner(profile, exposure_factor);
+
+        // From here on the PRU runs and the sled moves: a Ctrl-C must not
+        // leave them behind, but stop and go through the regular shutdown.
+        ArmInterruptHandler();
+
+        // Bring up the hardware first, so that the mirror spins up and syncs
+        // while the sled is moving and the image is being prepared.
+        ScanLineSender *line_sender;
+        if (dryrun)
+            line_sender = new DummyScanLineSender(profile);
+        else if (emulate_pru)
+            line_sender = PRUScanLineSender::Create(
+                profile, new PruEmulator(emulation_latency_usec,
+                                         emulation_hsync_jitter));
+        else if (!serial_device.empty())
+            line_sender = SerialScanLineSender::Create(
+                profile, serial_device.c_str(), serial_baud);
+        else
+            line_sender = PRUScanLineSender::Create(profile);
+        if (!line_sender) {
+            fprintf(stderr, "Cannot initialize hardware.\n");
+            return 1;
+        }
+        line_sender->StartSpinup();
+        ldgraphy->SetScanLineSender(line_sender);
+
+        // Image preprocessing runs in the background while the sled travels and
+        // the board is placed. Joined before we need the first scanline.
+        bool do_image = false;
+        std::thread image_preparation([&]() {
+                if (dot_size_chart) {
+                    do_image = true;
+                    ldgraphy->SetLaserDotSize(0, 0);  // Chart already thinned.
+                    ldgraphy->SetImage(dot_size_chart.release(),
+                                       kThinningChartResolution,
+                                       kThinningChartResolution);
+                } else if (test_pattern) {
+                    const float dpi_x = (commandline_dpi_x > 0)
+                        ? commandline_dpi_x : kDefaultTestPatternDpi;
+                    const float dpi_y = (commandline_dpi_y > 0)
+                        ? commandline_dpi_y : kDefaultTestPatternDpi;
+                    do_image = ldgraphy->SetTestPattern(
+                        test_pattern.release(), 25.4 / dpi_x, 25.4 / dpi_y,
+                        placement.offset_y_mm);
+                } else if (job_server) {
+                    // The job was decoded while being uploaded.
+                    do_image = PrepareImage(ldgraphy, job.image.release(),
+                                            job.dpi_x, job.dpi_y,
+                                            commandline_dpi_x,
+                                            commandline_dpi_y, placement);
+                } else {
+                    do_image = LoadImage(ldgraphy, filename, layers,
+                                         commandline_dpi_x, commandline_dpi_y,
+                                         invert, placement);
+                }
+            });
 
-    // Super-crude UI
-    if (do_sled_loading_ui) {
-        UIMessage("Hold on .. sled to take your board is on the way...");
-        sled.Move(180);  // Move all the way out for person to place device.
-        UIMessage("Here we are. Please place board in (0,0) corner. Press <RETURN>.");
-        while (fgetc(stdin) != '\n')
-            ;
-        UIMessage("Thanks. Getting ready to scan.");
-    }
+        SledControl sled(4000, do_move && !dryrun && !emulate_pru
+                         && serial_device.empty());
+
+        // Super-crude UI
+        if (do_sled_loading_ui) {
+            UIMessage("Hold on .. sled to take your board is on the way...");
+            sled.Move(180);  // Move all the way out for person to place device.
+            UIMessage("Here we are. Please place board in (0,0) corner. Press <RETURN>.");
+            while (fgetc(stdin) != '\n')
+                ;
+            UIMessage("Thanks. Getting ready to scan.");
+        }
 
-    sled.Move(-180);   // Back to base.
+        sled.Move(-180);   // Back to base.
 
-    float forward_move = kInitialSledOffsetMM;  // Forward until we reach begin.
-    if (mirror_adjust_exposure) forward_move += 5;
-    forward_move += offset_x;
-    sled.Move(forward_move);
+        float forward_move = kInitialSledOffsetMM;  // Forward until we reach begin.
+        if (mirror_adjust_exposure) forward_move += 5;
+        forward_move += offset_x;
+        sled.Move(forward_move);
 
-    ArmInterruptHandler();  // While PRU running, we want controlled exit.
-    ScanLineSender *line_sender = dryrun
-        ? new DummyScanLineSender()
-        : PRUScanLineSender::Create();
-    if (!line_sender) {
-        fprintf(stderr, "Cannot initialize hardware.\n");
-        return 1;
-    }
+        image_preparation.join();
+        // Got file or pattern, but failed loading.
+        if ((filename || expose_test_pattern) && !do_image) {
+            delete ldgraphy;
+            return 1;
+        }
+        if (job_server && !do_image) {
+            delete ldgraphy;  // Shuts down the sender: PRU and mirror stop.
+            DisarmInterruptHandler();
+            sled.Move(-180);  // Back to base, the board stays in place.
+            char data[64];
+            snprintf(data, sizeof(data),
+                     "{\"job\": %d, \"error\": \"Can't prepare image\"}",
+                     job_id);
+            job_server->PublishEvent("error", data);
+            continue;
+        }
 
-    ldgraphy->SetScanLineSender(line_sender);
+        if (do_image) {
+            const int eta = ldgraphy->estimated_time_seconds();
+            fprintf(stderr, "Estimated exposure time: %d:%02d min "
+                    "(%.1fmm/min, "
+                    // We don't actually know the optical power output of the
+                    // laser diode, so let's just give it as comparative figure.
+                    //"%.0fmJ/cm²)\n",
+                    "normalized %.0f energy units/area)\n",
+                    eta / 60, eta % 60, ldgraphy->exposure_speed_mm_per_sec() * 60,
+                    ldgraphy->exposure_joule_per_cm2() * 1000);
+            if (job_server)
+                job_server->SetMachineState(JobServer::MACHINE_LOADING, eta);
+        }
 
-    if (mirror_adjust_exposure) {
-        ldgraphy->ExposeJitterTest(6, mirror_adjust_exposure);
-    }
+        if (mirror_adjust_exposure && !is_interrupted()) {
+            ldgraphy->ExposeJitterTest(6, mirror_adjust_exposure);
+        }
 
-    if (do_focus) {
-        fprintf(stderr, "== FOCUS run. Exit with Ctrl-C. ==\n");
-        RunFocusLine(ldgraphy);
-    }
+        if (do_focus && !is_interrupted()) {
+            fprintf(stderr, "== FOCUS run. Exit with Ctrl-C. ==\n");
+            RunFocusLine(ldgraphy);
+        }
 
-    if (do_image) {
-        fprintf(stderr, "== Exposure. Emergency stop with Ctrl-C. ==\n");
-        int prev_percent = -1, prev_remain_time = -1;
-        const float total_sec = ldgraphy->estimated_time_seconds();
-        ldgraphy->ScanExpose(
-            do_move,
-            [&prev_percent, &prev_remain_time, total_sec](int done, int total) {
-                // Simple commandline progress indicator.
-                const int percent = roundf(100.0 * done / total);
-                const int remain_time = roundf(total_sec -
-                                               (total_sec * done / total));
-                // Only update if any number would change.
-                if (percent != prev_percent || remain_time != prev_remain_time) {
-                    fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
-                            "%3d%%; %d:%02d left ",
-                            percent, remain_time / 60, remain_time % 60);
-                    fflush(stderr);
-                    prev_percent = percent;
-                    prev_remain_time = remain_time;
-                }
-                return !is_interrupted();
-            });
-        if (is_interrupted())
-            fprintf(stderr, "Interrupted. Exposure might be incomplete.\n");
-    }
+        if (do_image) {
+            fprintf(stderr, "== Exposure. Emergency stop with Ctrl-C. ==\n");
+            int prev_percent = -1, prev_remain_time = -1;
+            const float total_sec = ldgraphy->estimated_time_seconds();
+            ldgraphy->ScanExpose(
+                do_move,
+                [&prev_percent, &prev_remain_time, total_sec, &job_server, job_id](
+                    int done, int total) {
+                    // Simple commandline progress indicator.
+                    const int percent = roundf(100.0 * done / total);
+                    const int remain_time = roundf(total_sec -
+                                                   (total_sec * done / total));
+                    // Only update if any number would change.
+                    if (percent != prev_percent || remain_time != prev_remain_time) {
+                        fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"
+                                "%3d%%; %d:%02d left ",
+                                percent, remain_time / 60, remain_time % 60);
+                        fflush(stderr);
+                        if (job_server) {
+                            job_server->SetMachineState(
+                                JobServer::MACHINE_EXPOSING, remain_time);
+                        }
+                        if (job_server && percent != prev_percent) {
+                            char data[64];
+                            snprintf(data, sizeof(data), "{\"job\": %d, "
+                                     "\"percent\": %d, \"remaining_sec\": %d}",
+                                     job_id, percent, remain_time);
+                            job_server->PublishEvent("exposing", data);
+                        }
+                        prev_percent = percent;
+                        prev_remain_time = remain_time;
+                    }
+                    return !is_interrupted();
+                });
+            if (is_interrupted())
+                fprintf(stderr, "Interrupted. Exposure might be incomplete.\n");
+            if (job_server) {
+                char data[64];
+                snprintf(data, sizeof(data), "{\"job\": %d, \"complete\": %s}",
+                         job_id, is_interrupted() ? "false" : "true");
+                job_server->PublishEvent("done", data);
+            }
+        }
 
-    delete ldgraphy;  // First make PRU stop using our pins.
+        delete ldgraphy;  // First make PRU stop using our pins.
 
-    DisarmInterruptHandler();   // Everything that comes now: fine to interrupt
+        DisarmInterruptHandler();   // Everything that comes now: fine to interrupt
 
-    if (do_sled_eject) {
-        UIMessage("Done Scanning - sending the sled with the board towards you.");
-        sled.Move(180);  // Move out for user to grab.
+        if (do_sled_eject) {
+            if (job_server)
+                job_server->SetMachineState(JobServer::MACHINE_UNLOADING, -1);
+            UIMessage("Done Scanning - sending the sled with the board towards you.");
+            sled.Move(180);  // Move out for user to grab.
 
-        UIMessage("Here we are. Please take the board and press <RETURN>");
-        // TODO: here, when the user takes too long, just pull in board again
-        // to have it more protected against light.
-        while (fgetc(stdin) != '\n')
-            ;
-        UIMessage("Thanks. Going back.");
-        sled.Move(-85);
-    }
+            UIMessage("Here we are. Please take the board and press <RETURN>");
+            // TODO: here, when the user takes too long, just pull in board again
+            // to have it more protected against light.
+            while (fgetc(stdin) != '\n')
+                ;
+            UIMessage("Thanks. Going back.");
+            sled.Move(-85);
+        }
+    } while (job_server && !is_interrupted());
 
+    if (do_profile) ReportProfile(profile_json_file);
     return 0;
 }
@@ -0,0 +1,269 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <chrono>
+
+#include "containers.h"
+#include "laser-scribe-constants.h"
+#include "scanline-sender.h"
+
+static const char *const kStageNames[Metrics::NUM_STAGES] = {
+    "decode", "geometry", "scanlines", "expose", "sled_move"
+};
+
+static const char *ErrorName(int status) {
+    switch (status) {
+    case ERROR_DEBUG_BREAK:  return "debug_break";
+    case ERROR_MIRROR_SYNC:  return "mirror_sync";
+    case ERROR_TIME_OVERRUN: return "time_overrun";
+    case ScanLineSender::STATUS_ERR_TIMEOUT: return "timeout";
+    case ScanLineSender::STATUS_ERR_PROTOCOL: return "protocol";
+    default: return nullptr;
+    }
+}
+
+Metrics *Metrics::instance() {
+    static Metrics *metrics = new Metrics();
+    return metrics;
+}
+
+Metrics::Metrics()
+    : scanlines_(0), wakeups_(0), missed_wakeups_(0), ringbuffer_fill_(0), ringbuffer_size_(0),
+      profiling_(false) {
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        stage_micros_[i] = 0;
+        stage_runs_[i] = 0;
+        stage_cpu_micros_[i] = 0;
+        stage_alloc_bytes_[i] = 0;
+        stage_peak_bytes_[i] = 0;
+    }
+    for (int i = 0; i < kMaxStatus; ++i) errors_[i] = 0;
+}
+
+int64_t Metrics::NowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t ThreadCpuMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Profiled stages currently running. The first one to start resets the
+// peak of the BitmapPool.
+static std::atomic<int> running_profiled_stages(0);
+
+void Metrics::AddStageProfile(Stage stage, int64_t cpu_micros,
+                              int64_t alloc_bytes, int64_t peak_bytes) {
+    Add(&stage_cpu_micros_[stage], cpu_micros);
+    Add(&stage_alloc_bytes_[stage], alloc_bytes);
+    int64_t peak = stage_peak_bytes_[stage].load(std::memory_order_relaxed);
+    while (peak < peak_bytes
+           && !stage_peak_bytes_[stage].compare_exchange_weak(peak,
+                                                              peak_bytes)) {
+    }
+}
+
+static void AppendMetric(std::string *out, const char *name, const char *type,
+                         const char *help) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n",
+             name, help, name, type);
+    out->append(buf);
+}
+
+static void AppendValue(std::string *out, const char *name,
+                        const char *label, const char *label_value,
+                        double value) {
+    char buf[256];
+    if (label)
+        snprintf(buf, sizeof(buf), "%s{%s=\"%s\"} %.12g\n",
+                 name, label, label_value, value);
+    else
+        snprintf(buf, sizeof(buf), "%s %.12g\n", name, value);
+    out->append(buf);
+}
+
+std::string Metrics::ToPrometheusText() const {
+    std::string out;
+    AppendMetric(&out, "ldgraphy_scanlines_total", "counter",
+                 "Scanlines sent to the realtime backend.");
+    AppendValue(&out, "ldgraphy_scanlines_total", nullptr, nullptr,
+                scanlines_.load());
+
+    AppendMetric(&out, "ldgraphy_ringbuffer_fill", "gauge",
+                 "Scanlines queued in the ring buffer after the last enqueue.");
+    AppendValue(&out, "ldgraphy_ringbuffer_fill", nullptr, nullptr,
+                ringbuffer_fill_.load());
+    AppendMetric(&out, "ldgraphy_ringbuffer_size", "gauge",
+                 "Scanlines the ring buffer can hold.");
+    AppendValue(&out, "ldgraphy_ringbuffer_size", nullptr, nullptr,
+                ringbuffer_size_.load());
+
+    AppendMetric(&out, "ldgraphy_wait_event_wakeups_total", "counter",
+                 "Wakeups by events from the realtime backend.");
+    AppendValue(&out, "ldgraphy_wait_event_wakeups_total", nullptr, nullptr,
+                wakeups_.load());
+    AppendMetric(&out, "ldgraphy_missed_wakeups_total", "counter",
+                 "Backend got where we waited for, but we only noticed "
+                 "after waiting for an event timed out.");
+    AppendValue(&out, "ldgraphy_missed_wakeups_total", nullptr, nullptr,
+                missed_wakeups_.load());
+
+    AppendMetric(&out, "ldgraphy_stage_seconds_total", "counter",
+                 "Time spent in image processing and machine stages.");
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        AppendValue(&out, "ldgraphy_stage_seconds_total", "stage",
+                    kStageNames[i], stage_micros_[i].load() / 1e6);
+    }
+    AppendMetric(&out, "ldgraphy_stage_runs_total", "counter",
+                 "Number of times each stage ran.");
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        AppendValue(&out, "ldgraphy_stage_runs_total", "stage",
+                    kStageNames[i], stage_runs_[i].load());
+    }
+
+    AppendMetric(&out, "ldgraphy_bitmap_bytes", "gauge",
+                 "Bytes of image bitmaps in use, in memory or mapped from "
+                 "files beyond the memory limit.");
+    AppendValue(&out, "ldgraphy_bitmap_bytes", "kind", "memory",
+                BitmapPool::instance()->bytes_in_use());
+    AppendValue(&out, "ldgraphy_bitmap_bytes", "kind", "mapped",
+                BitmapPool::instance()->mapped_bytes_in_use());
+
+    AppendMetric(&out, "ldgraphy_errors_total", "counter",
+                 "Errors reported by the realtime backend, by status.");
+    for (int i = 0; i < kMaxStatus; ++i) {
+        if (!ErrorName(i)) continue;
+        AppendValue(&out, "ldgraphy_errors_total", "status", ErrorName(i),
+                    errors_[i].load());
+    }
+    return out;
+}
+
+std::string Metrics::ProfileTable() const {
+    std::string out;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%-10s %8s %10s %10s %12s %14s\n",
+             "stage", "runs", "wall [s]", "cpu [s]", "alloc [MiB]",
+             "peak mem [MiB]");
+    out.append(buf);
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        snprintf(buf, sizeof(buf), "%-10s %8lld %10.3f %10.3f %12.1f %14.1f\n",
+                 kStageNames[i], (long long)stage_runs_[i].load(),
+                 stage_micros_[i].load() / 1e6,
+                 stage_cpu_micros_[i].load() / 1e6,
+                 stage_alloc_bytes_[i].load() / 1048576.0,
+                 stage_peak_bytes_[i].load() / 1048576.0);
+        out.append(buf);
+    }
+    return out;
+}
+
+std::string Metrics::ProfileJson() const {
+    std::string out = "{\"stages\": {";
+    char buf[256];
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        snprintf(buf, sizeof(buf), "%s\n  \"%s\": {\"runs\": %lld, "
+                 "\"wall_sec\": %.6f, \"cpu_sec\": %.6f, "
+                 "\"alloc_bytes\": %lld, \"peak_bytes\": %lld}",
+                 i > 0 ? "," : "", kStageNames[i],
+                 (long long)stage_runs_[i].load(),
+                 stage_micros_[i].load() / 1e6,
+                 stage_cpu_micros_[i].load() / 1e6,
+                 (long long)stage_alloc_bytes_[i].load(),
+                 (long long)stage_peak_bytes_[i].load());
+        out.append(buf);
+    }
+    out.append("\n}}\n");
+    return out;
+}
+
+ScopedStageTimer::ScopedStageTimer(Metrics::Stage stage)
+    : stage_(stage), start_(Metrics::NowMicros()),
+      profiling_(Metrics::instance()->profiling()),
+      start_cpu_(0), start_alloc_(0) {
+    if (profiling_) {
+        start_cpu_ = ThreadCpuMicros();
+        start_alloc_ = BitmapPool::instance()->bytes_allocated();
+        if (running_profiled_stages.fetch_add(1) == 0)
+            BitmapPool::instance()->ResetPeak();
+    }
+}
+
+ScopedStageTimer::~ScopedStageTimer() {
+    Metrics *const metrics = Metrics::instance();
+    metrics->AddStageTime(stage_, Metrics::NowMicros() - start_);
+    if (profiling_) {
+        metrics->AddStageProfile(
+            stage_, ThreadCpuMicros() - start_cpu_,
+            BitmapPool::instance()->bytes_allocated() - start_alloc_,
+            BitmapPool::instance()->peak_bytes_in_use());
+        running_profiled_stages.fetch_sub(1);
+    }
+}
+
+MetricsFileExporter::MetricsFileExporter(const char *filename,
+                                         int interval_seconds)
+    : filename_(filename), interval_seconds_(interval_seconds), stop_(false),
+      thread_(&MetricsFileExporter::Run, this) {
+}
+
+MetricsFileExporter::~MetricsFileExporter() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stop_ = true;
+    }
+    stop_requested_.notify_all();
+    thread_.join();
+    WriteFile();
+}
+
+bool MetricsFileExporter::WriteFile() {
+    const std::string content = Metrics::instance()->ToPrometheusText();
+    const std::string tmp = filename_ + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        perror(tmp.c_str());
+        return false;
+    }
+    const bool success = (fwrite(content.data(), 1, content.size(), f)
+                          == content.size());
+    if (fclose(f) != 0 || !success) return false;
+    return rename(tmp.c_str(), filename_.c_str()) == 0;
+}
+
+void MetricsFileExporter::Run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!stop_) {
+        l.unlock();
+        WriteFile();
+        l.lock();
+        stop_requested_.wait_for(l, std::chrono::seconds(interval_seconds_),
+                                 [this]() { return stop_; });
+    }
+}
@@ -0,0 +1,147 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_METRICS_H
+#define LDGRAPHY_METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Counters about what the machine is doing, to be exported in the Prometheus
+// text format. All updates are lock-free atomic operations, so they can be
+// done from the feeder and image processing threads without slowing them
+// down.
+//
+// With profiling enabled, stages also record CPU time, bitmap allocations and
+// peak bitmap memory for a report at the end of a run.
+class Metrics {
+public:
+    // Stages we measure the time of.
+    enum Stage {
+        STAGE_DECODE,       // Reading the PNG image(s), composing layers.
+        STAGE_GEOMETRY,     // Preparing lookup tables in SetImage()
+        STAGE_SCANLINES,    // Creating scanlines: gathering and thinning.
+        STAGE_EXPOSE,       // ScanExpose(), overlaps with creating scanlines.
+        STAGE_SLED_MOVE,    // Sled moves outside exposure.
+        NUM_STAGES
+    };
+
+    static constexpr int kMaxStatus = 8;   // Statuses we count errors for.
+
+    static Metrics *instance();
+
+    static int64_t NowMicros();   // Monotonic clock.
+
+    void CountScanline() { Add(&scanlines_, 1); }
+    void CountWakeup() { Add(&wakeups_, 1); }
+    void CountMissedWakeup() { Add(&missed_wakeups_, 1); }
+    void SetRingbufferFill(int fill, int size) {
+        ringbuffer_fill_.store(fill, std::memory_order_relaxed);
+        ringbuffer_size_.store(size, std::memory_order_relaxed);
+    }
+    void AddStageTime(Stage stage, int64_t micros) {
+        Add(&stage_micros_[stage], micros);
+        Add(&stage_runs_[stage], 1);
+    }
+
+    // Per-stage profile; costs a few system calls per stage, so only
+    // collected when enabled.
+    void EnableProfiling() { profiling_.store(true); }
+    bool profiling() const {
+        return profiling_.load(std::memory_order_relaxed);
+    }
+    void AddStageProfile(Stage stage, int64_t cpu_micros, int64_t alloc_bytes,
+                         int64_t peak_bytes);
+
+    // Count an error by ScanLineSender::Status value.
+    void CountError(int status) {
+        if (status > 0 && status < kMaxStatus) Add(&errors_[status], 1);
+    }
+
+    // All current values in Prometheus text exposition format.
+    std::string ToPrometheusText() const;
+
+    // Profile of all stages as human readable table and as JSON.
+    std::string ProfileTable() const;
+    std::string ProfileJson() const;
+
+private:
+    Metrics();
+
+    static void Add(std::atomic<int64_t> *counter, int64_t value) {
+        counter->fetch_add(value, std::memory_order_relaxed);
+    }
+
+    std::atomic<int64_t> scanlines_;
+    std::atomic<int64_t> wakeups_;
+    std::atomic<int64_t> missed_wakeups_;
+    std::atomic<int64_t> ringbuffer_fill_;
+    std::atomic<int64_t> ringbuffer_size_;
+    std::atomic<int64_t> stage_micros_[NUM_STAGES];
+    std::atomic<int64_t> stage_runs_[NUM_STAGES];
+    std::atomic<int64_t> errors_[kMaxStatus];
+
+    std::atomic<bool> profiling_;
+    std::atomic<int64_t> stage_cpu_micros_[NUM_STAGES];
+    std::atomic<int64_t> stage_alloc_bytes_[NUM_STAGES];
+    std::atomic<int64_t> stage_peak_bytes_[NUM_STAGES];
+};
+
+// Measure the time of a stage from construction to destruction; if profiling,
+// also CPU time of this thread, bitmap allocations and the peak bitmap memory
+// in use meanwhile. The peak is measured from the start of the oldest stage
+// still running, so stages running in parallel share it.
+class ScopedStageTimer {
+public:
+    explicit ScopedStageTimer(Metrics::Stage stage);
+    ~ScopedStageTimer();
+
+private:
+    const Metrics::Stage stage_;
+    const int64_t start_;
+    const bool profiling_;
+    int64_t start_cpu_;
+    int64_t start_alloc_;
+};
+
+// Write the metrics regularly to a file, e.g. for the textfile collector of
+// the Prometheus node exporter. The file is replaced atomically, so readers
+// never see a partial file. Writes a last time when destructed.
+class MetricsFileExporter {
+public:
+    MetricsFileExporter(const char *filename, int interval_seconds);
+    ~MetricsFileExporter();
+
+private:
+    bool WriteFile();
+    void Run();
+
+    const std::string filename_;
+    const int interval_seconds_;
+    std::mutex mutex_;
+    std::condition_variable stop_requested_;
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif  // LDGRAPHY_METRICS_H
@@ -0,0 +1,469 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "morphology.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "image-processing.h"
+
+// Minimum number of rows we compute at once. The window around it needs
+// context rows, so we don't want to make it too small.
+static constexpr int kMinBandRows = 64;
+
+// Each rectangle is one pass over the image, so large ellipses are
+// approximated with at most this many of them.
+static constexpr int kMaxKernelRects = 4;
+
+EllipticalKernel::EllipticalKernel(int x_radius, int y_radius)
+    : x_radius_(std::max(0, x_radius)), y_radius_(std::max(0, y_radius)) {
+    // Half-width of the ellipse for each row offset dy. It is monotonically
+    // decreasing, so each change in width marks the end of a rectangle that
+    // spans all the rows up to here.
+    std::vector<Rect> corners;
+    for (int dy = 0; dy <= y_radius_; ++dy) {
+        const int width = WidthAt(dy);
+        if (dy == y_radius_ || WidthAt(dy + 1) != width) {
+            const Rect r = { width, dy };
+            corners.push_back(r);
+        }
+    }
+    if ((int)corners.size() <= kMaxKernelRects) {
+        rects_ = corners;
+        return;
+    }
+
+    // Too many. Choose the subset of corners whose rectangles cover most of
+    // the ellipse; all of them are inside the ellipse, so the approximation
+    // errs on the side of eroding and dilating a little less.
+    // area[k][j]: covered by k + 1 rectangles, corner j being the last one.
+    const int m = corners.size();
+    std::vector<std::vector<long> > area(kMaxKernelRects,
+                                         std::vector<long>(m, -1));
+    std::vector<std::vector<int> > prev(kMaxKernelRects,
+                                        std::vector<int>(m, -1));
+    for (int j = 0; j < m; ++j) {
+        area[0][j] = (2L * corners[j].x_radius + 1)
+            * (2 * corners[j].y_radius + 1);
+    }
+    for (int k = 1; k < kMaxKernelRects; ++k) {
+        for (int j = k; j < m; ++j) {
+            for (int p = k - 1; p < j; ++p) {
+                const long a = area[k-1][p] + (2L * corners[j].x_radius + 1)
+                    * 2 * (corners[j].y_radius - corners[p].y_radius);
+                if (a > area[k][j]) {
+                    area[k][j] = a;
+                    prev[k][j] = p;
+                }
+            }
+        }
+    }
+    int best = 0;
+    for (int j = 1; j < m; ++j) {
+        if (area[kMaxKernelRects-1][j] > area[kMaxKernelRects-1][best])
+            best = j;
+    }
+    for (int k = kMaxKernelRects - 1; k >= 0; best = prev[k--][best])
+        rects_.insert(rects_.begin(), corners[best]);
+}
+
+int EllipticalKernel::WidthAt(int dy) const {
+    if (y_radius_ == 0) return x_radius_;
+    const float rel = 1.0f * dy / y_radius_;
+    return floorf(x_radius_ * sqrtf(1 - rel * rel) + 1e-4);
+}
+
+// -- Operations on rows packed in 64 bit words. The first pixel is in the
+// most significant bit, just as it is in the bytes of BitmapImage.
+namespace {
+struct AndOp {
+    static constexpr bool kErode = true;
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a & b; }
+};
+struct OrOp {
+    static constexpr bool kErode = false;
+    static uint64_t Apply(uint64_t a, uint64_t b) { return a | b; }
+};
+}
+
+static inline uint64_t LoadBigEndian(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void StoreBigEndian(uint64_t v, uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static void BytesToWords(const uint8_t *in, int bytes, uint64_t *out) {
+    for (/**/; bytes >= 8; bytes -= 8, in += 8)
+        *out++ = LoadBigEndian(in);
+    if (bytes > 0) {
+        uint64_t v = 0;
+        for (int b = 0; b < 8; ++b)
+            v = (v << 8) | (b < bytes ? in[b] : 0);
+        *out = v;
+    }
+}
+
+static void WordsToBytes(const uint64_t *in, uint8_t *out, int bytes) {
+    for (/**/; bytes >= 8; bytes -= 8, out += 8)
+        StoreBigEndian(*in++, out);
+    for (int b = 0; b < bytes; ++b)
+        out[b] = *in >> (56 - 8 * b);
+}
+
+static inline bool GetBit(const uint64_t *row, int x) {
+    return (row[x / 64] >> (63 - x % 64)) & 1;
+}
+
+static inline void SetBit(uint64_t *row, int x) {
+    row[x / 64] |= 1ULL << (63 - x % 64);
+}
+
+// Return position of the next bit with "value" at or after "from", or
+// n*64 if there is none.
+static int NextBit(const uint64_t *row, int n, int from, bool value) {
+    int i = from / 64;
+    if (i >= n) return n * 64;
+    uint64_t w = (value ? row[i] : ~row[i]) & (~0ULL >> (from % 64));
+    while (!w) {
+        if (++i >= n) return n * 64;
+        w = value ? row[i] : ~row[i];
+    }
+    return i * 64 + __builtin_clzll(w);
+}
+
+// Set pixels ["from", "to") of the row.
+static void SetRange(uint64_t *row, int from, int to) {
+    int i = from / 64;
+    const int last = (to - 1) / 64;
+    const uint64_t first_mask = ~0ULL >> (from % 64);
+    const uint64_t last_mask = ~0ULL << (63 - (to - 1) % 64);
+    if (i == last) {
+        row[i] |= first_mask & last_mask;
+        return;
+    }
+    row[i++] |= first_mask;
+    for (/**/; i < last; ++i) row[i] = ~0ULL;
+    row[last] |= last_mask;
+}
+
+// out[x] = Op(in[x - radius] ... in[x + radius]).
+// Works on the runs of set pixels, which are found word-wise: each of them
+// shrinks (erosion) or grows (dilation) by the radius on both ends. So the
+// cost only depends on the number of words and runs, not on the radius.
+template <class Op>
+static void HorizontalRun(const uint64_t *in, uint64_t *out, int n,
+                          int radius) {
+    if (radius == 0) {
+        memcpy(out, in, n * sizeof(*in));
+        return;
+    }
+    memset(out, 0, n * sizeof(*out));
+    const int width = n * 64;
+    int done = 0;   // Dilation: output already set up to here.
+    for (int x = NextBit(in, n, 0, true); x < width; /**/) {
+        const int end = NextBit(in, n, x, false);
+        int from, to;
+        if (Op::kErode) {
+            from = x + radius;
+            to = end - radius;
+        } else {
+            from = std::max(x - radius, done);
+            to = std::min(end + radius, width);
+            done = std::max(done, to);
+        }
+        if (from < to) SetRange(out, from, to);
+        x = NextBit(in, n, end, true);
+    }
+}
+
+// Same as HorizontalRun(), but across "num_rows" rows of "n" words, word-wise
+// with the van Herk/Gil-Werman algorithm: in blocks of 2 * radius + 1 rows,
+// the prefix and suffix of the operation are computed; each output row then
+// combines one suffix and one prefix row. So this is three operations per
+// word, regardless of the radius. "in" and "out" can be the same.
+template <class Op>
+static void VerticalRun(const uint64_t *in, uint64_t *out, int num_rows, int n,
+                        int radius, uint64_t *prefix, uint64_t *suffix) {
+    const size_t row_size = n * sizeof(*in);
+    if (radius == 0) {
+        if (out != in) memcpy(out, in, num_rows * row_size);
+        return;
+    }
+    const int block = 2 * radius + 1;
+    for (int y = 0; y < num_rows; ++y) {
+        const uint64_t *const r = in + y * n;
+        uint64_t *const p = prefix + y * n;
+        if (y % block == 0) {
+            memcpy(p, r, row_size);
+        } else {
+            for (int i = 0; i < n; ++i) p[i] = Op::Apply(p[i - n], r[i]);
+        }
+    }
+    for (int y = num_rows - 1; y >= 0; --y) {
+        const uint64_t *const r = in + y * n;
+        uint64_t *const s = suffix + y * n;
+        if (y % block == block - 1 || y == num_rows - 1) {
+            memcpy(s, r, row_size);
+        } else {
+            for (int i = 0; i < n; ++i) s[i] = Op::Apply(s[i + n], r[i]);
+        }
+    }
+    for (int y = 0; y < num_rows; ++y) {
+        uint64_t *const o = out + y * n;
+        int a = y - radius, b = y + radius;
+        if (a < 0 || b >= num_rows) {
+            // Pixels outside are not set: erosion clears, dilation ignores.
+            if (Op::kErode) {
+                memset(o, 0, row_size);
+                continue;
+            }
+            a = std::max(a, 0);
+            b = std::min(b, num_rows - 1);
+        }
+        if (a % block == 0) {
+            memcpy(o, prefix + b * n, row_size);   // Same block.
+        } else if (a / block == b / block) {
+            memcpy(o, suffix + a * n, row_size);   // b: last row of image.
+        } else {
+            const uint64_t *const s = suffix + a * n;
+            const uint64_t *const p = prefix + b * n;
+            for (int i = 0; i < n; ++i) o[i] = Op::Apply(s[i], p[i]);
+        }
+    }
+}
+
+template <class Op>
+static void MorphRows(const EllipticalKernel &kernel,
+                      const uint64_t *in, uint64_t *out, int num_rows, int n,
+                      uint64_t *run, uint64_t *prefix, uint64_t *suffix) {
+    bool first = true;
+    for (const EllipticalKernel::Rect &rect : kernel.rects()) {
+        for (int y = 0; y < num_rows; ++y) {
+            HorizontalRun<Op>(in + y * n, run + y * n, n, rect.x_radius);
+        }
+        if (first) {
+            VerticalRun<Op>(run, out, num_rows, n, rect.y_radius,
+                            prefix, suffix);
+            first = false;
+        } else {
+            VerticalRun<Op>(run, run, num_rows, n, rect.y_radius,
+                            prefix, suffix);
+            for (int i = 0; i < num_rows * n; ++i)
+                out[i] = Op::Apply(out[i], run[i]);
+        }
+    }
+}
+
+static int HaloFor(MorphologyFilter::Operation op,
+                   const EllipticalKernel &kernel) {
+    if (op != MorphologyFilter::THIN)
+        return kernel.y_radius();
+    // Thinning needs the eroded image dilated again (2 * y_radius) and needs
+    // to see the full extent of vertical runs it possibly keeps.
+    return 2 * (kernel.x_radius() + kernel.y_radius()) + 1;
+}
+
+MorphologyFilter::MorphologyFilter(Operation op, const EllipticalKernel &kernel,
+                                   int width, int height)
+    : op_(op), kernel_(kernel), width_bytes_(width / 8),
+      words_((width + 63) / 64), height_(height),
+      halo_(HaloFor(op, kernel)),
+      band_(std::max(kMinBandRows, 4 * halo_)),
+      window_rows_(band_ + 2 * halo_),
+      window_base_(-halo_), rows_pushed_(0),
+      window_(window_rows_ * words_), result_(window_.size()),
+      eroded_(op == THIN ? window_.size() : 0),
+      run_(window_.size()), prefix_(window_.size()), suffix_(window_.size()),
+      lost_columns_(words_),
+      output_pos_(0) {
+    assert(width % 8 == 0);
+}
+
+void MorphologyFilter::PushRow(const uint8_t *row) {
+    assert(rows_pushed_ < height_);
+    BytesToWords(row, width_bytes_,
+                 WindowRow(&window_, rows_pushed_ - window_base_));
+    ++rows_pushed_;
+    if (rows_pushed_ == window_base_ + window_rows_)
+        ProcessBand();
+    if (rows_pushed_ == height_) {
+        // Rows beyond the image are zero, so we can finish all the rest.
+        while (window_base_ + halo_ < height_)
+            ProcessBand();
+    }
+}
+
+bool MorphologyFilter::PopRow(uint8_t *row) {
+    if (output_pos_ >= output_.size())
+        return false;
+    memcpy(row, &output_[output_pos_], width_bytes_);
+    output_pos_ += width_bytes_;
+    if (output_pos_ == output_.size()) {
+        output_.clear();
+        output_pos_ = 0;
+    }
+    return true;
+}
+
+void MorphologyFilter::MorphWindow(bool erode,
+                                   const uint64_t *in, uint64_t *out) {
+    if (erode) {
+        MorphRows<AndOp>(kernel_, in, out, window_rows_, words_,
+                         &run_[0], &prefix_[0], &suffix_[0]);
+    } else {
+        MorphRows<OrOp>(kernel_, in, out, window_rows_, words_,
+                        &run_[0], &prefix_[0], &suffix_[0]);
+    }
+}
+
+// Thin structures keep their center line instead of disappearing: of the
+// pixels lost in the "num_rows" window rows starting at "first_row" (set in
+// the input, but not anymore after an opening; in run_), the ones in the
+// center of a short horizontal or vertical run are set in result_.
+// Each row is scanned by runs, each column with lost pixels once, so this
+// is linear in the pixels looked at, whatever the radius.
+void MorphologyFilter::KeepVanishingCenters(int first_row, int num_rows) {
+    const int width = width_bytes_ * 8;
+    const int max_run = 2 * (kernel_.x_radius() + kernel_.y_radius());
+
+    std::fill(lost_columns_.begin(), lost_columns_.end(), 0);
+    for (int r = first_row; r < first_row + num_rows; ++r) {
+        const uint64_t *const lost = WindowRow(&run_, r);
+        if (NextBit(lost, words_, 0, true) >= width)
+            continue;  // Nothing lost, which is the common case.
+        for (int i = 0; i < words_; ++i) lost_columns_[i] |= lost[i];
+
+        const uint64_t *const img = WindowRow(&window_, r);
+        uint64_t *const out = WindowRow(&result_, r);
+        for (int x = NextBit(img, words_, 0, true); x < width; /**/) {
+            const int end = NextBit(img, words_, x, false);
+            if (end - x <= max_run && GetBit(lost, (x + end) / 2))
+                SetBit(out, (x + end) / 2);
+            x = NextBit(img, words_, end, true);
+        }
+    }
+
+    // The halo is larger than max_run, so runs that are short enough and
+    // have their center in our rows are entirely in the window.
+    const uint64_t *const columns = &lost_columns_[0];
+    for (int x = NextBit(columns, words_, 0, true); x < width;
+         x = NextBit(columns, words_, x + 1, true)) {
+        for (int start = 0; start < window_rows_; /**/) {
+            if (!GetBit(WindowRow(&window_, start), x)) {
+                ++start;
+                continue;
+            }
+            int end = start + 1;
+            while (end < window_rows_ && GetBit(WindowRow(&window_, end), x))
+                ++end;
+            const int center = (start + end) / 2;
+            if (end - start <= max_run
+                && center >= first_row && center < first_row + num_rows
+                && GetBit(WindowRow(&run_, center), x)) {
+                SetBit(WindowRow(&result_, center), x);
+            }
+            start = end;
+        }
+    }
+}
+
+void MorphologyFilter::ProcessBand() {
+    const int out_rows = std::min(band_, height_ - (window_base_ + halo_));
+    const size_t out_start = output_.size();
+    output_.resize(out_start + out_rows * width_bytes_, 0);
+
+    bool any_bit = false;
+    for (size_t i = 0; !any_bit && i < window_.size(); ++i)
+        any_bit = (window_[i] != 0);
+
+    // An all-empty window stays empty with any of our operations.
+    if (any_bit) {
+        switch (op_) {
+        case ERODE:
+            MorphWindow(true, &window_[0], &result_[0]);
+            break;
+        case DILATE:
+            MorphWindow(false, &window_[0], &result_[0]);
+            break;
+        case THIN:
+            // Erode, then see what an opening would not restore.
+            MorphWindow(true, &window_[0], &eroded_[0]);
+            MorphWindow(false, &eroded_[0], &result_[0]);
+            for (int r = halo_; r < halo_ + out_rows; ++r) {
+                uint64_t *const opened = WindowRow(&result_, r);
+                const uint64_t *const img = WindowRow(&window_, r);
+                const uint64_t *const eroded = WindowRow(&eroded_, r);
+                uint64_t *const lost = WindowRow(&run_, r);
+                for (int i = 0; i < words_; ++i)
+                    lost[i] = img[i] & ~opened[i];
+                memcpy(opened, eroded, words_ * sizeof(uint64_t));
+            }
+            KeepVanishingCenters(halo_, out_rows);
+            break;
+        }
+        for (int r = 0; r < out_rows; ++r) {
+            WordsToBytes(WindowRow(&result_, halo_ + r),
+                         &output_[out_start + r * width_bytes_], width_bytes_);
+        }
+    }
+
+    // Advance window by one band.
+    const size_t band_words = band_ * words_;
+    std::copy(window_.begin() + band_words, window_.end(), window_.begin());
+    std::fill(window_.end() - band_words, window_.end(), 0);
+    window_base_ += band_;
+}
+
+static void FilterInPlace(MorphologyFilter::Operation op,
+                          const EllipticalKernel &kernel, BitmapImage *img) {
+    if (kernel.empty()) return;
+    MorphologyFilter filter(op, kernel, img->width(), img->height());
+    int out_row = 0;
+    for (int y = 0; y < img->height(); ++y) {
+        // Output always lags behind input, so it is safe to write in-place.
+        filter.PushRow(img->GetRow(y));
+        while (filter.PopRow(img->GetMutableRow(out_row)))
+            ++out_row;
+    }
+    assert(out_row == img->height());
+}
+
+void ErodeImage(BitmapImage *img, const EllipticalKernel &kernel) {
+    FilterInPlace(MorphologyFilter::ERODE, kernel, img);
+}
+void DilateImage(BitmapImage *img, const EllipticalKernel &kernel) {
+    FilterInPlace(MorphologyFilter::DILATE, kernel, img);
+}
+void ThinImage(BitmapImage *img, const EllipticalKernel &kernel) {
+    FilterInPlace(MorphologyFilter::THIN, kernel, img);
+}
@@ -0,0 +1,129 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_MORPHOLOGY_H
+#define LDGRAPHY_MORPHOLOGY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class BitmapImage;
+
+// Elliptical structuring element, used to model the (oval) laser dot.
+//
+// The ellipse is decomposed into a handful of centered rectangles; erosion
+// by the ellipse is the intersection of the erosions by each of these
+// rectangles (dilation: the union). Rectangles are separable, so each of them
+// is processed as a horizontal and a vertical run operation. Large ellipses
+// are approximated with the few rectangles inside them that cover most of
+// their area.
+class EllipticalKernel {
+public:
+    struct Rect {
+        int x_radius;   // Rectangle spans [-x_radius .. x_radius]
+        int y_radius;   // and [-y_radius .. y_radius]
+    };
+
+    // Ellipse with the given radii in pixels. If one radius is zero, this
+    // degenerates to a line in the other direction.
+    EllipticalKernel(int x_radius, int y_radius);
+
+    int x_radius() const { return x_radius_; }
+    int y_radius() const { return y_radius_; }
+
+    // Kernel only containing the center pixel; operations are a no-op.
+    bool empty() const { return x_radius_ == 0 && y_radius_ == 0; }
+
+    const std::vector<Rect> &rects() const { return rects_; }
+
+private:
+    int WidthAt(int dy) const;
+
+    int x_radius_, y_radius_;
+    std::vector<Rect> rects_;
+};
+
+// Streaming binary morphology on packed bitmap rows.
+//
+// Rows are pushed in order; results become available a few rows later, so
+// only a small window of the image is held in memory at any time. Internally,
+// rows are handled as 64 bit words: horizontal runs work on the runs of set
+// pixels, vertical runs word-wise with the van Herk/Gil-Werman algorithm. The
+// kernel has a small fixed number of rectangles, so the cost per pixel does
+// not grow with the radius.
+class MorphologyFilter {
+public:
+    enum Operation {
+        ERODE,
+        DILATE,
+        // Erosion, but structures that would vanish entirely keep their
+        // center line, so that no feature is lost (essentially: don't
+        // expose it thinner than the laser dot, but still expose it).
+        THIN,
+    };
+
+    // Filter rows of an image with given "width" (multiple of 8) and
+    // "height". Pixels outside the image are regarded as not set.
+    MorphologyFilter(Operation op, const EllipticalKernel &kernel,
+                     int width, int height);
+
+    // Push the next input row, consisting of width/8 bytes. Needs to be called
+    // exactly "height" times.
+    void PushRow(const uint8_t *row);
+
+    // Copy the next output row to "row" if available. Returns false if more
+    // input is needed first.
+    bool PopRow(uint8_t *row);
+
+private:
+    typedef std::vector<uint64_t> Words;
+
+    void ProcessBand();
+    void MorphWindow(bool erode, const uint64_t *in, uint64_t *out);
+    void KeepVanishingCenters(int first_row, int num_rows);
+
+    uint64_t *WindowRow(Words *w, int r) { return &(*w)[r * words_]; }
+
+    const Operation op_;
+    const EllipticalKernel kernel_;
+    const int width_bytes_;
+    const int words_;         // 64 bit words per row.
+    const int height_;
+    const int halo_;          // Context rows needed above and below a band.
+    const int band_;          // Rows computed per band.
+    const int window_rows_;   // band_ + 2 * halo_
+
+    int window_base_;         // Image row of the first row in window.
+    int rows_pushed_;
+
+    Words window_;            // Input rows [window_base_, +window_rows_)
+    Words result_, eroded_, run_, prefix_, suffix_;  // scratch, same size.
+    Words lost_columns_;      // single row scratch.
+
+    std::vector<uint8_t> output_; // Rows ready to be popped.
+    size_t output_pos_;
+};
+
+// Convenience functions operating in-place on a full image.
+void ErodeImage(BitmapImage *img, const EllipticalKernel &kernel);
+void DilateImage(BitmapImage *img, const EllipticalKernel &kernel);
+void ThinImage(BitmapImage *img, const EllipticalKernel &kernel);
+
+#endif // LDGRAPHY_MORPHOLOGY_H
@@ -0,0 +1,432 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Build time check of the assembled PRU program: each tick of the state
+// machine must be done within the tick delay, otherwise the PRU stops with
+// ERROR_TIME_OVERRUN at runtime.
+//
+// A tick starts when the cycle counter is reset and ends when it is read
+// again in wait_to_next_tick_and_reset; everything in between has to fit
+// into tick_delay - TICK_OVERHEAD_CYCLES. We follow every path between the
+// two, including all targets of the JMP through the state register, and
+// add up the cycles of the worst one.
+//
+// Usage: pru-cycle-budget [-o <cycles.h>] <program_bin.h> [<tick-delay>]
+// The program is the C array written by pasm -c. Tick delay defaults to
+// TICK_DELAY. Exit code is non-zero if the program does not fit.
+// With -o, the worst case is written as PRU_WORST_TICK_CYCLES into a header,
+// so that the host software can reject profiles with a shorter tick delay.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "laser-scribe-constants.h"
+
+// Instruction timing. All instructions take one cycle, except memory access:
+// a load stalls until the data arrives, a store is posted. Reads from within
+// the PRU subsystem are fast; everything else goes through the interconnect,
+// which can take a lot longer. Values are rounded up to be on the safe side.
+static constexpr int kLocalReadCycles = 3;      // First 4 bytes.
+static constexpr int kExternalReadCycles = 40;  // e.g. GPIO.
+static constexpr int kStoreCycles = 2;          // First 4 bytes.
+static constexpr uint32_t kLocalAddressEnd = 0x80000;  // PRU subsystem.
+
+// Constant table entries that point into the PRU subsystem: interrupt
+// controller, config, data RAMs, IEP, MII_RT, shared RAM.
+static bool IsLocalConstant(int c) {
+    return c == 0 || c == 4 || (c >= 24 && c <= 28);
+}
+
+static const char *const kStateNames[NUM_STATE_IDS] = {
+    "Idle", "Spinup", "Wait stable", "Confirm stable", "Hold sync",
+    "Data wait for sync", "Data run", "Advance ringbuffer", "Await more data"
+};
+
+static constexpr int kNoTickEnd = -1;   // Path never reads the counter.
+
+// Decoding of the instruction words we need to know about.
+struct Insn {
+    Insn(uint32_t w) : word(w) {}
+
+    int group() const { return word >> 29; }
+    int field(int shift, int bits) const {
+        return (word >> shift) & ((1 << bits) - 1);
+    }
+
+    bool is_alu() const { return group() == 0; }
+    int format2_op() const { return field(25, 4); }
+    bool is_jmp() const { return group() == 1 && format2_op() == 0; }
+    bool is_jal() const { return group() == 1 && format2_op() == 1; }
+    bool is_ldi() const { return group() == 1 && format2_op() == 2; }
+    bool is_lmbd_or_scan() const {
+        return group() == 1 && (format2_op() == 3 || format2_op() == 4);
+    }
+    bool is_halt() const {   // HALT or SLP
+        return group() == 1 && (format2_op() == 5 || format2_op() == 15);
+    }
+    bool immediate() const { return field(24, 1); }
+    int imm16() const { return field(8, 16); }
+
+    // Quick branches: compare (QBxx) or bit test (QBBC, QBBS).
+    bool is_compare_branch() const { return (word >> 30) == 1; }
+    bool is_bit_branch() const { return group() == 6; }
+    bool is_branch() const { return is_compare_branch() || is_bit_branch(); }
+    bool is_unconditional_branch() const {
+        return is_compare_branch() && field(27, 3) == 7;   // QBA
+    }
+    int branch_offset() const {
+        const int offset = field(25, 2) << 8 | field(0, 8);
+        return offset >= 512 ? offset - 1024 : offset;
+    }
+
+    // Memory access: LBBO/SBBO (register base), LBCO/SBCO (constant table).
+    bool is_memory() const { return group() == 7 || group() == 4; }
+    bool is_constant_table() const { return group() == 4; }
+    bool is_load() const { return is_memory() && field(28, 1); }
+    int base() const { return field(8, 5); }    // Register or constant.
+    int offset() const { return field(16, 8); } // if immediate()
+    int bytes() const {
+        const int code = field(25, 3) << 4 | field(13, 3) << 1 | field(7, 1);
+        return code < 124 ? code + 1 : 124;     // Else: length in r0.
+    }
+
+    int rd() const { return field(0, 8); }      // Register and field select.
+    int op2() const { return field(16, 8); }
+
+    uint32_t word;
+};
+
+class CycleBudget {
+public:
+    explicit CycleBudget(const std::vector<uint32_t> &program)
+        : code_(program.begin(), program.end()), loop_found_(false),
+          worst_cycles_(0) {}
+
+    bool Analyze(int tick_delay);
+
+    // Worst case cycles of a tick, after Analyze().
+    int worst_cycles() const { return worst_cycles_; }
+
+private:
+    std::vector<int> Successors(int pc) const;
+    bool KnownRegisterValue(int pc, int reg, uint32_t *value) const;
+    int Cycles(int pc) const;
+    bool IsCounterAccess(int pc, bool load) const;
+    int LongestPath(int pc, int end_pc, std::vector<int> *memo,
+                    std::vector<bool> *on_path);
+    int StateId(int pc) const;
+
+    std::vector<Insn> code_;
+    std::set<int> targets_;             // All addresses jumped to.
+    std::set<int> state_targets_;       // Targets of the register JMP.
+    bool loop_found_;
+    int worst_cycles_;
+};
+
+// Addresses jumped to via register are loaded with LDI into the very same
+// register field before.
+std::vector<int> CycleBudget::Successors(int pc) const {
+    const Insn &i = code_[pc];
+    std::vector<int> result;
+    if (i.is_halt()) return result;
+    if (i.is_jmp() || i.is_jal()) {
+        if (i.immediate()) {
+            result.push_back(i.imm16());
+        } else {
+            for (size_t p = 0; p < code_.size(); ++p) {
+                if (code_[p].is_ldi() && code_[p].rd() == i.op2())
+                    result.push_back(code_[p].imm16());
+            }
+        }
+        return result;
+    }
+    if (i.is_branch()) {
+        result.push_back(pc + i.branch_offset());
+        if (i.is_unconditional_branch()) return result;
+    }
+    result.push_back(pc + 1);
+    return result;
+}
+
+// Value of a register at "pc" if it is set with LDIs right before, in code
+// that can't be entered otherwise. Enough to find out addresses of LBBO/SBBO.
+bool CycleBudget::KnownRegisterValue(int pc, int reg, uint32_t *value) const {
+    static const int kFieldMask[8] = { 1, 2, 4, 8, 3, 6, 12, 15 };
+    static const int kFieldShift[8] = { 0, 8, 16, 24, 0, 8, 16, 0 };
+    uint32_t result = 0;
+    int known = 0;   // Bit per known byte.
+    for (int p = pc - 1; p >= 0 && known != 0xf; --p) {
+        if (targets_.count(p + 1)) return false;   // Might come from elsewhere.
+        const Insn &i = code_[p];
+        if (i.is_jmp() || i.is_halt() || i.is_unconditional_branch())
+            return false;
+        const int rd = i.rd() & 0x1f;
+        bool writes;
+        if (i.is_load()) {   // Bursts fill consecutive registers.
+            writes = (reg >= rd && reg <= rd + (i.bytes() - 1) / 4);
+        } else {
+            writes = (rd == reg && (i.is_alu() || i.is_ldi() || i.is_jal()
+                                    || i.is_lmbd_or_scan()));
+        }
+        if (!writes) continue;
+        if (!i.is_ldi()) return false;   // Not something we follow.
+
+        // Loading a full register zero-extends the 16 bit value.
+        const int sel = i.rd() >> 5;
+        const uint32_t v = i.imm16();
+        for (int b = 0; b < 4; ++b) {
+            if (!(kFieldMask[sel] & (1 << b)) || (known & (1 << b)))
+                continue;
+            const int shift = 8 * b - kFieldShift[sel];
+            result |= ((v >> shift) & 0xff) << (8 * b);
+            known |= 1 << b;
+        }
+    }
+    *value = result;
+    return known == 0xf;
+}
+
+int CycleBudget::Cycles(int pc) const {
+    const Insn &i = code_[pc];
+    if (!i.is_memory()) return 1;
+    const int extra_words = (i.bytes() - 1) / 4;
+    if (!i.is_load()) return kStoreCycles + extra_words;
+    bool local;
+    if (i.is_constant_table()) {
+        local = IsLocalConstant(i.base());
+    } else {
+        uint32_t address;
+        local = (KnownRegisterValue(pc, i.base(), &address)
+                 && address < kLocalAddressEnd);
+    }
+    return (local ? kLocalReadCycles : kExternalReadCycles) + extra_words;
+}
+
+bool CycleBudget::IsCounterAccess(int pc, bool load) const {
+    const Insn &i = code_[pc];
+    uint32_t address;
+    return (i.is_memory() && !i.is_constant_table() && i.is_load() == load
+            && i.immediate() && i.offset() == CYCLE_COUNTER_OFFSET
+            && KnownRegisterValue(pc, i.base(), &address)
+            && address == PRUSS_PRU_CTL);
+}
+
+// Most cycles from "pc" until the tick ends with reading the counter,
+// including the cycles of that instruction. With "end_pc" given, the cycles
+// until reaching that instruction instead.
+int CycleBudget::LongestPath(int pc, int end_pc, std::vector<int> *memo,
+                             std::vector<bool> *on_path) {
+    if (pc < 0 || pc >= (int)code_.size()) return kNoTickEnd;
+    if ((*memo)[pc] != -2) return (*memo)[pc];
+    if (pc == end_pc) return (*memo)[pc] = Cycles(pc);
+    if (IsCounterAccess(pc, true))
+        return (*memo)[pc] = (end_pc < 0) ? Cycles(pc) : kNoTickEnd;
+    if ((*on_path)[pc]) {
+        fprintf(stderr, "Loop at instruction %d within a tick; can't "
+                "determine the cycles needed.\n", pc);
+        loop_found_ = true;
+        return kNoTickEnd;
+    }
+    (*on_path)[pc] = true;
+    int longest = kNoTickEnd;
+    for (int next : Successors(pc)) {
+        longest = std::max(longest,
+                           LongestPath(next, end_pc, memo, on_path));
+    }
+    (*on_path)[pc] = false;
+    if (longest != kNoTickEnd) longest += Cycles(pc);
+    return (*memo)[pc] = longest;
+}
+
+// States account their cycles with LDI r4, CYCLE_STATS_POS + 4 * id as
+// first thing.
+int CycleBudget::StateId(int pc) const {
+    for (int p = pc; p < pc + 4 && p < (int)code_.size(); ++p) {
+        const Insn &i = code_[p];
+        if (i.is_ldi() && i.rd() == (7 << 5 | 4)
+            && i.imm16() >= CYCLE_STATS_POS
+            && i.imm16() < CYCLE_STATS_POS + 4 * NUM_STATE_IDS) {
+            return (i.imm16() - CYCLE_STATS_POS) / 4;
+        }
+    }
+    return -1;
+}
+
+bool CycleBudget::Analyze(int tick_delay) {
+    const int code_size = code_.size();
+    int register_jump = -1;
+    for (int pc = 0; pc < code_size; ++pc) {
+        for (int next : Successors(pc)) {
+            if (next != pc + 1) targets_.insert(next);
+        }
+        if (code_[pc].is_jmp() && !code_[pc].immediate()) {
+            register_jump = pc;
+            for (int next : Successors(pc)) state_targets_.insert(next);
+        }
+    }
+
+    std::vector<int> tick_starts;
+    for (int pc = 0; pc < code_size; ++pc) {
+        if (IsCounterAccess(pc, false)) tick_starts.push_back(pc + 1);
+    }
+    if (tick_starts.empty()) {
+        fprintf(stderr, "No cycle counter reset found; is this the "
+                "right program?\n");
+        return false;
+    }
+
+    // Worst case overall, and up to the state dispatch to add it per state.
+    std::vector<int> memo(code_size, -2);
+    std::vector<int> to_dispatch_memo(code_size, -2);
+    std::vector<bool> on_path(code_size, false);
+    int worst = kNoTickEnd;
+    int worst_to_dispatch = 0;
+    for (int start : tick_starts) {
+        worst = std::max(worst, LongestPath(start, -1, &memo, &on_path));
+        if (register_jump >= 0) {
+            worst_to_dispatch = std::max(
+                worst_to_dispatch,
+                LongestPath(start, register_jump, &to_dispatch_memo,
+                            &on_path));
+        }
+    }
+    if (loop_found_) return false;
+    if (worst == kNoTickEnd) {
+        fprintf(stderr, "No path from the cycle counter reset to "
+                "reading it.\n");
+        return false;
+    }
+
+    const int budget = tick_delay - TICK_OVERHEAD_CYCLES;
+    for (int target : state_targets_) {
+        const int through_state = LongestPath(target, -1, &memo, &on_path);
+        if (through_state == kNoTickEnd) continue;
+        const int id = StateId(target);
+        char name[64];
+        snprintf(name, sizeof(name), "%s @%d",
+                 (id >= 0) ? kStateNames[id] : "State", target);
+        const int cycles = worst_to_dispatch + through_state;
+        fprintf(stderr, "  %-26s %3d cycles%s\n", name, cycles,
+                cycles > budget ? "  <- over budget" : "");
+    }
+    fprintf(stderr, "Worst case %d of %d cycles per tick (tick delay %d; "
+            "needs at least %d).\n", worst, budget, tick_delay,
+            worst + TICK_OVERHEAD_CYCLES);
+    worst_cycles_ = worst;
+    return worst <= budget;
+}
+
+// Read the words of the array in the header written by pasm.
+static bool ReadProgram(const char *filename, std::vector<uint32_t> *program) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    std::string content;
+    char buf[4096];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) content.append(buf, r);
+    fclose(f);
+
+    const size_t start = content.find('{');
+    if (start == std::string::npos) {
+        fprintf(stderr, "%s: no program array found.\n", filename);
+        return false;
+    }
+    const char *pos = content.c_str() + start + 1;
+    for (;;) {
+        while (*pos == ',' || *pos == ' ' || *pos == '\t' || *pos == '\n'
+               || *pos == '\r')
+            ++pos;
+        char *end;
+        const unsigned long word = strtoul(pos, &end, 0);
+        if (end == pos) break;
+        program->push_back(word);
+        pos = end;
+    }
+    if (*pos != '}') {
+        fprintf(stderr, "%s: can't parse program array.\n", filename);
+        return false;
+    }
+    return !program->empty();
+}
+
+// Write the worst case into a header to be included by the host software.
+static bool WriteCyclesHeader(const char *filename, const char *program,
+                              int worst_cycles) {
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        perror(filename);
+        return false;
+    }
+    fprintf(out, "// Generated by pru-cycle-budget from %s; do not edit.\n"
+            "// Worst case PRU cycles of one tick, without the "
+            "TICK_OVERHEAD_CYCLES.\n"
+            "#define PRU_WORST_TICK_CYCLES %d\n", program, worst_cycles);
+    return fclose(out) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *cycles_header = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            cycles_header = optarg;
+            break;
+        default:
+            return 2;
+        }
+    }
+    const int args = argc - optind;
+    if (args < 1 || args > 2) {
+        fprintf(stderr, "Usage: %s [-o <cycles.h>] <program_bin.h> "
+                "[<tick-delay>]\n"
+                "Check that each tick of the PRU program fits into the "
+                "tick delay (default %d).\n"
+                "  -o <cycles.h> : Write the worst case into this header.\n",
+                argv[0], TICK_DELAY);
+        return 2;
+    }
+    const char *program_file = argv[optind];
+    const int tick_delay = (args > 1) ? atoi(argv[optind + 1]) : TICK_DELAY;
+    std::vector<uint32_t> program;
+    if (!ReadProgram(program_file, &program))
+        return 1;
+    CycleBudget budget(program);
+    if (!budget.Analyze(tick_delay)) {
+        fprintf(stderr, "%s: PRU program does not fit into the tick "
+                "delay.\n", program_file);
+        return 1;
+    }
+    if (cycles_header && !WriteCyclesHeader(cycles_header, program_file,
+                                            budget.worst_cycles())) {
+        return 1;
+    }
+    return 0;
+}
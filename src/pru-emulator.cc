@@ -0,0 +1,327 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pru-emulator.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "laser-scribe-constants.h"
+
+// The mirror starts spinning as soon as the PRU runs, but needs a while
+// until it reaches its speed and we see regular hsyncs.
+constexpr int64_t kMirrorSettleTicks = SPINUP_TICKS / 2;
+
+static uint32_t ReadParam(const std::vector<uint8_t> &mem, int pos) {
+    uint32_t result;
+    memcpy(&result, &mem[pos], sizeof(result));
+    return result;
+}
+
+static void WriteParam(std::vector<uint8_t> *mem, int pos, uint32_t value) {
+    memcpy(&(*mem)[pos], &value, sizeof(value));
+}
+
+static uint16_t ReadWindowValue(const std::vector<uint8_t> &mem, int pos) {
+    uint16_t result;
+    memcpy(&result, &mem[pos], sizeof(result));
+    return result;
+}
+
+static bool IsScanData(uint8_t cmd) {
+    return cmd == CMD_SCAN_DATA || cmd == CMD_SCAN_DATA_NO_SLED;
+}
+
+PruEmulator::PruEmulator(int max_host_latency_usec, int hsync_jitter_ticks)
+    : max_host_latency_usec_(max_host_latency_usec),
+      hsync_jitter_(hsync_jitter_ticks), mem_(PRU_DATA_RAM_SIZE),
+      state_(HALTED) {
+}
+
+bool PruEmulator::Init() {
+    fprintf(stderr, "PRU emulation; host latency up to %dusec, "
+            "hsync jitter %d ticks.\n", max_host_latency_usec_, hsync_jitter_);
+    return true;
+}
+
+bool PruEmulator::AllocateSharedMem(void **pru_mmap, const size_t size) {
+    if (size > mem_.size()) {
+        fprintf(stderr, "Requested shared memory exceeds PRU data RAM.\n");
+        return false;
+    }
+    std::fill(mem_.begin(), mem_.end(), 0);
+    *pru_mmap = mem_.data();
+    return true;
+}
+
+bool PruEmulator::StartExecution() {
+    tick_delay_ = ReadParam(mem_, PARAM_TICK_DELAY);
+    segment_ = ReadParam(mem_, PARAM_TICKS_PER_MIRROR_SEGMENT);
+    jitter_allow_ = ReadParam(mem_, PARAM_JITTER_ALLOW);
+    item_size_ = ReadParam(mem_, PARAM_ITEM_SIZE);
+    ringbuffer_end_ = ReadParam(mem_, PARAM_RINGBUFFER_END);
+    stable_facets_ = mem_[PARAM_STABLE_FACETS];
+    low_water_ = ReadParam(mem_, PARAM_LOW_WATER);
+    // 200 CPU cycles per microsecond.
+    max_latency_ticks_ = (int64_t)max_host_latency_usec_ * 200 / tick_delay_;
+
+    seed_ = 0x1db5e;
+    state_ = IDLE;
+    now_ = 0;
+    state_end_ = kNever;
+    mirror_stable_ = kMirrorSettleTicks;
+    last_hsync_ = -1;
+    stable_count_ = 0;
+    sync_laser_on_ = 0;
+    item_start_ = START_RINGBUFFER;
+    sled_owned_ = false;
+    pending_events_ = 0;
+
+    lines_ = sled_steps_ = underruns_ = sync_attempts_ = 0;
+    lost_segments_ = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_time_);
+    return true;
+}
+
+uint8_t PruEmulator::header() const {
+    if (ReadParam(mem_, PRODUCER_INDEX_POS)
+        == ReadParam(mem_, CONSUMER_INDEX_POS)) {
+        return CMD_EMPTY;
+    }
+    return mem_[item_start_];
+}
+
+void PruEmulator::Consume() {
+    const uint32_t consumed = ReadParam(mem_, CONSUMER_INDEX_POS) + 1;
+    WriteParam(&mem_, CONSUMER_INDEX_POS, consumed);
+    item_start_ += item_size_;
+    if (item_start_ >= ringbuffer_end_) item_start_ = START_RINGBUFFER;
+    // Like the PRU, only wake up the host once it is time to refill.
+    if (ReadParam(mem_, PRODUCER_INDEX_POS) - consumed <= low_water_)
+        SendEvent();
+}
+
+int PruEmulator::HsyncJitter(int64_t k) const {
+    if (hsync_jitter_ <= 0) return 0;
+    uint32_t x = (uint32_t)k * 2654435761u;   // Deterministic per hsync.
+    x ^= x >> 15; x *= 0x2c1b3c6d; x ^= x >> 12;
+    return (int)(x % (2 * hsync_jitter_ + 1)) - hsync_jitter_;
+}
+
+int64_t PruEmulator::NextHsync(int64_t t) const {
+    t = std::max(t, mirror_stable_);
+    const int64_t phase = segment_ / 3;  // Arbitrary mirror position.
+    int64_t k = std::max<int64_t>(0, (t - phase - hsync_jitter_) / segment_);
+    while (k * segment_ + phase + HsyncJitter(k) < t)
+        ++k;
+    return k * segment_ + phase + HsyncJitter(k);
+}
+
+int64_t PruEmulator::NextTransition() const {
+    if (state_ == HALTED) return kNever;
+    if (header() == CMD_EXIT) return now_ + 1;
+    switch (state_) {
+    case IDLE:
+        return header() == CMD_EMPTY ? kNever : now_ + 1;
+    case SPINUP:
+    case DATA_RUN:
+        return state_end_;
+    case WAIT_STABLE:
+        return std::min(NextHsync(std::max(sync_laser_on_, now_ + 1)),
+                        state_end_);
+    case CONFIRM_STABLE:
+    case DATA_WAIT_FOR_SYNC:
+        return NextHsync(std::max(sync_laser_on_, now_ + 1));
+    case HOLD_SYNC:
+        return std::min(NextHsync(std::max(sync_laser_on_, now_ + 1)),
+                        state_end_);
+    case AWAIT_MORE_DATA:
+        return IsScanData(header()) ? now_ + 1 : state_end_;
+    case HALTED:
+        break;
+    }
+    return kNever;
+}
+
+void PruEmulator::StartDataRun(int64_t hsync) {
+    sled_owned_ = true;
+    state_ = DATA_RUN;
+    // One tick per bit until the end of the data window, then one to notice
+    // the end, one to advance.
+    const int window_pos = item_start_ + SCANLINE_WINDOW_POS;
+    const int window_end = ReadWindowValue(mem_, window_pos)
+        + ReadWindowValue(mem_, window_pos + 2);
+    state_end_ = hsync + 8 * window_end + 2;
+}
+
+void PruEmulator::Finish(int64_t t, uint8_t error) {
+    now_ = t;
+    if (error != ERROR_NONE) mem_[ERROR_RESULT_POS] = error;
+    mem_[HALTED_POS] = 1;
+    SendEvent();
+    state_ = HALTED;
+}
+
+void PruEmulator::Transition(int64_t t) {
+    now_ = t;
+    if (header() == CMD_EXIT) {
+        Finish(t, ERROR_NONE);
+        return;
+    }
+
+    switch (state_) {
+    case IDLE:
+        if (header() == CMD_SPINUP) {
+            Consume();  // Acknowledge
+        } else {
+            sled_owned_ = true;
+        }
+        state_ = SPINUP;
+        state_end_ = t + SPINUP_MIN_TICKS;
+        break;
+
+    case SPINUP:
+        state_ = WAIT_STABLE;
+        state_end_ = t + SPINUP_TIMEOUT;
+        sync_laser_on_ = 0;  // Laser on until the first hsync.
+        last_hsync_ = -1;
+        stable_count_ = 0;
+        sync_attempts_++;
+        break;
+
+    case WAIT_STABLE:
+        if (t >= state_end_) {
+            Finish(t, ERROR_MIRROR_SYNC);
+            break;
+        }
+        sync_laser_on_ = t + segment_ - 2 * jitter_allow_;
+        if (last_hsync_ >= 0
+            && llabs(t - last_hsync_ - segment_) <= jitter_allow_) {
+            if (++stable_count_ >= stable_facets_)
+                state_ = CONFIRM_STABLE;
+        } else {
+            stable_count_ = 0;
+        }
+        last_hsync_ = t;
+        break;
+
+    case CONFIRM_STABLE:
+        sync_laser_on_ = t + segment_ - 2 * jitter_allow_;
+        if (header() != CMD_EMPTY) {
+            StartDataRun(t);
+        } else {
+            state_ = HOLD_SYNC;
+            state_end_ = t + SPINUP_HOLD_WAIT;
+        }
+        break;
+
+    case HOLD_SYNC:
+        if (t >= state_end_) {
+            state_ = IDLE;
+            break;
+        }
+        sync_laser_on_ = t + segment_ - 2 * jitter_allow_;
+        if (header() != CMD_EMPTY) StartDataRun(t);
+        break;
+
+    case DATA_WAIT_FOR_SYNC: {
+        // The hsync we have been aiming for; if we see a later one, the data
+        // came too late and we lost time. Also: the laser was switched on
+        // right away, i.e. long before the hsync.
+        const int64_t expected_hsync = sync_laser_on_ + 2 * jitter_allow_;
+        const int64_t lost = llround(1.0 * (t - expected_hsync) / segment_);
+        if (lost > 0) {
+            underruns_++;
+            lost_segments_ += lost;
+        }
+        sync_laser_on_ = t + segment_ - 2 * jitter_allow_;
+        StartDataRun(t);
+        break;
+    }
+
+    case DATA_RUN:  // Done with data: advance ring buffer.
+        if (header() != CMD_SCAN_DATA_NO_SLED) sled_steps_++;
+        lines_++;
+        Consume();
+        state_ = AWAIT_MORE_DATA;
+        state_end_ = t + END_OF_DATA_WAIT;
+        break;
+
+    case AWAIT_MORE_DATA:
+        if (IsScanData(header())) {
+            state_ = DATA_WAIT_FOR_SYNC;
+        } else {
+            state_ = IDLE;   // Waited too long; motors off.
+        }
+        break;
+
+    case HALTED:
+        break;
+    }
+}
+
+void PruEmulator::RunUntil(int64_t until, bool stop_at_event) {
+    event_sent_ = false;
+    for (;;) {
+        const int64_t t = NextTransition();
+        if (t == kNever || t > until) {
+            if (until != kNever) now_ = std::max(now_, until);
+            return;
+        }
+        Transition(t);
+        if (stop_at_event && event_sent_) return;
+    }
+}
+
+unsigned PruEmulator::WaitEvent() {
+    if (pending_events_ == 0) {
+        RunUntil(kNever, true);
+        if (pending_events_ == 0) {
+            fprintf(stderr, "PRU emulation: host waits for event, "
+                    "but state machine is stuck.\n");
+            abort();
+        }
+        // The host only wakes up a bit later; the PRU keeps going meanwhile.
+        seed_ = seed_ * 1103515245 + 12345;
+        RunUntil(now_ + (seed_ >> 8) % (max_latency_ticks_ + 1), false);
+    }
+    const unsigned events = pending_events_;
+    pending_events_ = 0;
+    return events;
+}
+
+bool PruEmulator::Shutdown() {
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    const double real_sec = (end_time.tv_sec - start_time_.tv_sec)
+        + (end_time.tv_nsec - start_time_.tv_nsec) / 1e9;
+    const double simulated_sec = now_ * (tick_delay_ / 200e6);
+    fprintf(stderr, "PRU emulation: %d lines, %d sled steps in %.2fs "
+            "simulated time (%.0fx real time).\n"
+            "  %d underruns, losing %lld mirror segments; %d mirror sync "
+            "attempts.\n", lines_, sled_steps_, simulated_sec,
+            simulated_sec / std::max(real_sec, 1e-6),
+            underruns_, (long long)lost_segments_, sync_attempts_);
+    state_ = HALTED;
+    return true;
+}
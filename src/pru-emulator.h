@@ -0,0 +1,122 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_PRU_EMULATOR_H
+#define LDGRAPHY_PRU_EMULATOR_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+#include "compiler-compat.h"
+#include "uio-pruss-interface.h"
+
+// Behavioral model of the state machine in laser-scribe-pru.p, working on
+// the same shared memory layout. Runs in simulated time: the PRU only
+// advances while the host waits for an event, jumping from one state change
+// to the next, so jobs run much faster than real time.
+//
+// Models spin-up, mirror synchronization, data output, ring buffer handling
+// and sled stepping. Instruction timing is not modeled (no time overruns).
+//
+// At Shutdown(), a report is printed with simulated time to complete,
+// lines, sled steps and underruns (lines that could not start at their
+// mirror segment as the host did not provide data in time).
+class PruEmulator : public PruInterface {
+public:
+    // The host reacts to each PRU event with a random latency of up to
+    // "max_host_latency_usec". Each hsync deviates randomly up to
+    // "hsync_jitter_ticks" from the ideal mirror period.
+    PruEmulator(int max_host_latency_usec, int hsync_jitter_ticks);
+
+    bool Init() override;
+    bool AllocateSharedMem(void **pru_mmap, const size_t size) override;
+    bool StartExecution() override;
+    unsigned WaitEvent() override;
+    bool Shutdown() override;
+
+private:
+    enum State {
+        IDLE, SPINUP, WAIT_STABLE, CONFIRM_STABLE, HOLD_SYNC,
+        DATA_WAIT_FOR_SYNC, DATA_RUN, AWAIT_MORE_DATA, HALTED
+    };
+
+    static constexpr int64_t kNever = INT64_MAX;
+
+    // Command of the next item, CMD_EMPTY if the host published none.
+    uint8_t header() const;
+
+    // Done with the current item: hand it back and move on to the next.
+    void Consume();
+
+    // Run the state machine until simulated time "until" or, if
+    // "stop_at_event" is set, the first event sent to the host.
+    void RunUntil(int64_t until, bool stop_at_event);
+
+    // Time of the next state change, given the current shared memory.
+    int64_t NextTransition() const;
+    void Transition(int64_t t);
+
+    // Time of first hsync at or after time "t". Before the mirror reached
+    // its speed, there are no usable hsyncs.
+    int64_t NextHsync(int64_t t) const;
+    int HsyncJitter(int64_t k) const;
+
+    void StartDataRun(int64_t hsync);
+    void SendEvent() { pending_events_++; event_sent_ = true; }
+    void Finish(int64_t t, uint8_t error);
+
+    const int max_host_latency_usec_;
+    const int hsync_jitter_;
+
+    std::vector<uint8_t> mem_;
+    uint32_t seed_;
+
+    // Timing parameters as read from memory at start.
+    int tick_delay_;
+    int64_t segment_;        // ticks per mirror segment
+    int64_t jitter_allow_;
+    int item_size_;
+    int ringbuffer_end_;
+    int stable_facets_;
+    uint32_t low_water_;
+    int64_t max_latency_ticks_;
+
+    State state_;
+    int64_t now_;            // Simulated time in ticks.
+    int64_t state_end_;      // Timeout of current state.
+    int64_t mirror_stable_;  // Time after which we see regular hsyncs.
+    int64_t last_hsync_;
+    int stable_count_;       // Hsyncs in a row within jitter_allow_
+    int64_t sync_laser_on_;  // Time laser is switched on to see next hsync
+    int item_start_;
+    bool sled_owned_;
+    unsigned pending_events_;
+    bool event_sent_;
+
+    // Statistics
+    struct timespec start_time_;
+    int lines_;
+    int sled_steps_;
+    int underruns_;
+    int64_t lost_segments_;
+    int sync_attempts_;
+};
+
+#endif  // LDGRAPHY_PRU_EMULATOR_H
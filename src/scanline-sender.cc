@@ -19,10 +19,17 @@
 #include "scanline-sender.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "laser-scribe-constants.h"
+#include "metrics.h"
 
 const char *ScanLineSender::StatusToString(Status s) {
     switch (s) {
@@ -31,122 +38,386 @@ const char *ScanLineSender::StatusToString(Status s) {
     case STATUS_DEBUG_BREAK: return "Debug break point";
     case STATUS_ERR_MIRROR_SYNC: return "Error while synchronizing mirror";
     case STATUS_ERR_TIME_OVERRUN: return "State machine time overrun";
+    case STATUS_ERR_TIMEOUT: return "Timeout waiting for realtime backend";
+    case STATUS_ERR_PROTOCOL: return "Garbled or lost data to backend";
     default: return "Unknown status";
     }
 }
 
+const char *ScanLineSender::StateIdToString(int state_id) {
+    switch (state_id) {
+    case STATE_ID_IDLE:               return "Idle";
+    case STATE_ID_SPINUP:             return "Spinup";
+    case STATE_ID_WAIT_STABLE:        return "Wait stable";
+    case STATE_ID_CONFIRM_STABLE:     return "Confirm stable";
+    case STATE_ID_HOLD_SYNC:          return "Hold sync";
+    case STATE_ID_DATA_WAIT_FOR_SYNC: return "Data wait for sync";
+    case STATE_ID_DATA_RUN:           return "Data run";
+    case STATE_ID_ADVANCE_RINGBUFFER: return "Advance ringbuffer";
+    case STATE_ID_AWAIT_MORE_DATA:    return "Await more data";
+    default: return "Unknown state";
+    }
+}
+
 // Stop gap for compiler attempting to be overly clever when copying between
-// host and PRU memory.
-static void unaligned_memcpy(volatile void *dest, const void *src, size_t size) {
-  volatile char *d = (volatile char*) dest;
-  const char *s = (char*) src;
-  const volatile char *end = d + size;
-  while (d < end) {
-    *d++ = *s++;
-  }
-}
-
-namespace {
-struct QueueElement {
+// host and PRU memory: libc block moves use NEON and unaligned stores, which
+// the uio-mapped PRU memory does not take. So only aligned words are stored,
+// and the bytes at the ragged ends one by one.
+void ScanLineSender::CopyToSlot(volatile uint8_t *slot, const uint8_t *data,
+                                int start, int end) {
+    int i = start;
+    for (/**/; i < end && ((uintptr_t)(slot + i) & 3) != 0; ++i)
+        slot[i] = data[i];
+    for (/**/; i + 4 <= end; i += 4) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));  // Host memory: fine.
+        *(volatile uint32_t*)(slot + i) = word;
+    }
+    for (/**/; i < end; ++i)
+        slot[i] = data[i];
+}
+
+void ScanLineSender::FillSlot(volatile uint8_t *slot, uint8_t value,
+                              int start, int end) {
+    const uint32_t word = value * 0x01010101u;
+    int i = start;
+    for (/**/; i < end && ((uintptr_t)(slot + i) & 3) != 0; ++i)
+        slot[i] = value;
+    for (/**/; i + 4 <= end; i += 4)
+        *(volatile uint32_t*)(slot + i) = word;
+    for (/**/; i < end; ++i)
+        slot[i] = value;
+}
+
+void ScanLineSender::FindDataWindow(const volatile uint8_t *data, int size,
+                                    int *data_start, int *data_end) {
+    int start = 0;
+    while (start < size && data[start] == 0) ++start;
+    while (size > start && data[size - 1] == 0) --size;
+    *data_start = start;
+    *data_end = size;
+}
+
+bool ScanLineSender::EnqueueNextData(const uint8_t *data, size_t size,
+                                     bool sled_on) {
+    // Only transfer the part of the line that has dots set.
+    int start, end;
+    FindDataWindow(data, size, &start, &end);
+    return EnqueueWindow(data, start, end, sled_on);
+}
+
+bool ScanLineSender::EnqueueWindow(const uint8_t *data, int data_start,
+                                   int data_end, bool sled_on) {
+    volatile uint8_t *const slot = AcquireSlot();
+    if (slot == nullptr) return false;
+    CopyToSlot(slot, data, data_start, data_end);
+    return Commit(sled_on, data_start, data_end);
+}
+
+// Header of each item in the ring buffer. The data window follows directly.
+struct PRUScanLineSender::ItemHeader {
     volatile uint8_t state;
-    volatile uint8_t data[SCANLINE_DATA_SIZE];
+    volatile uint8_t padding;
+    volatile uint16_t data_start;   // Byte offset of window in line.
+    volatile uint16_t data_length;  // Bytes in window.
+    volatile uint16_t padding2;
 } __attribute__((packed));
-}
 
 struct PRUScanLineSender::PRUCommunication {
     volatile uint8_t error_status;
-    volatile QueueElement ring_buffer[QUEUE_LEN];
+    volatile uint8_t halted;
+    volatile uint8_t padding[PARAMETER_POS - 2];
+    volatile uint32_t tick_delay;
+    volatile uint32_t ticks_per_mirror_segment;
+    volatile uint32_t jitter_allow;
+    volatile uint32_t item_size;
+    volatile uint32_t ringbuffer_end;
+    volatile uint32_t stable_facets;
+    volatile uint32_t low_water;
+    volatile uint32_t max_state_cycles[NUM_STATE_IDS];
+    volatile uint8_t padding2[PRODUCER_INDEX_POS - CYCLE_STATS_POS
+                              - 4 * NUM_STATE_IDS];
+    volatile uint32_t producer_index;
+    volatile uint8_t padding3[CONSUMER_INDEX_POS - PRODUCER_INDEX_POS - 4];
+    volatile uint32_t consumer_index;
+    volatile uint8_t padding4[START_RINGBUFFER - CONSUMER_INDEX_POS - 4];
+    volatile uint8_t ring_buffer[PRU_DATA_RAM_SIZE - START_RINGBUFFER];
 } __attribute__((packed));
 
-PRUScanLineSender::PRUScanLineSender() : status_(STATUS_NOT_RUNNING),
-                                         queue_pos_(0) {
+PRUScanLineSender::PRUScanLineSender(PruInterface *pru)
+    : pru_data_(nullptr), status_(STATUS_NOT_RUNNING), epoll_fd_(-1),
+      event_timeout_ms_(0), stall_timeout_ms_(0), write_index_(0),
+      published_index_(0), queue_len_(0), low_water_(0), publish_batch_(0), item_size_(0), line_bytes_(0),
+      pru_(pru) {
     // Make sure that things are packed the way we think it is.
-    assert(sizeof(QueueElement) == SCANLINE_ITEM_SIZE);
+    assert(sizeof(ItemHeader) == SCANLINE_HEADER_SIZE);
+    assert(offsetof(ItemHeader, data_start) == SCANLINE_WINDOW_POS);
+    assert(offsetof(PRUCommunication, tick_delay) == PARAM_TICK_DELAY);
+    assert(offsetof(PRUCommunication, ticks_per_mirror_segment)
+           == PARAM_TICKS_PER_MIRROR_SEGMENT);
+    assert(offsetof(PRUCommunication, jitter_allow) == PARAM_JITTER_ALLOW);
+    assert(offsetof(PRUCommunication, item_size) == PARAM_ITEM_SIZE);
+    assert(offsetof(PRUCommunication, ringbuffer_end) == PARAM_RINGBUFFER_END);
+    assert(offsetof(PRUCommunication, stable_facets) == PARAM_STABLE_FACETS);
+    assert(offsetof(PRUCommunication, low_water) == PARAM_LOW_WATER);
+    assert(offsetof(PRUCommunication, max_state_cycles) == CYCLE_STATS_POS);
+    assert(offsetof(PRUCommunication, producer_index) == PRODUCER_INDEX_POS);
+    assert(offsetof(PRUCommunication, consumer_index) == CONSUMER_INDEX_POS);
+    assert(offsetof(PRUCommunication, ring_buffer) == START_RINGBUFFER);
+    assert(sizeof(PRUCommunication) == PRU_DATA_RAM_SIZE);
 }
 PRUScanLineSender::~PRUScanLineSender() {
-    if (status_ == STATUS_RUNNING) pru_.Shutdown();
+    if (status_ == STATUS_RUNNING) pru_->Shutdown();
+    if (epoll_fd_ >= 0) close(epoll_fd_);
 }
 
-ScanLineSender *PRUScanLineSender::Create() {
-    PRUScanLineSender *result = new PRUScanLineSender();
-    if (!result->Init()) {
+ScanLineSender *PRUScanLineSender::Create(const MachineProfile &profile,
+                                          PruInterface *pru) {
+    PRUScanLineSender *result
+        = new PRUScanLineSender(pru ? pru : new UioPrussInterface());
+    if (!result->Init(profile)) {
         delete result;
         return nullptr;
     }
     return result;
 }
 
-bool PRUScanLineSender::Init() {
+bool PRUScanLineSender::Init(const MachineProfile &profile) {
     if (status_ == STATUS_RUNNING) {
         fprintf(stderr, "Already running. Init() has no effect\n");
         return false;
     }
 
-    if (!pru_.Init()) {
+    if (!pru_->Init()) {
         return false;
     }
 
-    if (!pru_.AllocateSharedMem((void**) &pru_data_, sizeof(*pru_data_))) {
+    // The feeder sleeps in epoll until the PRU signals the low-water mark or
+    // a deadline passes. Without the event fd, the PRU interface polls.
+    const int event_fd = pru_->EventFd();
+    if (event_fd >= 0) {
+        epoll_fd_ = epoll_create(1);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = event_fd;
+        if (epoll_fd_ >= 0
+            && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd, &ev) < 0) {
+            close(epoll_fd_);
+            epoll_fd_ = -1;
+        }
+        if (epoll_fd_ < 0) {
+            fprintf(stderr, "Can't watch PRU interrupt (%s); polling.\n",
+                    strerror(errno));
+        }
+    }
+
+    if (!pru_->AllocateSharedMem((void**) &pru_data_, sizeof(*pru_data_))) {
         fprintf(stderr, "Cannot allocate shared memory\n");
         return false;
     }
     pru_data_->error_status = ERROR_NONE;
-    for (int i = 0; i < QUEUE_LEN; ++i) {
-        pru_data_->ring_buffer[i].state = CMD_EMPTY;
-    }
-    status_ = pru_.StartExecution() ? STATUS_RUNNING : STATUS_NOT_RUNNING;
+    pru_data_->halted = 0;
+    pru_data_->tick_delay = profile.tick_delay;
+    pru_data_->ticks_per_mirror_segment = profile.ticks_per_mirror_segment;
+    pru_data_->jitter_allow = profile.jitter_allow();
+    pru_data_->stable_facets = profile.spinup_stable_facets;
+
+    // Items are sized for a full line; as many as fit into memory.
+    line_bytes_ = profile.scanline_bytes();
+    item_size_ = SCANLINE_HEADER_SIZE + ((line_bytes_ + 3) & ~3);
+    queue_len_ = sizeof(pru_data_->ring_buffer) / item_size_;
+    pru_data_->item_size = item_size_;
+    pru_data_->ringbuffer_end = START_RINGBUFFER + queue_len_ * item_size_;
+    pru_data_->producer_index = 0;
+    pru_data_->consumer_index = 0;
+    write_index_ = 0;
+    published_index_ = 0;
+
+    // We are woken up to refill once a third of the ring buffer is left,
+    // which has to be enough to cover our wakeup latency.
+    low_water_ = std::max(1, queue_len_ / 3);
+    pru_data_->low_water = low_water_;
+
+    // Small enough that the PRU never gets to the low-water mark only
+    // because it doesn't know about lines that are already there.
+    publish_batch_ = std::max(1, low_water_ / 4);
+
+    // A missed event should not let the ring buffer run empty, so look at it
+    // a bit after we expect the event. The longest time the PRU is busy
+    // without consuming an item is spin-up and synchronization.
+    const float line_ms = 1000.0 / profile.line_frequency();
+    event_timeout_ms_ = std::max(1, (int)(low_water_ * line_ms / 2));
+    stall_timeout_ms_ = std::max(1000, (int)(
+        2000.0 * (SPINUP_TICKS + MAX_WAIT_STABLE_TIME)
+        / profile.pixel_frequency()));
+    status_ = pru_->StartExecution() ? STATUS_RUNNING : STATUS_NOT_RUNNING;
+    return status_ == STATUS_RUNNING;
+}
+
+bool PRUScanLineSender::StartSpinup() {
+    if (status_ != STATUS_RUNNING) return false;
+    if (!WaitForFreeItem()) return false;
+    item(write_index_)->state = CMD_SPINUP;
+    write_index_++;
+    Publish();
+    // PRU acknowledges by consuming the item.
+    WaitUntil(write_index_, false);
     return status_ == STATUS_RUNNING;
 }
 
-bool PRUScanLineSender::EnqueueNextData(const uint8_t *data, size_t size,
-                                        bool sled_on) {
+volatile uint8_t *PRUScanLineSender::AcquireSlot() {
+    if (status_ != STATUS_RUNNING || !WaitForFreeItem()) return nullptr;
+    return (volatile uint8_t*) (item(write_index_) + 1);
+}
+
+bool PRUScanLineSender::Commit(bool sled_on, int data_start, int data_end) {
     if (status_ != STATUS_RUNNING) return false;
-    assert(size == SCANLINE_DATA_SIZE);  // We only accept full lines :)
-    WaitUntil(queue_pos_, CMD_EMPTY);
-    unaligned_memcpy(pru_data_->ring_buffer[queue_pos_].data, data, size);
+    assert(0 <= data_start && data_start <= data_end
+           && data_end <= line_bytes_);
+    assert(write_index_ - pru_data_->consumer_index < (uint32_t)queue_len_);
+    volatile ItemHeader *const header = item(write_index_);
+    header->data_start = data_start;
+    header->data_length = data_end - data_start;
     // TODO: maybe later transmit a byte telling how many steps the sled-stepper
     // should do. Including zero.
-    pru_data_->ring_buffer[queue_pos_].state =
-        sled_on ? CMD_SCAN_DATA : CMD_SCAN_DATA_NO_SLED;
+    header->state = sled_on ? CMD_SCAN_DATA : CMD_SCAN_DATA_NO_SLED;
+    write_index_++;
 
-    queue_pos_++;
-    queue_pos_ %= QUEUE_LEN;
+    // Items are handed over in batches. Earlier if the ring buffer is full,
+    // or if the PRU gets close to the low-water mark with what it knows of.
+    // Before waiting for the PRU, everything is published in WaitUntil().
+    const uint32_t consumed = pru_data_->consumer_index;
+    const int fill = write_index_ - consumed;
+    if ((int)(write_index_ - published_index_) >= publish_batch_
+        || fill == queue_len_
+        || (int)(published_index_ - consumed) <= low_water_) {
+        Publish();
+    }
+    Metrics::instance()->CountScanline();
+    Metrics::instance()->SetRingbufferFill(fill, queue_len_);
     return status_ == STATUS_RUNNING;
 }
 
 bool PRUScanLineSender::Shutdown() {
     if (status_ != STATUS_RUNNING) return false;
-    WaitUntil(queue_pos_, CMD_EMPTY);
-    pru_data_->ring_buffer[queue_pos_].state = CMD_EXIT;
-    // PRU will set it to empty again when actually halted.
-    WaitUntil(queue_pos_, CMD_DONE);
-    pru_.Shutdown();
+    if (WaitForFreeItem()) {
+        item(write_index_)->state = CMD_EXIT;
+        write_index_++;
+        Publish();
+        WaitUntil(write_index_, true);
+    }
+    const bool success = (status_ == STATUS_RUNNING
+                          && pru_data_->error_status == ERROR_NONE);
+    final_max_state_cycles_ = GetMaxStateCycles();
+    pru_->Shutdown();
+    pru_data_ = nullptr;
     status_ = STATUS_NOT_RUNNING;
     fprintf(stderr, "Finished scanning.\n");
+    return success;
+}
+
+std::vector<int> PRUScanLineSender::GetMaxStateCycles() {
+    if (pru_data_ == nullptr) return final_max_state_cycles_;
+    std::vector<int> result;
+    for (int i = 0; i < NUM_STATE_IDS; ++i)
+        result.push_back(pru_data_->max_state_cycles[i]);
+    return result;
+}
+
+volatile PRUScanLineSender::ItemHeader *PRUScanLineSender::item(
+    uint32_t index) {
+    return (volatile ItemHeader *) (pru_data_->ring_buffer
+                                    + (index % queue_len_) * item_size_);
+}
+
+void PRUScanLineSender::Publish() {
+    // Items have to be in memory before the PRU sees the index moving.
+    __sync_synchronize();
+    pru_data_->producer_index = write_index_;
+    published_index_ = write_index_;
+}
+
+bool PRUScanLineSender::WaitForFreeItem() {
+    if (write_index_ - pru_data_->consumer_index < (uint32_t)queue_len_)
+        return status_ == STATUS_RUNNING;
+    // Full. The PRU interrupts us once it is down to the low-water mark;
+    // then we have room to fill a whole batch.
+    WaitUntil(write_index_ - low_water_, false);
+    return status_ == STATUS_RUNNING;
+}
+
+bool PRUScanLineSender::WaitForEvent(int timeout_ms) {
+    if (epoll_fd_ < 0) return pru_->WaitEventFor(timeout_ms);
+    struct epoll_event ev;
+    if (epoll_wait(epoll_fd_, &ev, 1, timeout_ms) <= 0)
+        return false;  // Timeout or interrupted.
+    pru_->ClearEvent();
     return true;
 }
 
-void PRUScanLineSender::WaitUntil(int pos, int state) {
+void PRUScanLineSender::WaitUntil(uint32_t index, bool until_halted) {
+    Publish();  // The PRU can only get there if it knows about everything.
+    uint32_t last_consumed = pru_data_->consumer_index;
+    int64_t last_progress = Metrics::NowMicros();
     for (;;) {
-        const int buffer_state = pru_data_->ring_buffer[pos].state;
-        if (buffer_state == state)
+        if (pru_data_->halted) {
+            status_ = (enum Status) pru_data_->error_status;
+            if (status_ != STATUS_RUNNING)
+                Metrics::instance()->CountError(status_);
+            return;
+        }
+        const uint32_t consumed = pru_data_->consumer_index;
+        if (!until_halted && (int32_t)(consumed - index) >= 0)
             return;
 
-        if (buffer_state == CMD_DONE) {  // Error cond. Should be separate state
-            status_ = (enum Status) pru_data_->error_status;
+        // Look at the memory at the latest when it is time to check for a
+        // stall, otherwise after the time we expect the event in.
+        const int64_t stall_deadline
+            = last_progress + 1000LL * stall_timeout_ms_;
+        const int64_t until_stall_ms
+            = (stall_deadline - Metrics::NowMicros() + 999) / 1000;
+        const int timeout_ms = std::max<int64_t>(
+            1, std::min<int64_t>(event_timeout_ms_, until_stall_ms));
+        if (WaitForEvent(timeout_ms)) {
+            Metrics::instance()->CountWakeup();
+            last_consumed = pru_data_->consumer_index;
+            last_progress = Metrics::NowMicros();
+            continue;
+        }
+
+        // No event. The PRU only interrupts at the low-water mark, so it
+        // moving on is expected; but if it got where we wait for, we missed
+        // the event. If it doesn't move at all, it might be hanging.
+        const int64_t now = Metrics::NowMicros();
+        const uint32_t now_consumed = pru_data_->consumer_index;
+        if (pru_data_->halted
+            || (!until_halted && (int32_t)(now_consumed - index) >= 0)) {
+            Metrics::instance()->CountMissedWakeup();
+        }
+        if (now_consumed != last_consumed) {
+            last_consumed = now_consumed;
+            last_progress = now;
+        } else if (now - last_progress > 1000LL * stall_timeout_ms_) {
+            fprintf(stderr, "No progress of the PRU for %dms.\n",
+                    stall_timeout_ms_);
+            status_ = STATUS_ERR_TIMEOUT;
+            Metrics::instance()->CountError(status_);
             return;
         }
-        pru_.WaitEvent();
     }
 }
 
-DummyScanLineSender::DummyScanLineSender() : lines_enqueued_(0) {
+DummyScanLineSender::DummyScanLineSender(const MachineProfile &profile)
+    : line_usec_(1e6 / profile.line_frequency()), lines_enqueued_(0),
+      line_(profile.scanline_bytes()) {
     fprintf(stderr, "Dry-run, including rough timing simulation.\n");
 }
 
-bool DummyScanLineSender::EnqueueNextData(const uint8_t *, size_t, bool) {
+bool DummyScanLineSender::Commit(bool, int, int) {
     lines_enqueued_++;
-    usleep(1000000 / 244);  // rough simulation of scan; see line_frequency
+    Metrics::instance()->CountScanline();
+    usleep(line_usec_);  // rough simulation of scan
     return true;
 }
 bool DummyScanLineSender::Shutdown() {
@@ -19,13 +19,15 @@
 #ifndef LDGRAPHY_SCANLINESENDER_H
 #define LDGRAPHY_SCANLINESENDER_H
 
+#include "compiler-compat.h"
 #include "uio-pruss-interface.h"
+#include "machine-profile.h"
+#include "serial-protocol.h"
 #include <stdint.h>
 
-#if __GNUC__ == 4 && __GNUC_MINOR__ < 7
-// Default ompiler on beaglebone black does not understand this one yet.
-#  define override
-#endif
+#include <memory>
+#include <string>
+#include <vector>
 
 class ScanLineSender {
 public:
@@ -35,27 +37,81 @@ public:
         STATUS_DEBUG_BREAK      = 1,
         STATUS_ERR_MIRROR_SYNC  = 2,
         STATUS_ERR_TIME_OVERRUN = 3,
+        STATUS_ERR_TIMEOUT      = 4,  // Host side: backend stopped responding
+        STATUS_ERR_PROTOCOL     = 5,  // Garbled or lost data to the backend
     };
     static const char *StatusToString(Status s);
 
+    // Name of the realtime state machine state with given STATE_ID_*.
+    static const char *StateIdToString(int state_id);
+
     virtual ~ScanLineSender() {}
 
+    // Start spinning up the mirror and synchronizing before the first data is
+    // sent, so that exposure can start right away once it is. Until the first
+    // data is enqueued, the sled is left alone, so it can still be moved by
+    // the host. Optional; otherwise, the first data triggers the spin-up.
+    virtual bool StartSpinup() { return true; }
+
     // Enqueue next scanline. Blocks until there is space in the ring buffer.
+    // "size" is at most the scanline bytes of the machine profile; the
+    // remaining dots of the line are off.
+    // If "sled_on" == true, then advances the sled after this line.
+    // Returns 'true' on success.
+    // Copies the line; see AcquireSlot() to avoid that.
+    bool EnqueueNextData(const uint8_t *data, size_t size, bool sled_on);
+
+    // Like EnqueueNextData(), but only the bytes in ["data_start",
+    // "data_end") of "data" are used; the dots outside are off.
+    bool EnqueueWindow(const uint8_t *data, int data_start, int data_end,
+                       bool sled_on);
+
+    // Find the part of the "size" bytes of "data" that has dots set, to be
+    // used as window in Commit(). Reads each byte at most once, so it can
+    // be used on a slot in PRU memory.
+    static void FindDataWindow(const volatile uint8_t *data, int size,
+                               int *data_start, int *data_end);
+
+    // Get the buffer for the next scanline, to be filled by the caller and
+    // sent with Commit(). For the PRU, this is the item in the ring buffer
+    // itself, so lines can be created right where they are needed. The
+    // buffer has room for the scanline bytes of the machine profile and is
+    // word aligned; it is not cleared. Blocks until there is space in the
+    // ring buffer. Returns nullptr on error.
+    // The slot can be device memory, so only write it with CopyToSlot() or
+    // FillSlot(), never with memcpy() and friends.
+    virtual volatile uint8_t *AcquireSlot() = 0;
+
+    // Copy the bytes in ["start", "end") of "data" to the same place in
+    // "slot" with plain word stores.
+    static void CopyToSlot(volatile uint8_t *slot, const uint8_t *data,
+                           int start, int end);
+
+    // Set the bytes in ["start", "end") of "slot" to "value".
+    static void FillSlot(volatile uint8_t *slot, uint8_t value,
+                         int start, int end);
+
+    // Send the line in the last acquired slot. Only the bytes in
+    // ["data_start", "data_end") are used, the dots outside are off.
     // If "sled_on" == true, then advances the sled after this line.
     // Returns 'true' on success.
-    virtual bool EnqueueNextData(const uint8_t *data, size_t size,
-                                 bool sled_on) = 0;
+    virtual bool Commit(bool sled_on, int data_start, int data_end) = 0;
 
-    // Shutdown the system.
+    // Shutdown the system. Returns false if there was an error.
     virtual bool Shutdown() = 0;
 
+    // Maximum CPU cycles used in a tick by each state of the realtime state
+    // machine, indexed by STATE_ID_*. Available while running and after
+    // Shutdown(). Empty if the backend can't measure that.
+    virtual std::vector<int> GetMaxStateCycles() { return {}; }
+
     // Get current status.
     virtual Status status() = 0;
 };
 
 /* Here follow the implementations of the ScanlineSender. Below is one for
- * PRU and a dummy implementation. This should be followed by Cortex M4 based
- * or other microcontrollers.
+ * PRU, one for microcontrollers (e.g. Cortex M4) connected via a serial line
+ * and a dummy implementation.
  */
 
 // Lower-level interface with the hardware: send scan lines to the ring-buffer
@@ -64,39 +120,121 @@ class PRUScanLineSender : public ScanLineSender {
 public:
     virtual ~PRUScanLineSender();
 
-    // Create and initialize hardware (which might fail). Return non-null
+    // Create and initialize hardware (which might fail) with the timing
+    // parameters of the given machine profile. Return non-null
     // object if successful.
-    static ScanLineSender *Create();
+    // Optionally, an alternative PruInterface can be given, e.g. an
+    // emulation. Takes ownership of it.
+    static ScanLineSender *Create(const MachineProfile &profile,
+                                  PruInterface *pru = nullptr);
 
     // -- ScanLineSender interface
-    bool EnqueueNextData(const uint8_t *data, size_t size, bool sled_on) override;
+    bool StartSpinup() override;
+    volatile uint8_t *AcquireSlot() override;
+    bool Commit(bool sled_on, int data_start, int data_end) override;
     bool Shutdown() override;
+    std::vector<int> GetMaxStateCycles() override;
 
     Status status() override { return status_; }
 private:
     struct PRUCommunication;
+    struct ItemHeader;
+
+    PRUScanLineSender(PruInterface *pru);
+    bool Init(const MachineProfile &profile);
 
-    PRUScanLineSender();
-    bool Init();
+    volatile ItemHeader *item(uint32_t index);
 
-    void WaitUntil(int pos, int state);
+    // Hand all items written so far over to the PRU.
+    void Publish();
+
+    // Make sure the item at write_index_ is free. Returns false on error.
+    bool WaitForFreeItem();
+
+    // Wait at most "timeout_ms" for the next event of the PRU. Returns false
+    // on timeout.
+    bool WaitForEvent(int timeout_ms);
+
+    // Publish, then wait until the PRU consumed all items before "index", or
+    // until it halted. Sets status_ on error or if the PRU does not make progress for
+    // stall_timeout_ms_.
+    void WaitUntil(uint32_t index, bool until_halted);
 
     volatile PRUCommunication *pru_data_;
     Status status_;
-    int queue_pos_;
-    UioPrussInterface pru_;
+    int epoll_fd_;          // Watching the PRU event; -1 if we poll.
+    int event_timeout_ms_;  // Look at memory if no event for this long.
+    int stall_timeout_ms_;
+    uint32_t write_index_;  // Free running; published as producer index.
+    uint32_t published_index_;  // Last write_index_ the PRU was told about.
+    int queue_len_;     // Items in the ring buffer.
+    int low_water_;     // PRU interrupts once down to this many items.
+    int publish_batch_; // Publish at least after this many items.
+    int item_size_;     // Bytes per item, including header.
+    int line_bytes_;
+    std::vector<int> final_max_state_cycles_;  // Snapshot after Shutdown()
+    std::unique_ptr<PruInterface> pru_;
+};
+
+// Stream scanlines to a microcontroller on a serial line or USB CDC, using
+// the protocol in serial-protocol.h. The device buffers a window of commands,
+// which we keep full.
+class SerialScanLineSender : public ScanLineSender {
+public:
+    virtual ~SerialScanLineSender();
+
+    // Open "device" and send it the timing parameters of the given machine
+    // profile. The "baud" rate is only set if non-zero; USB CDC ignores it.
+    // Returns nullptr and prints a message if the device doesn't answer.
+    static ScanLineSender *Create(const MachineProfile &profile,
+                                  const char *device, int baud);
+
+    // -- ScanLineSender interface
+    bool StartSpinup() override;
+    volatile uint8_t *AcquireSlot() override;
+    bool Commit(bool sled_on, int data_start, int data_end) override;
+    bool Shutdown() override;
+
+    Status status() override { return status_; }
+private:
+    SerialScanLineSender(int fd);
+    bool Init(const MachineProfile &profile);
+
+    // Send command of given type; "payload" follows the sequence number.
+    bool SendCommand(uint8_t type, const std::string &payload);
+
+    // Handle acknowledgements received, waiting for more until at most
+    // "max_pending" commands are unacknowledged. Sets status_ on error.
+    bool WaitPending(int max_pending);
+
+    const int fd_;
+    SerialFrameReader reader_;
+    Status status_;
+    int line_bytes_;
+    int window_;            // Commands the device can buffer.
+    int stall_timeout_ms_;  // Longest time the device might not answer.
+    uint8_t next_seq_;
+    uint8_t last_acked_seq_;
+    int pending_;           // Commands sent but not acknowledged.
+    int lines_;
+    int64_t wire_bytes_;
+    std::vector<uint8_t> line_;  // Slot handed out by AcquireSlot().
 };
 
 class DummyScanLineSender : public ScanLineSender {
 public:
-    DummyScanLineSender();
+    // Simulates the line frequency of the given machine.
+    DummyScanLineSender(const MachineProfile &profile);
 
-    bool EnqueueNextData(const uint8_t *data, size_t size, bool sled_on) override;
+    volatile uint8_t *AcquireSlot() override { return line_.data(); }
+    bool Commit(bool sled_on, int data_start, int data_end) override;
     bool Shutdown() override;
 
     Status status() override { return STATUS_RUNNING; }
 private:
+    const int line_usec_;
     int lines_enqueued_;
+    std::vector<uint8_t> line_;
 };
 
 #endif  // LDGRAPHY_SCANLINESENDER_H
@@ -0,0 +1,214 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scanline-source.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "image-processing.h"
+#include "metrics.h"
+#include "scanline-sender.h"
+
+// Rows gathered at once. Multiple of 8, as the gathering works in 8x8 blocks.
+static constexpr int kGatherBandRows = 64;
+
+ImageScanlineSource::ImageScanlineSource(
+    BitmapImage *img,
+    const ImageTransform &placement,
+    const std::vector<int> &column_source_row,
+    const std::vector<int> &column_x_offset,
+    int scanlines,
+    const EllipticalKernel &thinning)
+    : image_(img), placement_(placement),
+      column_source_row_(column_source_row), column_x_offset_(column_x_offset),
+      bytes_((column_source_row.size() + 7) / 8), scanlines_(scanlines),
+      thinning_(thinning), band_(kGatherBandRows * bytes_) {
+    Rewind();
+}
+
+ImageScanlineSource::~ImageScanlineSource() {}
+
+void ImageScanlineSource::Rewind() {
+    band_first_ = band_count_ = band_pos_ = 0;
+    produced_ = 0;
+    if (thinning_.empty())
+        filter_.reset();
+    else
+        filter_.reset(new MorphologyFilter(MorphologyFilter::THIN, thinning_,
+                                           bytes_ * 8, scanlines_));
+}
+
+const uint8_t *ImageScanlineSource::NextGatheredRow() {
+    if (band_pos_ == band_count_) {
+        band_first_ += band_count_;
+        band_count_ = std::min(kGatherBandRows, scanlines_ - band_first_);
+        GatherRotatedRows(*image_, placement_, column_source_row_,
+                          column_x_offset_, band_first_, band_count_,
+                          band_.data(), bytes_);
+        band_pos_ = 0;
+    }
+    return &band_[band_pos_++ * bytes_];
+}
+
+bool ImageScanlineSource::ReadNext(uint8_t *out) {
+    if (produced_ >= scanlines_) return false;
+    if (filter_) {
+        // The filter needs a few rows of context before it can emit a row.
+        while (!filter_->PopRow(out))
+            filter_->PushRow(NextGatheredRow());
+    } else {
+        memcpy(out, NextGatheredRow(), bytes_);
+    }
+    ++produced_;
+    return true;
+}
+
+PatternScanlineSource::PatternScanlineSource(
+    TestPattern *pattern,
+    const std::vector<int> &column_source_row,
+    const std::vector<int> &column_x_offset,
+    int scanlines)
+    : pattern_(pattern), column_source_row_(column_source_row),
+      column_x_offset_(column_x_offset),
+      bytes_((column_source_row.size() + 7) / 8), scanlines_(scanlines),
+      column_((pattern->height() + 7) / 8), produced_(0) {
+}
+
+PatternScanlineSource::~PatternScanlineSource() {}
+
+bool PatternScanlineSource::ReadNext(uint8_t *out) {
+    if (produced_ >= scanlines_) return false;
+    memset(out, 0, bytes_);
+    // The x offset only changes in a few places along the scanline, so we
+    // only render again when it does.
+    int rendered_x = -1;
+    for (size_t c = 0; c < column_source_row_.size(); ++c) {
+        const int y = column_source_row_[c];
+        if (y < 0) continue;
+        const int x = produced_ + column_x_offset_[c];
+        if (x != rendered_x) {
+            std::fill(column_.begin(), column_.end(), 0);
+            pattern_->RenderColumn(x, column_.data());
+            rendered_x = x;
+        }
+        if (column_[y / 8] & (0x80 >> (y % 8)))
+            out[c / 8] |= 0x80 >> (c % 8);
+    }
+    ++produced_;
+    return true;
+}
+
+ReadAheadScanlineSource::ReadAheadScanlineSource(ScanlineSource *delegate,
+                                                 int max_lines_ahead)
+    : delegate_(delegate), bytes_(delegate->scanline_bytes()),
+      capacity_(max_lines_ahead),
+      refill_(std::min(kGatherBandRows, max_lines_ahead)),
+      ring_(capacity_ * bytes_) {
+    Start();
+}
+
+ReadAheadScanlineSource::~ReadAheadScanlineSource() {
+    Stop();
+}
+
+void ReadAheadScanlineSource::Start() {
+    produced_ = consumed_ = 0;
+    producer_done_ = stop_ = false;
+    thread_ = std::thread(&ReadAheadScanlineSource::Run, this);
+}
+
+void ReadAheadScanlineSource::Stop() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+void ReadAheadScanlineSource::Rewind() {
+    Stop();
+    delegate_->Rewind();
+    Start();
+}
+
+void ReadAheadScanlineSource::Run() {
+    for (;;) {
+        int band;
+        {
+            std::unique_lock<std::mutex> l(mutex_);
+            cond_.wait(l, [this]() {
+                    return stop_
+                        || capacity_ - (produced_ - consumed_) >= refill_;
+                });
+            if (stop_) return;
+            band = capacity_ - (produced_ - consumed_);
+        }
+        ScopedStageTimer timer(Metrics::STAGE_SCANLINES);
+        for (int i = 0; i < band; ++i) {
+            // The slot is not visible to the reader until we publish it.
+            uint8_t *const slot = &ring_[(produced_ % capacity_) * bytes_];
+            const bool more = delegate_->ReadNext(slot);
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                if (more)
+                    ++produced_;
+                else
+                    producer_done_ = true;
+                if (stop_) return;
+            }
+            cond_.notify_all();
+            if (!more) return;
+        }
+    }
+}
+
+const uint8_t *ReadAheadScanlineSource::WaitForLine() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cond_.wait(l, [this]() { return produced_ > consumed_ || producer_done_; });
+    if (produced_ == consumed_) return nullptr;  // Producer is done.
+    return &ring_[(consumed_ % capacity_) * bytes_];
+}
+
+void ReadAheadScanlineSource::ReleaseLine() {
+    std::unique_lock<std::mutex> l(mutex_);
+    ++consumed_;
+    // The producer only needs to know once there is room for a band.
+    const bool refill = (capacity_ - (produced_ - consumed_) == refill_);
+    l.unlock();
+    if (refill) cond_.notify_all();
+}
+
+bool ReadAheadScanlineSource::ReadNext(uint8_t *out) {
+    const uint8_t *const line = WaitForLine();
+    if (!line) return false;
+    memcpy(out, line, bytes_);
+    ReleaseLine();
+    return true;
+}
+
+bool ReadAheadScanlineSource::ReadNextToSlot(volatile uint8_t *slot) {
+    const uint8_t *const line = WaitForLine();
+    if (!line) return false;
+    ScanLineSender::CopyToSlot(slot, line, 0, bytes_);
+    ReleaseLine();
+    return true;
+}
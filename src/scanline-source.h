@@ -0,0 +1,165 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_SCANLINE_SOURCE_H
+#define LDGRAPHY_SCANLINE_SOURCE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "compiler-compat.h"
+#include "image-processing.h"
+#include "morphology.h"
+#include "test-pattern.h"
+
+// A source of scanlines, produced on demand in sequence.
+class ScanlineSource {
+public:
+    virtual ~ScanlineSource() {}
+
+    // Number of bytes in each scanline.
+    virtual int scanline_bytes() const = 0;
+
+    // Total number of scanlines this source produces.
+    virtual int scanlines() const = 0;
+
+    // Write the next scanline to "out", which has space for scanline_bytes().
+    // Returns false if all scanlines have been produced already.
+    virtual bool ReadNext(uint8_t *out) = 0;
+
+    // Start over with the first scanline.
+    virtual void Rewind() = 0;
+};
+
+// Scanlines created from an image: each scanline is gathered from the image
+// with the column mapping as described in CreateGatheredRotatedImage(), then
+// thinned in a rolling window of a few rows. So at no time a fully
+// preprocessed image needs to exist.
+class ImageScanlineSource : public ScanlineSource {
+public:
+    // Takes ownership of the image, which is read with the given "placement".
+    // "scanlines" is the number of output rows, "thinning" the laser dot to
+    // thin structures with (see ThinImage()).
+    ImageScanlineSource(BitmapImage *img,
+                        const ImageTransform &placement,
+                        const std::vector<int> &column_source_row,
+                        const std::vector<int> &column_x_offset,
+                        int scanlines,
+                        const EllipticalKernel &thinning);
+    ~ImageScanlineSource();
+
+    int scanline_bytes() const override { return bytes_; }
+    int scanlines() const override { return scanlines_; }
+    bool ReadNext(uint8_t *out) override;
+    void Rewind() override;
+
+private:
+    const uint8_t *NextGatheredRow();
+
+    std::unique_ptr<BitmapImage> image_;
+    const ImageTransform placement_;
+    const std::vector<int> column_source_row_;
+    const std::vector<int> column_x_offset_;
+    const int bytes_;
+    const int scanlines_;
+    const EllipticalKernel thinning_;
+
+    std::unique_ptr<MorphologyFilter> filter_;  // nullptr if not thinning.
+    std::vector<uint8_t> band_;      // Gathered, not yet thinned rows.
+    int band_first_, band_count_, band_pos_;
+    int produced_;
+};
+
+// Scanlines rendered from a TestPattern, with the same column mapping as
+// ImageScanlineSource, but without thinning: the pattern shows what the
+// laser does with exact geometry.
+class PatternScanlineSource : public ScanlineSource {
+public:
+    // Takes ownership of the pattern, which needs to have its resolution set.
+    PatternScanlineSource(TestPattern *pattern,
+                          const std::vector<int> &column_source_row,
+                          const std::vector<int> &column_x_offset,
+                          int scanlines);
+    ~PatternScanlineSource();
+
+    int scanline_bytes() const override { return bytes_; }
+    int scanlines() const override { return scanlines_; }
+    bool ReadNext(uint8_t *out) override;
+    void Rewind() override { produced_ = 0; }
+
+private:
+    std::unique_ptr<TestPattern> pattern_;
+    const std::vector<int> column_source_row_;
+    const std::vector<int> column_x_offset_;
+    const int bytes_;
+    const int scanlines_;
+    std::vector<uint8_t> column_;    // Rendered pattern column.
+    int produced_;
+};
+
+// Reads ahead from another ScanlineSource in a background thread, but never
+// more than "max_lines_ahead" lines beyond what has been read by the caller.
+// This decouples the (bursty) production of lines from a consumer that needs
+// them at a steady pace. Lines are refilled in bands once there is room for
+// a few of them; each band is timed as one run of STAGE_SCANLINES.
+class ReadAheadScanlineSource : public ScanlineSource {
+public:
+    // Takes ownership of "delegate". Starts reading right away.
+    ReadAheadScanlineSource(ScanlineSource *delegate, int max_lines_ahead);
+    ~ReadAheadScanlineSource();
+
+    int scanline_bytes() const override { return bytes_; }
+    int scanlines() const override { return delegate_->scanlines(); }
+    bool ReadNext(uint8_t *out) override;
+    void Rewind() override;
+
+    // Like ReadNext(), but writes to a slot acquired from the ScanLineSender,
+    // which might be device memory (see ScanLineSender::AcquireSlot()).
+    bool ReadNextToSlot(volatile uint8_t *slot);
+
+private:
+    void Start();
+    void Stop();
+    void Run();
+
+    // Wait for the next line in the ring; nullptr if there is none anymore.
+    // Needs to be followed by a ReleaseLine() once the line is copied.
+    const uint8_t *WaitForLine();
+    void ReleaseLine();
+
+    std::unique_ptr<ScanlineSource> delegate_;
+    const int bytes_;
+    const int capacity_;
+    const int refill_;    // Free lines needed before we start producing.
+    std::vector<uint8_t> ring_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    int produced_;        // Lines written into ring; only modified by thread.
+    int consumed_;        // Lines read from ring; only modified by reader.
+    bool producer_done_;
+    bool stop_;
+};
+
+#endif  // LDGRAPHY_SCANLINE_SOURCE_H
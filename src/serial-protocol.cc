@@ -0,0 +1,207 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "serial-protocol.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t NowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// CRC-8 with polynomial x^8 + x^2 + x + 1; simple enough for any
+// microcontroller.
+static uint8_t Crc8(const char *data, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= (uint8_t)data[i];
+        for (int b = 0; b < 8; ++b)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+// Consistent Overhead Byte Stuffing: removes all zero bytes, at the cost of
+// one byte per 254.
+static void CobsEncode(const std::string &data, std::string *out) {
+    size_t code_pos = out->size();
+    out->push_back(0);
+    uint8_t code = 1;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (data[i] != 0) {
+            out->push_back(data[i]);
+            ++code;
+        }
+        if (data[i] == 0 || code == 0xff) {
+            (*out)[code_pos] = code;
+            code_pos = out->size();
+            out->push_back(0);
+            code = 1;
+        }
+    }
+    (*out)[code_pos] = code;
+}
+
+static bool CobsDecode(const char *in, size_t len, std::string *out) {
+    size_t i = 0;
+    while (i < len) {
+        const uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > len) return false;
+        out->append(in + i, code - 1);
+        i += code - 1;
+        if (code < 0xff && i < len) out->push_back(0);
+    }
+    return true;
+}
+
+void EncodeFrame(uint8_t type, const std::string &payload, std::string *out) {
+    std::string frame;
+    frame.push_back(type);
+    frame.append(payload);
+    frame.push_back(Crc8(frame.data(), frame.size()));
+    CobsEncode(frame, out);
+    out->push_back(0);
+}
+
+void AppendUInt16(uint16_t value, std::string *out) {
+    out->push_back(value & 0xff);
+    out->push_back(value >> 8);
+}
+
+void AppendUInt32(uint32_t value, std::string *out) {
+    AppendUInt16(value & 0xffff, out);
+    AppendUInt16(value >> 16, out);
+}
+
+uint16_t ReadUInt16(const char *in) {
+    return (uint8_t)in[0] | (uint8_t)in[1] << 8;
+}
+
+uint32_t ReadUInt32(const char *in) {
+    return ReadUInt16(in) | (uint32_t)ReadUInt16(in + 2) << 16;
+}
+
+// Header byte n: 0..127 - the next n+1 bytes are literal; 129..255 - the
+// next byte is repeated 257-n times.
+void PackBits(const uint8_t *data, size_t len, std::string *out) {
+    size_t i = 0;
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < 128 && data[i + run] == data[i])
+            ++run;
+        if (run >= 3) {
+            out->push_back(257 - run);
+            out->push_back(data[i]);
+            i += run;
+            continue;
+        }
+        // Literal up to the start of the next run worth encoding.
+        size_t literal = 0;
+        while (i + literal < len && literal < 128) {
+            const uint8_t *p = data + i + literal;
+            if (i + literal + 2 < len && p[0] == p[1] && p[0] == p[2])
+                break;
+            ++literal;
+        }
+        out->push_back(literal - 1);
+        out->append((const char*)data + i, literal);
+        i += literal;
+    }
+}
+
+int UnpackBits(const char *data, size_t len, uint8_t *out, size_t max_len) {
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < len) {
+        const uint8_t n = data[i++];
+        if (n < 128) {
+            const size_t literal = n + 1;
+            if (i + literal > len || pos + literal > max_len) return -1;
+            memcpy(out + pos, data + i, literal);
+            i += literal;
+            pos += literal;
+        } else if (n > 128) {
+            const size_t run = 257 - n;
+            if (i >= len || pos + run > max_len) return -1;
+            memset(out + pos, data[i++], run);
+            pos += run;
+        }
+        // 128 is a no-op.
+    }
+    return pos;
+}
+
+bool SerialFrameReader::ExtractFrame(std::string *frame) {
+    for (;;) {
+        const size_t end = buffer_.find('\0');
+        if (end == std::string::npos) return false;
+        std::string decoded;
+        const bool valid = (end > 0
+                            && CobsDecode(buffer_.data(), end, &decoded)
+                            && decoded.size() >= 2
+                            && Crc8(decoded.data(), decoded.size() - 1)
+                            == (uint8_t)decoded[decoded.size() - 1]);
+        buffer_.erase(0, end + 1);
+        if (valid) {
+            frame->assign(decoded, 0, decoded.size() - 1);
+            return true;
+        }
+        if (end > 0) bad_frames_++;   // Empty ones are just resync.
+    }
+}
+
+bool SerialFrameReader::Read(int timeout_ms, std::string *frame) {
+    const int64_t deadline = NowMillis() + timeout_ms;
+    for (;;) {
+        if (ExtractFrame(frame))
+            return true;
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            wait_ms = deadline - NowMillis();
+            if (wait_ms < 0) wait_ms = 0;
+        }
+        struct pollfd pfd = { fd_, POLLIN, 0 };
+        const int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return false;
+        char buf[4096];
+        const ssize_t r = read(fd_, buf, sizeof(buf));
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (r <= 0) return false;
+        buffer_.append(buf, r);
+    }
+}
+
+bool WriteAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t w = write(fd, data.data() + written,
+                                data.size() - written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        written += w;
+    }
+    return true;
+}
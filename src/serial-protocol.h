@@ -0,0 +1,108 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_SERIAL_PROTOCOL_H
+#define LDGRAPHY_SERIAL_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// Protocol between host and a microcontroller exposing scanlines, over a
+// serial line or USB CDC.
+//
+// Frames are COBS encoded and terminated by a zero byte, so the receiver can
+// always find the start of the next frame. Decoded, a frame is
+//   <type> <payload...> <crc8 of type and payload>
+// Multi-byte values are little endian.
+//
+// Host to device:
+//   HELLO   tick_delay, ticks_per_mirror_segment, jitter_allow,
+//           stable_facets, line_bytes; each uint32. Device answers with INFO
+//           and forgets all previous commands.
+//   SPINUP  seq
+//   LINE    seq, flags (LINE_FLAG_*), data_start (uint16), then the data
+//           window from data_start on, PackBits compressed.
+//   EXIT    seq
+// Device to host:
+//   INFO    window: number of commands the device can buffer (< 128).
+//   ACK     seq, status: the command with that sequence number and all
+//           before are done. Status is a ScanLineSender::Status; not running
+//           means the device stopped.
+//
+// Commands are numbered with a wrapping uint8 sequence number, the first
+// after HELLO being 0. The host may only send commands while fewer than
+// window are unacknowledged. The device acknowledges SPINUP once the mirror
+// is synchronized, a line once it is exposed and EXIT once it is halted.
+enum SerialFrameType {
+    FRAME_HELLO  = 'H',
+    FRAME_SPINUP = 'S',
+    FRAME_LINE   = 'L',
+    FRAME_EXIT   = 'X',
+    FRAME_INFO   = 'I',
+    FRAME_ACK    = 'A',
+};
+
+enum {
+    LINE_FLAG_SLED = 0x01,   // Advance sled after this line.
+};
+
+static constexpr int kSerialHelloValues = 5;
+static constexpr int kSerialMaxWindow = 127;
+
+// Append frame with given type and payload, encoded and terminated, to "out".
+void EncodeFrame(uint8_t type, const std::string &payload, std::string *out);
+
+// Append uint16/uint32 little endian to "out", or read them from "in".
+void AppendUInt16(uint16_t value, std::string *out);
+void AppendUInt32(uint32_t value, std::string *out);
+uint16_t ReadUInt16(const char *in);
+uint32_t ReadUInt32(const char *in);
+
+// PackBits compression: lines are mostly runs of zeros and ones.
+void PackBits(const uint8_t *data, size_t len, std::string *out);
+// Unpack into "out" of "max_len" bytes. Returns unpacked length, or -1 if
+// the data is corrupt or does not fit.
+int UnpackBits(const char *data, size_t len, uint8_t *out, size_t max_len);
+
+// Reads frames from a file descriptor.
+class SerialFrameReader {
+public:
+    explicit SerialFrameReader(int fd) : fd_(fd), bad_frames_(0) {}
+
+    // Read the next valid frame into "frame", starting with the type, without
+    // checksum. Waits at most "timeout_ms"; -1 waits forever. Returns false
+    // on timeout or if the file descriptor is closed. Garbled frames are
+    // skipped.
+    bool Read(int timeout_ms, std::string *frame);
+
+    int bad_frames() const { return bad_frames_; }
+
+private:
+    bool ExtractFrame(std::string *frame);
+
+    const int fd_;
+    std::string buffer_;   // Bytes read, not yet forming a complete frame.
+    int bad_frames_;
+};
+
+// Write all of "data", retrying on short writes. Returns false on error.
+bool WriteAll(int fd, const std::string &data);
+
+#endif  // LDGRAPHY_SERIAL_PROTOCOL_H
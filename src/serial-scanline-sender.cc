@@ -0,0 +1,257 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ScanLineSender for a microcontroller on a serial line or USB CDC.
+
+#include "scanline-sender.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "laser-scribe-constants.h"
+#include "metrics.h"
+
+// Time for the device to answer hello.
+static constexpr int kHelloTimeoutMs = 2000;
+
+static speed_t BaudToSpeed(int baud) {
+    switch (baud) {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 921600:  return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    case 3000000: return B3000000;
+    case 4000000: return B4000000;
+    default: return 0;
+    }
+}
+
+// Raw 8 bit, no flow control or character translation.
+static bool ConfigureSerial(int fd, int baud) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        perror("Not a serial device");
+        return false;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (baud) {
+        const speed_t speed = BaudToSpeed(baud);
+        if (!speed) {
+            fprintf(stderr, "Unsupported baud rate %d\n", baud);
+            return false;
+        }
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+    if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+        perror("Can't configure serial device");
+        return false;
+    }
+    tcflush(fd, TCIOFLUSH);   // Whatever was there before is stale.
+    return true;
+}
+
+SerialScanLineSender::SerialScanLineSender(int fd)
+    : fd_(fd), reader_(fd), status_(STATUS_NOT_RUNNING), line_bytes_(0),
+      window_(0), stall_timeout_ms_(0), next_seq_(0), last_acked_seq_(0xff),
+      pending_(0), lines_(0), wire_bytes_(0) {
+}
+
+SerialScanLineSender::~SerialScanLineSender() {
+    close(fd_);
+}
+
+ScanLineSender *SerialScanLineSender::Create(const MachineProfile &profile,
+                                             const char *device, int baud) {
+    const int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", device, strerror(errno));
+        return nullptr;
+    }
+    if (!ConfigureSerial(fd, baud)) {
+        close(fd);
+        return nullptr;
+    }
+    SerialScanLineSender *result = new SerialScanLineSender(fd);
+    if (!result->Init(profile)) {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
+bool SerialScanLineSender::Init(const MachineProfile &profile) {
+    line_bytes_ = profile.scanline_bytes();
+    line_.resize(line_bytes_);
+    // Same as the PRU: spin-up and synchronization are the longest the
+    // device is busy without finishing a command.
+    stall_timeout_ms_ = std::max(1000, (int)(
+        2000.0 * (SPINUP_TICKS + MAX_WAIT_STABLE_TIME)
+        / profile.pixel_frequency()));
+
+    std::string hello;
+    AppendUInt32(profile.tick_delay, &hello);
+    AppendUInt32(profile.ticks_per_mirror_segment, &hello);
+    AppendUInt32(profile.jitter_allow(), &hello);
+    AppendUInt32(profile.spinup_stable_facets, &hello);
+    AppendUInt32(line_bytes_, &hello);
+    std::string out;
+    EncodeFrame(FRAME_HELLO, hello, &out);
+    if (!WriteAll(fd_, out)) {
+        perror("Writing to serial device");
+        return false;
+    }
+
+    std::string frame;
+    while (reader_.Read(kHelloTimeoutMs, &frame)) {
+        if (frame[0] != FRAME_INFO || frame.size() < 2)
+            continue;   // Left over from before.
+        window_ = std::min((int)(uint8_t)frame[1], kSerialMaxWindow);
+        if (window_ < 1) {
+            fprintf(stderr, "Serial device can't buffer any lines.\n");
+            return false;
+        }
+        status_ = STATUS_RUNNING;
+        return true;
+    }
+    fprintf(stderr, "No answer from serial device.\n");
+    return false;
+}
+
+bool SerialScanLineSender::SendCommand(uint8_t type,
+                                       const std::string &payload) {
+    if (!WaitPending(window_ - 1))
+        return false;
+    std::string command;
+    command.push_back(next_seq_);
+    command.append(payload);
+    std::string out;
+    EncodeFrame(type, command, &out);
+    if (!WriteAll(fd_, out)) {
+        perror("Writing to serial device");
+        status_ = STATUS_ERR_PROTOCOL;
+        Metrics::instance()->CountError(status_);
+        return false;
+    }
+    next_seq_++;
+    pending_++;
+    wire_bytes_ += out.size();
+    return true;
+}
+
+bool SerialScanLineSender::WaitPending(int max_pending) {
+    std::string frame;
+    // Take what is there already; only block if we have to.
+    while (reader_.Read(pending_ > max_pending ? stall_timeout_ms_ : 0,
+                        &frame)) {
+        if (frame[0] != FRAME_ACK || frame.size() < 3)
+            continue;
+        const uint8_t acked = frame[1] - last_acked_seq_;
+        if (acked > pending_) {
+            fprintf(stderr, "Serial device acknowledged unknown command.\n");
+            status_ = STATUS_ERR_PROTOCOL;
+            break;
+        }
+        last_acked_seq_ = frame[1];
+        pending_ -= acked;
+        if ((Status)frame[2] != STATUS_RUNNING) {
+            status_ = (Status)frame[2];
+            break;
+        }
+    }
+    if (status_ == STATUS_RUNNING && pending_ > max_pending) {
+        fprintf(stderr, "No answer from serial device for %dms.\n",
+                stall_timeout_ms_);
+        status_ = STATUS_ERR_TIMEOUT;
+    }
+    if (status_ != STATUS_RUNNING) {
+        Metrics::instance()->CountError(status_);
+        return false;
+    }
+    return true;
+}
+
+bool SerialScanLineSender::StartSpinup() {
+    if (status_ != STATUS_RUNNING) return false;
+    // Like the PRU, only return once the mirror is synchronized.
+    return SendCommand(FRAME_SPINUP, "") && WaitPending(0);
+}
+
+volatile uint8_t *SerialScanLineSender::AcquireSlot() {
+    // Lines are compressed on the way anyway, so nothing to gain by
+    // handing out space in the send buffer.
+    return status_ == STATUS_RUNNING ? line_.data() : nullptr;
+}
+
+bool SerialScanLineSender::Commit(bool sled_on, int data_start, int data_end) {
+    if (status_ != STATUS_RUNNING) return false;
+    assert(0 <= data_start && data_start <= data_end
+           && data_end <= line_bytes_);
+
+    // Only transfer the part of the line that has dots set.
+    const uint8_t *const data = line_.data();
+    int start = data_start, end = data_end;
+    while (start < end && data[start] == 0) ++start;
+    while (end > start && data[end - 1] == 0) --end;
+
+    std::string payload;
+    payload.push_back(sled_on ? LINE_FLAG_SLED : 0);
+    AppendUInt16(start, &payload);
+    PackBits(data + start, end - start, &payload);
+    if (!SendCommand(FRAME_LINE, payload))
+        return false;
+
+    lines_++;
+    Metrics::instance()->CountScanline();
+    Metrics::instance()->SetRingbufferFill(pending_, window_);
+    return true;
+}
+
+bool SerialScanLineSender::Shutdown() {
+    if (status_ != STATUS_RUNNING) return false;
+    // The device acknowledges exit once it halted.
+    const bool success = SendCommand(FRAME_EXIT, "") && WaitPending(0);
+    if (lines_ > 0) {
+        fprintf(stderr, "Serial: %d lines, %lld bytes sent for %lld bytes "
+                "of scanlines (%.1f%%); %d garbled frames received.\n",
+                lines_, (long long)wire_bytes_,
+                (long long)lines_ * line_bytes_,
+                100.0 * wire_bytes_ / ((double)lines_ * line_bytes_),
+                reader_.bad_frames());
+    }
+    status_ = STATUS_NOT_RUNNING;
+    fprintf(stderr, "Finished scanning.\n");
+    return success;
+}
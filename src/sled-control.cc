@@ -23,6 +23,7 @@
 #include <stdio.h>
 
 #include "generic-gpio.h"
+#include "metrics.h"
 
 #define SLED_MOTOR_STEP (GPIO_1_BASE | 16)
 #define SLED_MOTOR_DIR (GPIO_1_BASE | 18)
@@ -44,6 +45,7 @@ SledControl::~SledControl() {
 
 float SledControl::Move(float millimeter) {
     if (!do_move_) return millimeter;
+    ScopedStageTimer timer(Metrics::STAGE_SLED_MOVE);
 
     uint32_t switch_to_watch;
     if (millimeter < 0) {
@@ -0,0 +1,227 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test-pattern.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Line widths of the snakes, as in test-patterns/resolution-snake.ps plus
+// some finer ones.
+static const float kSnakeWidthsMM[] = { 0.2032, 0.1524, 0.1, 0.075, 0.05 };
+
+// Periods of line pairs on the ladder.
+static const float kLadderPeriodsMM[] = {
+    0.4, 0.3, 0.25, 0.2, 0.15, 0.12, 0.1, 0.08, 0.06
+};
+
+// Width and height of the dots in the dot size matrix.
+static const float kDotSizesMM[] = { 0.025, 0.05, 0.075, 0.1, 0.15, 0.2 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+TestPattern *TestPattern::Create(const char *name) {
+    TestPattern *result = new TestPattern();
+    if (strcmp(name, "snake") == 0)
+        result->CreateSnakes();
+    else if (strcmp(name, "ladder") == 0)
+        result->CreateLadders();
+    else if (strcmp(name, "dots") == 0)
+        result->CreateDotMatrix();
+    else if (strcmp(name, "jitter") == 0)
+        result->CreateJitterLines();
+    else {
+        delete result;
+        return nullptr;
+    }
+    return result;
+}
+
+const char *TestPattern::AvailableNames() {
+    return "snake, ladder, dots, jitter";
+}
+
+void TestPattern::AddRect(float x0, float y0, float x1, float y1) {
+    Rect r = { x0, y0, x1, y1 };
+    rects_.push_back(r);
+    width_mm_ = std::max(width_mm_, x1);
+    height_mm_ = std::max(height_mm_, y1);
+}
+
+void TestPattern::AddSnake(float x0, float y0, float x1, float y1,
+                           float w, bool along_x) {
+    // Everything is worked out as if along x, then swapped if needed.
+    if (!along_x) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    auto add = [this, along_x](float ax0, float ay0, float ax1, float ay1) {
+        if (along_x)
+            AddRect(ax0, ay0, ax1, ay1);
+        else
+            AddRect(ay0, ax0, ay1, ax1);
+    };
+    // Lines with a gap as wide as the line, connected alternating at the
+    // end and the beginning.
+    for (int i = 0; y0 + (2 * i + 1) * w <= y1; ++i) {
+        const float y = y0 + 2 * i * w;
+        add(x0, y, x1, y + w);
+        if (y + 3 * w > y1) break;   // Last line.
+        if (i % 2 == 0)
+            add(x1 - w, y, x1, y + 3 * w);
+        else
+            add(x0, y, x0 + w, y + 3 * w);
+    }
+}
+
+void TestPattern::AddLinePairs(float pos, float from, float to, float period,
+                               int count, bool along_x) {
+    for (int i = 0; i < count; ++i) {
+        const float start = pos + i * period;
+        if (along_x)
+            AddRect(from, start, to, start + period / 2);
+        else
+            AddRect(start, from, start + period / 2, to);
+    }
+}
+
+// Snakes of decreasing line width: the upper row with lines along the
+// sled, the lower row along the laser scan.
+void TestPattern::CreateSnakes() {
+    for (size_t i = 0; i < ARRAY_SIZE(kSnakeWidthsMM); ++i) {
+        const float x = i * 12;
+        AddSnake(x, 0, x + 10, 25, kSnakeWidthsMM[i], true);
+        AddSnake(x, 30, x + 10, 55, kSnakeWidthsMM[i], false);
+    }
+}
+
+// Rungs of five line pairs each, with decreasing period. One ladder for
+// each direction, as sled and laser scan resolve differently: lines along
+// the sled going down, lines along the laser scan right of it.
+void TestPattern::CreateLadders() {
+    constexpr float kRungGap = 1.5;
+    constexpr float kLineLength = 10;
+    constexpr float kSecondLadder = kLineLength + 5;
+    float pos = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(kLadderPeriodsMM); ++i) {
+        const float period = kLadderPeriodsMM[i];
+        AddLinePairs(pos, 0, kLineLength, period, 5, true);
+        AddLinePairs(kSecondLadder + pos, 0, kLineLength, period, 5, false);
+        pos += 5 * period + kRungGap;
+    }
+}
+
+// Cells of 4x4 dots; dot width changes along the sled from cell to cell,
+// height along the laser scan.
+void TestPattern::CreateDotMatrix() {
+    constexpr float kDotPitch = 0.6;
+    constexpr float kCellSize = 4 * kDotPitch + 1;
+    for (size_t i = 0; i < ARRAY_SIZE(kDotSizesMM); ++i) {
+        for (size_t j = 0; j < ARRAY_SIZE(kDotSizesMM); ++j) {
+            for (int dx = 0; dx < 4; ++dx) {
+                for (int dy = 0; dy < 4; ++dy) {
+                    const float x = i * kCellSize + dx * kDotPitch;
+                    const float y = j * kCellSize + dy * kDotPitch;
+                    AddRect(x, y, x + kDotSizesMM[i], y + kDotSizesMM[j]);
+                }
+            }
+        }
+    }
+}
+
+// Lines one pixel thin along the sled across the whole scan. Each scanline
+// comes from the next mirror facet, so if the facets project differently,
+// the lines become ragged with the period of the facet count.
+void TestPattern::CreateJitterLines() {
+    for (int y = 0; y <= 60; y += 5) {
+        AddRect(0, y, 40, y);   // Rounded up to one pixel.
+    }
+}
+
+void TestPattern::SetResolution(float mm_per_pixel_x, float mm_per_pixel_y) {
+    width_ = ceil(width_mm_ / mm_per_pixel_x);
+    height_ = ceil(height_mm_ / mm_per_pixel_y);
+
+    struct PixelRect { int x0, y0, x1, y1; };
+    std::vector<PixelRect> pixel_rects;
+    std::vector<int> boundaries;
+    for (const Rect &r : rects_) {
+        PixelRect p;
+        p.x0 = std::min((int)lround(r.x0 / mm_per_pixel_x), width_ - 1);
+        p.y0 = std::min((int)lround(r.y0 / mm_per_pixel_y), height_ - 1);
+        p.x1 = std::min(std::max(p.x0 + 1, (int)lround(r.x1 / mm_per_pixel_x)),
+                        width_);
+        p.y1 = std::min(std::max(p.y0 + 1, (int)lround(r.y1 / mm_per_pixel_y)),
+                        height_);
+        pixel_rects.push_back(p);
+        boundaries.push_back(p.x0);
+        boundaries.push_back(p.x1);
+    }
+    boundaries.push_back(0);
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                     boundaries.end());
+
+    // Between two boundaries, the same rectangles cover each column.
+    strip_start_.clear();
+    strip_spans_.clear();
+    for (int start : boundaries) {
+        std::vector<Span> spans;
+        for (const PixelRect &p : pixel_rects) {
+            if (p.x0 <= start && start < p.x1) {
+                Span s = { p.y0, p.y1 };
+                spans.push_back(s);
+            }
+        }
+        std::sort(spans.begin(), spans.end(),
+                  [](const Span &a, const Span &b) { return a.y0 < b.y0; });
+        std::vector<Span> merged;
+        for (const Span &s : spans) {
+            if (!merged.empty() && s.y0 <= merged.back().y1)
+                merged.back().y1 = std::max(merged.back().y1, s.y1);
+            else
+                merged.push_back(s);
+        }
+        strip_start_.push_back(start);
+        strip_spans_.push_back(merged);
+    }
+}
+
+static void SetBits(uint8_t *bits, int from, int to) {
+    while (from < to && from % 8 != 0) {
+        bits[from / 8] |= 0x80 >> (from % 8);
+        ++from;
+    }
+    const int full_bytes = (to - from) / 8;
+    memset(bits + from / 8, 0xff, full_bytes);
+    for (from += 8 * full_bytes; from < to; ++from)
+        bits[from / 8] |= 0x80 >> (from % 8);
+}
+
+void TestPattern::RenderColumn(int x, uint8_t *bits) const {
+    if (x < 0 || x >= width_ || strip_start_.empty()) return;
+    const int strip = std::upper_bound(strip_start_.begin(),
+                                       strip_start_.end(), x)
+        - strip_start_.begin() - 1;
+    for (const Span &s : strip_spans_[strip])
+        SetBits(bits, s.y0, s.y1);
+}
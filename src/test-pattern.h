@@ -0,0 +1,93 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2017 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of LDGraphy http://github.com/hzeller/ldgraphy
+ *
+ * LDGraphy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LDGraphy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LDGRAPHY_TEST_PATTERN_H
+#define LDGRAPHY_TEST_PATTERN_H
+
+#include <stdint.h>
+
+#include <vector>
+
+// Built-in calibration pattern, made of rectangles. It is rendered column by
+// column at whatever resolution is asked for while exposing, so there is
+// never an image of the whole pattern.
+//
+// Coordinates are those of a placed image: x along the sled, y along the
+// laser scan, origin in the top left corner.
+class TestPattern {
+public:
+    // Create the pattern with the given name, or nullptr if there is none.
+    static TestPattern *Create(const char *name);
+
+    // Names of all patterns, comma separated, for the usage message.
+    static const char *AvailableNames();
+
+    float width_mm() const { return width_mm_; }
+    float height_mm() const { return height_mm_; }
+
+    // Prepare rendering at the given resolution. Rectangles are at least one
+    // pixel wide and high, so nothing vanishes at low resolution.
+    void SetResolution(float mm_per_pixel_x, float mm_per_pixel_y);
+
+    // Size in pixels at the current resolution.
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Set the pixels of column "x" in "bits": pixel y is bit (0x80 >> y % 8)
+    // of byte y / 8, like in a BitmapImage row. The bits have to be cleared
+    // before.
+    void RenderColumn(int x, uint8_t *bits) const;
+
+private:
+    struct Rect {
+        float x0, y0, x1, y1;
+    };
+    struct Span {
+        int y0, y1;
+    };
+
+    TestPattern() : width_mm_(0), height_mm_(0), width_(0), height_(0) {}
+
+    void AddRect(float x0, float y0, float x1, float y1);
+
+    // Line of given width meandering in rectangle from (x0, y0) to (x1, y1).
+    // Its straight parts are along the sled if "along_x", else along the scan.
+    void AddSnake(float x0, float y0, float x1, float y1, float line_width,
+                  bool along_x);
+
+    // "count" line pairs with given period starting at "pos" on the axis
+    // across the lines; lines go from "from" to "to" on the other axis.
+    void AddLinePairs(float pos, float from, float to, float period,
+                      int count, bool along_x);
+
+    void CreateSnakes();
+    void CreateLadders();
+    void CreateDotMatrix();
+    void CreateJitterLines();
+
+    std::vector<Rect> rects_;      // In mm.
+    float width_mm_, height_mm_;
+
+    // Pattern at current resolution: within a strip of columns from
+    // strip_start_[i] to strip_start_[i+1] the same rows are set.
+    int width_, height_;
+    std::vector<int> strip_start_;
+    std::vector<std::vector<Span> > strip_spans_;
+};
+
+#endif  // LDGRAPHY_TEST_PATTERN_H
@@ -26,9 +26,13 @@
 #include <errno.h>
 #include <pruss_intc_mapping.h>
 #include <prussdrv.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <strings.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 // Generated PRU code from laser-scribe-pru.p
 #include "laser-scribe-pru_bin.h"
@@ -36,6 +40,9 @@
 // Target PRU
 #define PRU_NUM 0
 
+// Without interrupt, we look at the shared memory this often.
+static constexpr int kPollIntervalUsec = 1000;
+
 #if PRU_NUM == 0
 #  define PRU_DATARAM PRUSS0_PRU0_DATARAM
 #  define PRU_INSTRUCTIONRAM PRUSS0_PRU0_IRAM
@@ -57,6 +64,12 @@ bool UioPrussInterface::Init() {
     return false;
   }
   prussdrv_pruintc_init(&pruss_intc_initdata);
+
+  event_fd_ = prussdrv_pru_event_fd(PRU_EVTOUT_0);
+  if (event_fd_ < 0) {
+    fprintf(stderr, "No PRU interrupt fd (%s); polling instead.\n",
+            strerror(errno));
+  }
   return true;
 }
 
@@ -82,7 +95,23 @@ unsigned UioPrussInterface::WaitEvent() {
   return num_events;
 }
 
+bool UioPrussInterface::WaitEventFor(int timeout_ms) {
+  // Without the event fd, we poll: the caller looks at memory after each call.
+  const int64_t timeout_usec = 1000LL * timeout_ms;
+  usleep(std::min<int64_t>(timeout_usec, kPollIntervalUsec));
+  return false;
+}
+
+void UioPrussInterface::ClearEvent() {
+  // The uio device is readable now, so this does not block.
+  unsigned num_events;
+  if (read(event_fd_, &num_events, sizeof(num_events)) != sizeof(num_events))
+    return;
+  prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU_ARM_INTERRUPT);
+}
+
 bool UioPrussInterface::Shutdown() {
+  event_fd_ = -1;   // Owned by prussdrv.
   prussdrv_pru_disable(PRU_NUM);
   prussdrv_exit();
   return true;
@@ -17,13 +17,52 @@
  * along with LDGraphy.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef LDGRAPHY_UIO_PRUSS_INTERFACE_H
+#define LDGRAPHY_UIO_PRUSS_INTERFACE_H
+
 #include <stddef.h>
 
-class UioPrussInterface {
+// Interface to the PRU running laser-scribe-pru.p: the actual hardware or
+// an emulation of it.
+class PruInterface {
 public:
+  virtual ~PruInterface() {}
+  virtual bool Init() = 0;
+  virtual bool AllocateSharedMem(void **pru_mmap, const size_t size) = 0;
+  virtual bool StartExecution() = 0;
+  virtual unsigned WaitEvent() = 0;
+
+  // Wait at most "timeout_ms" for an event. Returns true if there was one,
+  // false on timeout; the caller then has to look at the shared memory, as
+  // the event might have been missed. Implementations that can't time out
+  // block until the next event. Only used if there is no EventFd().
+  virtual bool WaitEventFor(int /*timeout_ms*/) { WaitEvent(); return true; }
+
+  // File descriptor that becomes readable on events, so that the feeder can
+  // wait for it in its epoll loop. -1 if there is none.
+  virtual int EventFd() { return -1; }
+
+  // Acknowledge the event after EventFd() became readable.
+  virtual void ClearEvent() {}
+
+  virtual bool Shutdown() = 0;
+};
+
+class UioPrussInterface : public PruInterface {
+public:
+  UioPrussInterface() : event_fd_(-1) {}
+
   bool Init();
   bool AllocateSharedMem(void **pru_mmap, const size_t size);
   bool StartExecution();
   unsigned WaitEvent();
+  bool WaitEventFor(int timeout_ms);
+  int EventFd() { return event_fd_; }
+  void ClearEvent();
   bool Shutdown();
+
+private:
+  int event_fd_;   // uio device of the PRU interrupt; -1: polling.
 };
+
+#endif  // LDGRAPHY_UIO_PRUSS_INTERFACE_H